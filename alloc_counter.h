@@ -0,0 +1,83 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+// Heap allocation counting, so a coin cycle can be held to zero
+// allocations. The firmware feeds it from ESP-IDF's heap hooks (see HEAP in
+// hardware_functions.h). A host build defines ALLOC_COUNTER_WRAP and links
+// with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc; every allocation in
+// the process then lands in hostAllocs, and the caller checks the count
+// before and after a cycle, as tools/sensor_replay.cpp does. Kept free of
+// Arduino dependencies.
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct AllocCounter {
+    volatile uint32_t allocations;
+    volatile uint32_t bytes;
+};
+
+// Safe from any task
+inline void countAllocation(AllocCounter& counter, size_t size) {
+    __atomic_fetch_add(&counter.allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter.bytes, (uint32_t)size, __ATOMIC_RELAXED);
+}
+
+#ifdef ALLOC_COUNTER_WRAP
+#include <new>
+#include <stdlib.h>
+
+AllocCounter hostAllocs = {};
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    countAllocation(hostAllocs, size);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    countAllocation(hostAllocs, count * size);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    countAllocation(hostAllocs, size);
+    return __real_realloc(ptr, size);
+}
+}
+
+// A shared libstdc++ calls its own malloc, which --wrap can't reach
+void* operator new(size_t size) {
+    void* ptr = __wrap_malloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+#endif
+
+#endif // ALLOC_COUNTER_H
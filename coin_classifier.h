@@ -0,0 +1,119 @@
+#ifndef COIN_CLASSIFIER_H
+#define COIN_CLASSIFIER_H
+
+// Denomination classifier. Kept free of Arduino dependencies so the same
+// model can be benchmarked on the host (see tools/classifier_bench.cpp).
+
+#include <stdint.h>
+
+// ==================== DENOMINATIONS ====================
+enum CoinDenomination {
+    COIN_PENNY,
+    COIN_NICKEL,
+    COIN_DIME,
+    COIN_QUARTER,
+    COIN_HALF_DOLLAR,
+    COIN_DOLLAR,
+    COIN_UNKNOWN
+};
+
+#define NUM_COIN_CLASSES      6       // Classes in the model (excludes COIN_UNKNOWN)
+
+// ==================== FEATURES ====================
+// Cheap per-coin measurements: diameter from the ROI, mean colour of the
+// coin pixels and how long the coin blocked the optical sensor
+struct CoinFeatures {
+    uint16_t diameterPx;      // Full-frame pixels
+    uint8_t meanR, meanG, meanB;
+    uint16_t blockTimeMs;
+};
+
+#define NUM_COIN_FEATURES     5
+
+struct CoinPrediction {
+    CoinDenomination denomination;
+    uint8_t confidence;       // 0-100
+    uint32_t distance;        // Squared distance to the nearest prototype
+};
+
+// ==================== INT8 MODEL ====================
+// Each feature is quantized to int8 as (x - zero) * mul / div, then compared
+// against one int8 prototype per class. Retrain by refitting the prototypes
+// on the labelled corpus and re-running the host benchmark.
+const int16_t COIN_FEATURE_ZERO[NUM_COIN_FEATURES] = {230, 128, 128, 128, 19};
+const int8_t COIN_FEATURE_MUL[NUM_COIN_FEATURES]   = {1, 1, 1, 1, 4};
+const int8_t COIN_FEATURE_DIV[NUM_COIN_FEATURES]   = {2, 1, 1, 1, 1};
+
+const int8_t COIN_PROTOTYPES[NUM_COIN_CLASSES][NUM_COIN_FEATURES] = {
+    // diam,  R,   G,   B, block
+    {  -24,  42, -18, -48, -16 },  // Penny
+    {  -14,  22,  22,  17,  -8 },  // Nickel
+    {  -30,  27,  27,  22, -20 },  // Dime
+    {    0,  22,  22,  20,   0 },  // Quarter
+    {   30,  24,  24,  22,  20 },  // Half dollar
+    {   11,  52,  22, -43,   8 }   // Dollar
+};
+
+// Predictions farther than this from every prototype are reported as unknown
+#define COIN_REJECT_DISTANCE  2500
+
+const char* getDenominationName(CoinDenomination denomination) {
+    switch (denomination) {
+        case COIN_PENNY: return "PENNY";
+        case COIN_NICKEL: return "NICKEL";
+        case COIN_DIME: return "DIME";
+        case COIN_QUARTER: return "QUARTER";
+        case COIN_HALF_DOLLAR: return "HALF_DOLLAR";
+        case COIN_DOLLAR: return "DOLLAR";
+        default: return "UNKNOWN";
+    }
+}
+
+int8_t quantizeCoinFeature(int index, int32_t value) {
+    int32_t q = (value - COIN_FEATURE_ZERO[index]) * COIN_FEATURE_MUL[index] / COIN_FEATURE_DIV[index];
+    if (q < -128) return -128;
+    if (q > 127) return 127;
+    return (int8_t)q;
+}
+
+CoinPrediction classifyCoin(const CoinFeatures& features) {
+    int8_t x[NUM_COIN_FEATURES];
+    x[0] = quantizeCoinFeature(0, features.diameterPx);
+    x[1] = quantizeCoinFeature(1, features.meanR);
+    x[2] = quantizeCoinFeature(2, features.meanG);
+    x[3] = quantizeCoinFeature(3, features.meanB);
+    x[4] = quantizeCoinFeature(4, features.blockTimeMs);
+
+    uint32_t best = UINT32_MAX;
+    uint32_t second = UINT32_MAX;
+    int bestClass = 0;
+    for (int c = 0; c < NUM_COIN_CLASSES; c++) {
+        uint32_t distance = 0;
+        for (int i = 0; i < NUM_COIN_FEATURES; i++) {
+            int32_t d = (int32_t)x[i] - COIN_PROTOTYPES[c][i];
+            distance += (uint32_t)(d * d);
+        }
+        if (distance < best) {
+            second = best;
+            best = distance;
+            bestClass = c;
+        } else if (distance < second) {
+            second = distance;
+        }
+    }
+
+    CoinPrediction prediction;
+    prediction.distance = best;
+    if (best > COIN_REJECT_DISTANCE) {
+        prediction.denomination = COIN_UNKNOWN;
+        prediction.confidence = 0;
+        return prediction;
+    }
+
+    // Confidence from the margin between the two nearest prototypes
+    prediction.denomination = (CoinDenomination)bestClass;
+    prediction.confidence = (uint8_t)(100 - (100 * best) / (best + second + 1));
+    return prediction;
+}
+
+#endif // COIN_CLASSIFIER_H
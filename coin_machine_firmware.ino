@@ -9,10 +9,14 @@
  * - OV2640 camera for coin photography
  * - WS2812B LED lighting for photography
  * - RGB status indicator
+ * - On-device denomination classifier
  */
 
 #include "config.h"
 #include "hardware_functions.h"
+#include "state_table.h"
+#include "init_table.h"
+#include "photo_plans.h"
 
 // ==================== GLOBAL VARIABLES ====================
 // Hardware objects
@@ -20,315 +24,416 @@ Servo trapdoorServo;
 Servo flipperServo;
 CRGB cameraLEDs[NUM_CAMERA_LEDS];
 
-// State machine variables
-CoinMachineState currentState = STATE_INIT;
-CoinMachineState previousState = STATE_INIT;
-unsigned long stateStartTime = 0;
-unsigned long lastStateTime = 0;
-
-// Timing variables
-unsigned long trapdoorOpenTime = 0;
-unsigned long flipperMoveTime = 0;
-unsigned long photographSequenceTime = 0;
+// State machine (states and transitions live in state_table.h)
+CoinStateMachine stateMachine;
 
 // Processing variables
-bool processingCoin = false;
 int currentPhotoStep = 0;
-String currentImageFilename1 = "";
-String currentImageFilename2 = "";
+int currentShot = 0;
+bool shotNeedsSettle = false;
+unsigned long pendingMoveCount = 0;   // flipperMoveCount once the queued move has started
+
+// Photo plan; a console selection takes effect at the next coin
+uint8_t activePlan = DEFAULT_PHOTO_PLAN;
+uint8_t selectedPlan = DEFAULT_PHOTO_PLAN;
+
+// Per-coin record. Photography fills it in; it is written to storage
+// while the next coin waits in its detection window (see storeFinishedCoin())
+CoinRecord currentCoin;
+bool coinAwaitingStore = false;
+unsigned long coinsPhotographed = 0;
+unsigned long coinsRejected = 0;          // Each coin of a multiple drop counts
+
+// Throughput per photo plan, measured between coins leaving the flipper.
+// Only intervals where the next coin was already queued count, so idle
+// time between drops doesn't dilute the rate.
+struct PlanStats {
+    unsigned long coins;
+    unsigned long busyIntervals;
+    unsigned long busyTimeMs;
+    unsigned long lastFinishTime;
+    bool nextQueued;              // A coin was waiting when the last one finished
+};
+
+PlanStats planStats[PHOTO_PLAN_COUNT];
 
 // Error handling
 StatusCode lastError = STATUS_OK;
 int errorCount = 0;
 
+// Boot (see BOOT in hardware_functions.h)
+bool coldBoot = true;
+unsigned long bootTimeMs = 0;             // millis() when setup() finished
+InitResult initResults[INIT_STEP_COUNT];  // For the boot report
+unsigned long initTimeMs = 0;             // Wall time of all init steps together
+
+// Heap allocations by loop() per coin cycle (see HEAP in hardware_functions.h).
+// A cycle runs from one WAITING_FOR_COIN or COIN_DETECTED entry to the next.
+uint32_t cycleAllocMark = 0;
+uint32_t lastCycleAllocations = 0;
+unsigned long allocatingCycles = 0;
+
+// Control task timing: how long loop() works per pass, sleeps excluded
+unsigned long loopPasses = 0;
+unsigned long maxLoopPassUs = 0;
+
+// Last trace clock anchor from each core (see TRACE in hardware_functions.h)
+unsigned long loopTraceSyncMs = 0;
+unsigned long consoleTraceSyncMs = 0;
+
+// Console commands that need loop(): they drive hardware or the state machine
+struct ConsoleCommand {
+    char text[COMMAND_MAX_LENGTH];
+};
+
+SpscQueue<ConsoleCommand, COMMAND_QUEUE_SIZE> controlCommands;
+TaskHandle_t consoleTask = NULL;
+
 // ==================== SETUP FUNCTION ====================
 void setup() {
+    coldBoot = isColdBoot();
     Serial.begin(SERIAL_BAUD_RATE);
-    delay(1000);
+    if (coldBoot) {
+        delay(SERIAL_STARTUP_WAIT);
+    }
     
     DEBUG_PRINTLN("=== Automated Coin Machine Starting ===");
+    DEBUG_PRINT("Reset reason: ");
+    DEBUG_PRINT(getResetReasonName());
+    DEBUG_PRINTLN(coldBoot ? " (cold boot)" : " (fast boot)");
     DEBUG_PRINTLN("Initializing hardware...");
     
-    // Initialize all hardware components
-    bool initSuccess = true;
-    
-    if (!initializeStorage()) {
-        DEBUG_PRINTLN("ERROR: Storage initialization failed");
-        initSuccess = false;
-    }
+    // loop() is the control task; everything on core 0 yields to it
+    vTaskPrioritySet(NULL, CONTROL_TASK_PRIORITY);
     
-    if (!initializeCamera()) {
-        DEBUG_PRINTLN("ERROR: Camera initialization failed");
-        initSuccess = false;
-    }
+    // Initialize all hardware components, independent ones in parallel
+    unsigned long initStartMs = millis();
+    bool initSuccess = runInitSteps(COIN_MACHINE_INIT_STEPS, INIT_STEP_COUNT, initResults);
+    initTimeMs = millis() - initStartMs;
+    printInitReport(COIN_MACHINE_INIT_STEPS, INIT_STEP_COUNT, initResults, initTimeMs);
     
-    if (!initializeServos()) {
-        DEBUG_PRINTLN("ERROR: Servo initialization failed");
-        initSuccess = false;
-    }
+    stateMachine.begin(COIN_MACHINE_STATES, COIN_MACHINE_TRANSITIONS, NUM_COIN_MACHINE_TRANSITIONS,
+                       STATE_INIT, EVENT_TIMEOUT, millis());
+    stateMachine.onTransition(logTransition);
     
-    if (!initializeLEDs()) {
-        DEBUG_PRINTLN("ERROR: LED initialization failed");
-        initSuccess = false;
-    }
+    // The console runs even if initialization failed
+    startConsoleTask();
     
-    if (!initializeSensor()) {
-        DEBUG_PRINTLN("ERROR: Sensor initialization failed");
+    if (initSuccess && !performQuickSelfTest()) {
+        DEBUG_PRINTLN("ERROR: Self-test failed");
         initSuccess = false;
     }
     
     // Check initialization results
     if (!initSuccess) {
-        currentState = STATE_ERROR;
-        setStatusLED(LED_ERROR);
+        stateMachine.dispatch(EVENT_FAULT, millis());
         DEBUG_PRINTLN("FATAL: Hardware initialization failed");
         return;
     }
     
-    // Perform system test
-    DEBUG_PRINTLN("Performing system test...");
-    performSystemTest();
+    // The actuator test takes ~7 s; 'test' runs it on demand
+    if (coldBoot) {
+        DEBUG_PRINTLN("Performing system test...");
+        performSystemTest();
+    }
     
-    // Clean up old images
-    cleanupOldImages();
+    // Lock exposure and white balance for this session. A fast boot reuses
+    // the stored lock; the lighting hasn't changed since a moment ago.
+    bool exposureLoaded = !coldBoot && loadExposureLock();
+    if (!exposureLoaded && !calibrateCameraExposure()) {
+        loadExposureLock();
+    }
     
-    // Initialize state machine
-    changeState(STATE_WAITING_FOR_COIN);
+    // Old images are cleaned up by the storage task
+    updateImageQuality();
     
-    DEBUG_PRINTLN("=== System Ready ===");
+    // Start the state machine; from here on loop() should not allocate
+    cycleAllocMark = controlAllocs.allocations;
+    stateMachine.dispatch(EVENT_START, millis());
+    
+    bootTimeMs = millis();
+    DEBUG_PRINT("=== System Ready in ");
+    DEBUG_PRINT(bootTimeMs);
+    DEBUG_PRINTLN("ms ===");
     DEBUG_PRINTLN("Waiting for coins...");
 }
 
+// The servos only wait to reach home on a cold boot
+bool initializeServosStep() {
+    return initializeServos(coldBoot);
+}
+
 // ==================== MAIN LOOP ====================
 void loop() {
+    unsigned long passStart = micros();
     unsigned long currentTime = millis();
     
-    // Update state timing
-    unsigned long timeInState = currentTime - stateStartTime;
+    // Queued coins wake the machine; only WAITING_FOR_COIN reacts
+    if (hasQueuedCoin()) {
+        stateMachine.dispatch(EVENT_COIN_SENSED, currentTime);
+    }
     
-    // Handle timeout protection
-    if (timeInState > RESET_TIMEOUT) {
-        DEBUG_PRINTLN("WARNING: State timeout, performing reset");
-        handleError(STATUS_TIMEOUT_ERROR);
-        return;
+    // Completion events from timer wheel actions
+    uint8_t event;
+    while (takeTimerEvent(&event)) {
+        stateMachine.dispatch(event, currentTime);
+    }
+    if (takeChuteClear()) {
+        stateMachine.dispatch(EVENT_CHUTE_CLEAR, currentTime);
     }
     
-    // State machine dispatcher
-    switch (currentState) {
-        case STATE_INIT:
-            // Should not reach here after setup
-            changeState(STATE_WAITING_FOR_COIN);
-            break;
-            
-        case STATE_WAITING_FOR_COIN:
-            handleWaitingForCoin();
-            break;
-            
-        case STATE_COIN_DETECTED:
-            handleCoinDetected();
-            break;
-            
-        case STATE_PROCESSING:
-            handleProcessing();
-            break;
-            
-        case STATE_PHOTOGRAPHING:
-            handlePhotographing();
-            break;
-            
-        case STATE_REJECTING:
-            handleRejecting();
-            break;
-            
-        case STATE_ERROR:
-            handleError(lastError);
-            break;
-            
-        default:
-            DEBUG_PRINTLN("ERROR: Unknown state");
-            changeState(STATE_ERROR);
-            break;
+    // The reject cycle's timed steps
+    runTrapdoorCycle(currentTime);
+    
+    // Images the storage task could not write
+    if (!collectImageSaves()) {
+        lastError = STATUS_STORAGE_ERROR;
+        stateMachine.dispatch(EVENT_FAULT, currentTime);
     }
     
-    // Process serial commands for debugging
-    processSerialCommands();
+    // State timeouts, the current state's tick, then anything it posted
+    stateMachine.update(currentTime);
     
-    // Small delay to prevent excessive CPU usage
-    delay(10);
+    // Hardware commands passed on by the console task
+    runControlCommands();
+    traceSyncIfDue(loopTraceSyncMs);
+    
+    unsigned long passUs = micros() - passStart;
+    loopPasses++;
+    maxLoopPassUs = max(maxLoopPassUs, passUs);
+    histogramAdd(loopPassHistogram, passUs);
+    
+    // Sleep until the sensor or a timer action wakes us, the state times
+    // out, or LOOP_IDLE_MS passes for the console and camera polling
+    waitForWork(min((unsigned long)LOOP_IDLE_MS, stateMachine.timeUntilTimeout(millis())));
 }
 
 // ==================== STATE HANDLERS ====================
 
-void handleWaitingForCoin() {
+void enterWaitingForCoin() {
     // Set ready status
     setStatusLED(LED_READY);
-    
-    // Check for sensor trigger
-    if (isSensorTriggered()) {
-        DEBUG_PRINTLN("Coin detected!");
-        changeState(STATE_COIN_DETECTED);
-        clearSensorTrigger();
-    }
+    storeFinishedCoin();
+    checkCycleAllocations();
+    lastError = STATUS_OK;
 }
 
-void handleCoinDetected() {
+// Waits out the front queued coin's detection window, which may already
+// have passed while it sat in the chute behind the previous coin. The
+// COIN_DETECTED rows in state_table.h then pick one of the actions below.
+void enterCoinDetected() {
     setStatusLED(LED_PROCESSING);
-    
-    unsigned long timeInState = millis() - stateStartTime;
-    
-    // Wait for the detection window to complete
-    if (timeInState >= MULTI_COIN_TIMEOUT) {
-        // Check if multiple coins were detected
-        if (isMultipleCoinDetected()) {
-            DEBUG_PRINTLN("Multiple coins detected - rejecting");
-            changeState(STATE_REJECTING);
-            lastError = STATUS_MULTIPLE_COINS;
-        } else {
-            DEBUG_PRINTLN("Single coin detected - processing");
-            changeState(STATE_PROCESSING);
-        }
-        resetSensorCount();
+    // A reject cycle may still be holding the trapdoor open for the last coin
+    endTrapdoorHold();
+    scheduleAfter(getDetectionWindowRemaining() * 1000UL, postWindowClosed, 0);
+    storeFinishedCoin();
+    checkCycleAllocations();
+}
+
+void exitCoinDetected() {
+    cancelTimerAction(postWindowClosed);
+}
+
+void postWindowClosed(uint32_t) {
+    postTimerEvent(EVENT_WINDOW_CLOSED);
+}
+
+void rejectMultipleCoins() {
+    LOG_EVENT(LOG_MULTIPLE_COINS);
+    lastError = STATUS_MULTIPLE_COINS;
+    // The coins that dropped together go out together
+    coinsRejected += getCoinsInWindow();
+    coinQueueDrop(coinQueue, getCoinsInWindow());
+    requestTelemetry();
+    if (TRACE_DUMP_ON_REJECT) {
+        requestTraceDump("multiple coins");
     }
 }
 
-void handleProcessing() {
+void rejectStorageFull() {
+    // Pass the coin through rather than delete earlier photos
+    LOG_EVENT(LOG_STORAGE_FULL);
+    lastError = STATUS_STORAGE_ERROR;
+    coinsRejected++;
+    coinQueueDrop(coinQueue, 1);
+    requestTelemetry();
+    if (TRACE_DUMP_ON_REJECT) {
+        requestTraceDump("storage full");
+    }
+}
+
+void acceptCoin() {
+    LOG_EVENT(LOG_COIN_ACCEPTED);
+    startCoinRecord();
+    coinQueueDrop(coinQueue, 1);
+}
+
+// Brief settling time (COIN_SETTLE_TIME) before photography starts
+void enterProcessing() {
     setStatusLED(LED_PROCESSING);
-    
-    // Check for additional coins during processing
-    if (isSensorTriggered()) {
-        DEBUG_PRINTLN("Additional coin detected during processing - rejecting");
-        clearSensorTrigger();
-        resetSensorCount();
-        changeState(STATE_REJECTING);
-        lastError = STATUS_COIN_DURING_PROCESSING;
-        return;
+}
+
+void enterPhotographing() {
+    setStatusLED(LED_BUSY);
+    LOG_EVENT(LOG_PHOTO_START, LOG_STR(PHOTO_PLANS[activePlan].name));
+    TRACE(TRACE_PHOTOS_BEGIN, currentCoin.id);
+    currentPhotoStep = PHOTO_MOVE;
+    currentShot = 0;
+    shotNeedsSettle = queueFlipperMove(PHOTO_PLANS[activePlan].shots[0].angle, 0);
+}
+
+// Move the flipper delayMs from now, on the timer wheel so the move starts
+// on time whatever loop() is doing. Returns false if it is already there.
+bool queueFlipperMove(int angle, unsigned long delayMs) {
+    if (angle == flipperAngle) {
+        return false;
     }
-    
-    unsigned long timeInState = millis() - stateStartTime;
-    
-    // Brief settling time before starting photography
-    if (timeInState >= 500) {
-        DEBUG_PRINTLN("Starting photography sequence");
-        changeState(STATE_PHOTOGRAPHING);
-        currentPhotoStep = 0;
+    LOG_EVENT(LOG_FLIPPER_QUEUED, angle);
+    pendingMoveCount = flipperMoveCount + 1;
+    if (delayMs == 0 || !scheduleAfter(delayMs * 1000UL, moveFlipperAction, angle)) {
+        setFlipperPosition(angle);
+    }
+    return true;
+}
+
+void switchPhotoPlan() {
+    if (selectedPlan != activePlan) {
+        activePlan = selectedPlan;
+        // The previous coin ran another plan; don't count the gap
+        planStats[activePlan].nextQueued = false;
     }
 }
 
+// Runs the active photo plan's shots, then returns the flipper home. Each
+// move is queued on the timer wheel FLIPPER_PHOTO_DELAY after the previous
+// capture; this only waits for it.
 void handlePhotographing() {
-    setStatusLED(LED_BUSY);
-    
-    unsigned long timeInState = millis() - stateStartTime;
+    const PhotoPlan& plan = PHOTO_PLANS[activePlan];
+    const PhotoShot& shot = plan.shots[currentShot < plan.shotCount ? currentShot : 0];
     
     switch (currentPhotoStep) {
-        case 0: // Move flipper to first position (90 degrees)
-            DEBUG_PRINTLN("Moving flipper to first position");
-            moveFlipperToSide1();
-            flipperMoveTime = millis();
-            currentPhotoStep = 1;
-            break;
+        case PHOTO_MOVE: // Wait for the queued move to the shot's angle to start
+            if (shotNeedsSettle && flipperMoveCount != pendingMoveCount) {
+                break;
+            }
+            currentPhotoStep = PHOTO_SHOOT;
+            if (shotNeedsSettle) {
+                TRACE(TRACE_SETTLE_BEGIN, currentShot, shot.settle);
+            }
+            // fall through
             
-        case 1: // Wait for flipper to reach position, then take first photo
-            if (millis() - flipperMoveTime >= SERVO_MOVE_DELAY) {
-                DEBUG_PRINTLN("Taking first photo");
-                currentImageFilename1 = generateImageFilename();
-                
-                if (captureAndSaveImage(currentImageFilename1.c_str())) {
-                    DEBUG_PRINTLN("First photo captured successfully");
-                    currentPhotoStep = 2;
-                    flipperMoveTime = millis();
-                } else {
-                    DEBUG_PRINTLN("ERROR: First photo capture failed");
-                    handleError(STATUS_CAMERA_ERROR);
-                    return;
+        case PHOTO_SHOOT: // Wait for flipper to reach position, then take the photo
+            if (shotNeedsSettle) {
+                if (!isFlipperSettled(shot.settle)) {
+                    break;
                 }
+                TRACE(TRACE_SETTLE_END, lastSettleMs);
+                LOG_EVENT(LOG_FLIPPER_SETTLED, lastSettleMs);
+                shotNeedsSettle = false;
             }
-            break;
             
-        case 2: // Move flipper to second position (180 degrees)
-            if (millis() - flipperMoveTime >= FLIPPER_PHOTO_DELAY) {
-                DEBUG_PRINTLN("Moving flipper to second position");
-                moveFlipperToSide2();
-                flipperMoveTime = millis();
-                currentPhotoStep = 3;
+            // The storage task still holds the frames it may; it wakes us
+            // when it hands one back
+            if (!isCaptureFrameFree()) {
+                break;
             }
-            break;
             
-        case 3: // Wait for flipper to reach position, then take second photo
-            if (millis() - flipperMoveTime >= SERVO_MOVE_DELAY) {
-                DEBUG_PRINTLN("Taking second photo");
-                currentImageFilename2 = generateImageFilename();
-                
-                if (captureAndSaveImage(currentImageFilename2.c_str())) {
-                    DEBUG_PRINTLN("Second photo captured successfully");
-                    currentPhotoStep = 4;
-                    flipperMoveTime = millis();
-                } else {
-                    DEBUG_PRINTLN("ERROR: Second photo capture failed");
-                    handleError(STATUS_CAMERA_ERROR);
+            LOG_EVENT(LOG_PHOTO_TAKING, currentShot + 1, plan.shotCount);
+            {
+                TRACE(TRACE_CAPTURE_BEGIN, currentShot, shot.lights);
+                char filename[IMAGE_FILENAME_MAX];
+                generateImageFilename(filename, sizeof(filename));
+                applyExposurePreset(shot.exposure);
+                bool captured = captureAndSaveImage(filename, shot.lights,
+                                                    currentShot == 0 ? currentCoin.id : 0);
+                TRACE(TRACE_CAPTURE_END, captured);
+                if (!captured) {
+                    LOG_EVENT(LOG_CAPTURE_FAILED);
+                    lastError = STATUS_CAMERA_ERROR;
+                    stateMachine.post(EVENT_FAULT);
                     return;
                 }
+                currentCoin.stackTimeMs += lastStackTimeMs;
+                if (currentShot == 0) {
+                    strlcpy(currentCoin.image1, filename, sizeof(currentCoin.image1));
+                } else if (currentShot == 1) {
+                    strlcpy(currentCoin.image2, filename, sizeof(currentCoin.image2));
+                } else {
+                    if (currentCoin.extraImages[0] != '\0') {
+                        strlcat(currentCoin.extraImages, ";", sizeof(currentCoin.extraImages));
+                    }
+                    strlcat(currentCoin.extraImages, filename, sizeof(currentCoin.extraImages));
+                }
             }
-            break;
             
-        case 4: // Return flipper to home position
-            if (millis() - flipperMoveTime >= FLIPPER_PHOTO_DELAY) {
-                DEBUG_PRINTLN("Returning flipper to home position");
-                moveFlipperHome();
-                flipperMoveTime = millis();
-                currentPhotoStep = 5;
+            // Give the capture FLIPPER_PHOTO_DELAY before the next move
+            currentShot++;
+            if (currentShot < plan.shotCount) {
+                shotNeedsSettle = queueFlipperMove(plan.shots[currentShot].angle, FLIPPER_PHOTO_DELAY);
+                currentPhotoStep = PHOTO_MOVE;
+            } else {
+                LOG_EVENT(LOG_FLIPPER_HOMING);
+                applyExposurePreset(EXPOSURE_SESSION);
+                queueFlipperMove(FLIPPER_HOME, FLIPPER_PHOTO_DELAY);
+                currentPhotoStep = PHOTO_FINISH;
             }
             break;
             
-        case 5: // Wait for flipper to reach home, then complete
-            if (millis() - flipperMoveTime >= SERVO_MOVE_DELAY) {
-                DEBUG_PRINTLN("Photography sequence complete");
-                DEBUG_PRINT("Images saved: ");
-                DEBUG_PRINT(currentImageFilename1);
-                DEBUG_PRINT(", ");
-                DEBUG_PRINTLN(currentImageFilename2);
+        case PHOTO_FINISH: // Wait for the flipper to get home; the storage task classifies
+            if (flipperMoveCount == pendingMoveCount && isFlipperSettled(SETTLE_TIMED)) {
+                // Filenames are in the coin's record
+                LOG_EVENT(LOG_PHOTOS_DONE, currentCoin.id, plan.shotCount);
+                TRACE(TRACE_PHOTOS_END, currentCoin.id);
+                histogramAdd(coinCycleHistogram, millis() - currentCoin.detectedAt);
+                requestTelemetry();
+                
+                // The flipper is free; the record is stored while the next
+                // coin is admitted
+                coinAwaitingStore = true;
+                recordThroughput(millis());
                 
                 // Reset for next coin
-                currentPhotoStep = 0;
-                changeState(STATE_WAITING_FOR_COIN);
+                currentPhotoStep = PHOTO_MOVE;
+                stateMachine.post(EVENT_PHOTOS_DONE);
             }
             break;
     }
-    
-    // Timeout protection for photography sequence
-    if (timeInState > PROCESSING_TIMEOUT) {
-        DEBUG_PRINTLN("ERROR: Photography sequence timeout");
-        handleError(STATUS_TIMEOUT_ERROR);
+}
+
+// Photography ran past PROCESSING_TIMEOUT
+void failWithTimeout() {
+    LOG_EVENT(LOG_PHOTO_TIMEOUT);
+    lastError = STATUS_TIMEOUT_ERROR;
+    if (TRACE_DUMP_ON_ERROR) {
+        requestTraceDump("photo timeout");
     }
 }
 
-void handleRejecting() {
+// Open trapdoor immediately when entering rejection state; its timer
+// closes it again without holding up the machine
+void enterRejecting() {
     setStatusLED(LED_ERROR);
-    
-    unsigned long timeInState = millis() - stateStartTime;
-    
-    // Open trapdoor immediately when entering rejection state
-    if (timeInState < 100) {
-        DEBUG_PRINTLN("Opening rejection trapdoor");
-        openTrapdoor();
-        trapdoorOpenTime = millis();
-    }
-    
-    // Close trapdoor after specified time
-    if (timeInState >= TRAPDOOR_OPEN_TIME) {
-        DEBUG_PRINTLN("Closing rejection trapdoor");
-        closeTrapdoor();
-        
-        // Wait a bit more for trapdoor to close, then return to waiting
-        if (timeInState >= TRAPDOOR_OPEN_TIME + 1000) {
-            DEBUG_PRINTLN("Rejection complete, ready for next coin");
-            changeState(STATE_WAITING_FOR_COIN);
-        }
+    LOG_EVENT(LOG_TRAPDOOR_OPENING);
+    startRejectCycle();
+    watchChute();
+}
+
+void exitRejecting() {
+    stopWatchingChute();
+}
+
+void enterError() {
+    setStatusLED(LED_ERROR);
+    if (TRACE_DUMP_ON_ERROR) {
+        requestTraceDump("error");
     }
 }
 
+void handleErrorState() {
+    handleError(lastError);
+}
+
 void handleError(StatusCode error) {
-    setStatusLED(LED_ERROR);
-    
     static unsigned long lastErrorReport = 0;
     unsigned long currentTime = millis();
     
@@ -364,43 +469,114 @@ void handleError(StatusCode error) {
         DEBUG_PRINTLN("Attempting system recovery...");
         systemReset();
         errorCount = 0;
-        changeState(STATE_WAITING_FOR_COIN);
+        stateMachine.post(EVENT_RECOVERED);
     }
 }
 
-// ==================== UTILITY FUNCTIONS ====================
+// ==================== CLASSIFICATION ====================
+
+void startCoinRecord() {
+    const QueuedCoin& coin = coinQueueFront(coinQueue);
+    currentCoin = CoinRecord();
+    currentCoin.id = ++coinsPhotographed;
+    currentCoin.detectedAt = coin.sensedAt;
+    currentCoin.queueMs = millis() - coin.sensedAt;
+    currentCoin.features.blockTimeMs = coin.blockTimeMs;
+    currentCoin.prediction.denomination = COIN_UNKNOWN;
+    currentCoin.prediction.confidence = 0;
+    currentCoin.classified = false;
+    currentCoin.jpegQuality = imageQuality.quality;
+    switchPhotoPlan();
+    currentCoin.plan = PHOTO_PLANS[activePlan].name;
+    currentCoin.frameWidth = getCaptureFrameWidth();
+}
+
+// ==================== COIN PIPELINE ====================
 
-void changeState(CoinMachineState newState) {
-    if (newState != currentState) {
-        previousState = currentState;
-        currentState = newState;
-        stateStartTime = millis();
-        
-        DEBUG_PRINT("State change: ");
-        DEBUG_PRINT(getStateName(previousState));
-        DEBUG_PRINT(" -> ");
-        DEBUG_PRINTLN(getStateName(currentState));
-        
-        // Reset variables when changing states
-        if (newState == STATE_WAITING_FOR_COIN) {
-            processingCoin = false;
-            resetSensorCount();
-            lastError = STATUS_OK;
+// Hand the last photographed coin to the storage task, which classifies
+// it and writes its record. Runs on entry to the states that follow
+// photography, before the next coin reuses currentCoin.
+void storeFinishedCoin() {
+    if (!coinAwaitingStore) {
+        return;
+    }
+    coinAwaitingStore = false;
+    queueFinishedCoin(currentCoin);
+    updateImageQuality();
+}
+
+void recordThroughput(unsigned long now) {
+    PlanStats& stats = planStats[activePlan];
+    if (stats.nextQueued) {
+        stats.busyIntervals++;
+        stats.busyTimeMs += now - stats.lastFinishTime;
+    }
+    stats.coins++;
+    stats.lastFinishTime = now;
+    stats.nextQueued = hasQueuedCoin();
+}
+
+// Sustained coins per minute with the given plan while coins were waiting
+unsigned long getPlanCoinsPerMinute(uint8_t plan) {
+    const PlanStats& stats = planStats[plan];
+    if (stats.busyTimeMs == 0) {
+        return 0;
+    }
+    return stats.busyIntervals * 60000UL / stats.busyTimeMs;
+}
+
+void printPhotoPlans() {
+    DEBUG_PRINTLN("=== Photo Plans ===");
+    for (uint8_t p = 0; p < PHOTO_PLAN_COUNT; p++) {
+        DEBUG_PRINT(p == selectedPlan ? "* " : "  ");
+        DEBUG_PRINT(PHOTO_PLANS[p].name);
+        DEBUG_PRINT(": ");
+        DEBUG_PRINT(PHOTO_PLANS[p].shotCount);
+        DEBUG_PRINT(" shots, ");
+        DEBUG_PRINT(planStats[p].coins);
+        DEBUG_PRINT(" coins, ");
+        DEBUG_PRINT(getPlanCoinsPerMinute(p));
+        DEBUG_PRINT(" coins/min");
+        if (planStats[p].busyIntervals > 0) {
+            DEBUG_PRINT(" (");
+            DEBUG_PRINT(planStats[p].busyTimeMs / planStats[p].busyIntervals);
+            DEBUG_PRINT("ms/coin)");
         }
+        DEBUG_PRINTLN("");
     }
+    DEBUG_PRINTLN("==================");
 }
 
-const char* getStateName(CoinMachineState state) {
-    switch (state) {
-        case STATE_INIT: return "INIT";
-        case STATE_WAITING_FOR_COIN: return "WAITING_FOR_COIN";
-        case STATE_COIN_DETECTED: return "COIN_DETECTED";
-        case STATE_PROCESSING: return "PROCESSING";
-        case STATE_PHOTOGRAPHING: return "PHOTOGRAPHING";
-        case STATE_REJECTING: return "REJECTING";
-        case STATE_ERROR: return "ERROR";
-        default: return "UNKNOWN";
+bool selectPhotoPlan(const char* name) {
+    for (uint8_t p = 0; p < PHOTO_PLAN_COUNT; p++) {
+        if (strcmp(name, PHOTO_PLANS[p].name) == 0) {
+            selectedPlan = p;
+            return true;
+        }
     }
+    return false;
+}
+
+// ==================== UTILITY FUNCTIONS ====================
+
+// Closes the current coin cycle; any allocation in it is a regression
+void checkCycleAllocations() {
+    uint32_t allocations = controlAllocs.allocations;
+    lastCycleAllocations = allocations - cycleAllocMark;
+    cycleAllocMark = allocations;
+    if (lastCycleAllocations > 0) {
+        allocatingCycles++;
+        LOG_EVENT(LOG_CYCLE_ALLOCATED, lastCycleAllocations);
+    }
+}
+
+void logTransition(uint8_t from, uint8_t to, uint8_t) {
+    TRACE(TRACE_STATE, to, from);
+    LOG_EVENT(LOG_STATE_CHANGE, LOG_STR(getStateName(from)), LOG_STR(getStateName(to)));
+}
+
+const char* getStateName(uint8_t state) {
+    return stateMachine.stateName(state);
 }
 
 // ==================== INTERRUPT HANDLERS ====================
@@ -410,39 +586,496 @@ const char* getStateName(CoinMachineState state) {
 void printSystemStatus() {
     DEBUG_PRINTLN("=== System Status ===");
     DEBUG_PRINT("Current State: ");
-    DEBUG_PRINTLN(getStateName(currentState));
+    DEBUG_PRINTLN(getStateName(stateMachine.current()));
+    DEBUG_PRINT("Boot: ");
+    DEBUG_PRINT(coldBoot ? "cold" : "fast");
+    DEBUG_PRINT(", ");
+    DEBUG_PRINT(getResetReasonName());
+    DEBUG_PRINT(", ready in ");
+    DEBUG_PRINT(bootTimeMs);
+    DEBUG_PRINTLN("ms");
     DEBUG_PRINT("Time in State: ");
-    DEBUG_PRINT(millis() - stateStartTime);
+    DEBUG_PRINT(stateMachine.timeInState(millis()));
     DEBUG_PRINTLN("ms");
     DEBUG_PRINT("Sensor Trigger Count: ");
     DEBUG_PRINTLN(getSensorTriggerCount());
+    DEBUG_PRINT("Coins Queued: ");
+    DEBUG_PRINT(coinQueueCount(coinQueue));
+    DEBUG_PRINT(" (");
+    DEBUG_PRINT(coinQueue.dropped);
+    DEBUG_PRINTLN(" dropped, queue full)");
+    DEBUG_PRINT("Photo Plan: ");
+    DEBUG_PRINT(PHOTO_PLANS[activePlan].name);
+    DEBUG_PRINT(", ");
+    DEBUG_PRINT(getPlanCoinsPerMinute(activePlan));
+    DEBUG_PRINTLN(" coins/min");
+    DEBUG_PRINT("Coins Photographed: ");
+    DEBUG_PRINTLN(coinsPhotographed);
+    DEBUG_PRINT("Coins Stored: ");
+    DEBUG_PRINTLN(coinsStored);
+    DEBUG_PRINT("Last Denomination: ");
+    DEBUG_PRINT(getDenominationName(lastPrediction.denomination));
+    DEBUG_PRINT(" (classified in ");
+    DEBUG_PRINT(lastClassifyTimeUs);
+    DEBUG_PRINTLN("us)");
+    DEBUG_PRINT("JPEG Quality: ");
+    DEBUG_PRINT(imageQuality.quality);
+    DEBUG_PRINT(" (frame width ");
+    DEBUG_PRINT(getCaptureFrameWidth());
+    DEBUG_PRINT(", budget ");
+    DEBUG_PRINT(imageQuality.budgetBytes);
+    DEBUG_PRINTLN(" bytes)");
+    if (STACK_FRAMES > 1) {
+        DEBUG_PRINT("Stacking: ");
+        DEBUG_PRINT(STACK_FRAMES);
+        DEBUG_PRINT(" frames, +");
+        DEBUG_PRINT(currentCoin.stackTimeMs);
+        DEBUG_PRINTLN("ms on last coin");
+    }
+    DEBUG_PRINT("Flipper Timing: ");
+    if (flipperTiming.calibrated) {
+        DEBUG_PRINT(flipperTiming.baseMs);
+        DEBUG_PRINT("ms + ");
+        DEBUG_PRINT(flipperTiming.perDegreeUs);
+        DEBUG_PRINTLN("us/deg");
+    } else {
+        DEBUG_PRINTLN("fixed");
+    }
+    DEBUG_PRINT("Exposure: ");
+    if (exposureLock.locked) {
+        DEBUG_PRINT("locked, AEC ");
+        DEBUG_PRINT(exposureLock.aec);
+        DEBUG_PRINT(", gain ");
+        DEBUG_PRINTLN(exposureLock.gain);
+    } else {
+        DEBUG_PRINTLN("auto");
+    }
+    DEBUG_PRINT("Storage Used: ");
+    DEBUG_PRINT(SPIFFS.usedBytes());
+    DEBUG_PRINT(" / ");
+    DEBUG_PRINTLN(SPIFFS.totalBytes());
+    DEBUG_PRINT("Reject Cycles: ");
+    DEBUG_PRINT(trapdoorCycles);
+    DEBUG_PRINTLN(isTrapdoorIdle() ? "" : " (trapdoor cycling)");
+    DEBUG_PRINT("Output Writes: ");
+    DEBUG_PRINT(outputs.writes);
+    DEBUG_PRINT(" (");
+    DEBUG_PRINT(outputs.skipped);
+    DEBUG_PRINTLN(" unchanged skipped)");
+    DEBUG_PRINT("Timed Actions: ");
+    DEBUG_PRINT(timerActionsRun);
+    DEBUG_PRINT(" (late avg ");
+    DEBUG_PRINT(timerAvgLateUs);
+    DEBUG_PRINT("us, max ");
+    DEBUG_PRINT(timerMaxLateUs);
+    DEBUG_PRINT("us");
+    if (timerEventsDropped > 0) {
+        DEBUG_PRINT(", ");
+        DEBUG_PRINT(timerEventsDropped);
+        DEBUG_PRINT(" events dropped");
+    }
+    DEBUG_PRINTLN(")");
     DEBUG_PRINT("Error Count: ");
     DEBUG_PRINTLN(errorCount);
+    if (TELEMETRY_ENABLED) {
+        // Share of one core spent on telemetry since boot
+        unsigned long uptimeUs = millis() * 1000UL;
+        DEBUG_PRINTF("Telemetry: %lu frames, build %luus, send %luus (%.3f%% CPU incl. UART waits)\n",
+                     (unsigned long)telemetrySequence,
+                     telemetrySequence ? telemetryBuildUs / telemetrySequence : 0,
+                     telemetrySequence ? telemetrySendUs / telemetrySequence : 0,
+                     uptimeUs ? 100.0 * (telemetryBuildUs + telemetrySendUs) / uptimeUs : 0.0);
+    }
     DEBUG_PRINT("Free Heap: ");
-    DEBUG_PRINTLN(ESP.getFreeHeap());
+    DEBUG_PRINT(ESP.getFreeHeap());
+    DEBUG_PRINT(" (largest block ");
+    DEBUG_PRINT(ESP.getMaxAllocHeap());
+    DEBUG_PRINTLN("; 'mem' for history)");
+    DEBUG_PRINT("Heap Allocations: ");
+    if (ALLOC_COUNTING) {
+        DEBUG_PRINT(controlAllocs.allocations);
+        DEBUG_PRINT(" control (");
+        DEBUG_PRINT(allocatingCycles);
+        DEBUG_PRINT(" coin cycles allocated, last ");
+        DEBUG_PRINT(lastCycleAllocations);
+        DEBUG_PRINT("), ");
+        DEBUG_PRINT(otherAllocs.allocations);
+        DEBUG_PRINTLN(" other tasks");
+    } else {
+        DEBUG_PRINTLN("not counted (needs CONFIG_HEAP_USE_HOOKS)");
+    }
     DEBUG_PRINTLN("==================");
 }
 
-// Optional: Add serial command processing for debugging
+// Heap, PSRAM and stacks now, then the sample ring oldest first. Falling
+// free memory is a leak; a largest block falling faster is fragmentation.
+void printMemoryStats() {
+    MemorySample now;
+    readMemory(now);
+    
+    DEBUG_PRINTLN("=== Memory ===");
+    DEBUG_PRINTF("Heap: %u free, %u lowest ever, %u largest block\n",
+                 (unsigned)now.freeHeap, (unsigned)now.minFreeHeap, (unsigned)now.largestBlock);
+    if (psramFound()) {
+        DEBUG_PRINTF("PSRAM: %u free of %u, %u lowest ever, %u largest block\n",
+                     (unsigned)now.freePsram, (unsigned)ESP.getPsramSize(),
+                     (unsigned)ESP.getMinFreePsram(), (unsigned)now.largestPsramBlock);
+    } else {
+        DEBUG_PRINTLN("PSRAM: none");
+    }
+    DEBUG_PRINTF("Frame buffer needs %u, largest block for it %u%s\n", (unsigned)MEM_LOW_BLOCK_BYTES,
+                 (unsigned)frameBufferBlock(now), frameBufferBlock(now) < MEM_LOW_BLOCK_BYTES ? " LOW" : "");
+    DEBUG_PRINTF("Frame buffers in %s, scratch in %s: %u of %u bytes at most, %u coins, %u too big\n",
+                 getPlacementName(placeInPsram(FRAME_BUFFER_PLACEMENT)), getPlacementName(classifierScratchPsram),
+                 (unsigned)classifierScratch.highWater, (unsigned)classifierScratch.size(),
+                 (unsigned)classifierScratch.resets, (unsigned)classifierScratch.failures);
+    DEBUG_PRINT("Stack free:");
+    for (uint8_t t = 0; t < MEM_STACK_TASKS; t++) {
+        DEBUG_PRINTF(" %s %u", MEM_STACK_TASK_NAMES[t], (unsigned)now.stackFree[t]);
+    }
+    DEBUG_PRINTLN("");
+    
+    uint8_t kept = memorySamplesKept();
+    DEBUG_PRINTF("History (every %us, oldest first):\n", (unsigned)(MEM_SAMPLE_INTERVAL / 1000));
+    DEBUG_PRINTLN("  time_s    free  lowest   block   psram  pblock  loop  stor  cons");
+    for (uint8_t i = 0; i < kept; i++) {
+        const MemorySample& s = memorySampleAt(i);
+        DEBUG_PRINTF("%8u %7u %7u %7u %7u %7u %5u %5u %5u\n",
+                     (unsigned)s.timeS, (unsigned)s.freeHeap, (unsigned)s.minFreeHeap,
+                     (unsigned)s.largestBlock, (unsigned)s.freePsram, (unsigned)s.largestPsramBlock,
+                     (unsigned)s.stackFree[0], (unsigned)s.stackFree[1], (unsigned)s.stackFree[2]);
+    }
+    if (kept > 1) {
+        const MemorySample& first = memorySampleAt(0);
+        DEBUG_PRINTF("Since %us: free %+ld, largest block %+ld\n", (unsigned)first.timeS,
+                     (long)now.freeHeap - (long)first.freeHeap,
+                     (long)now.largestBlock - (long)first.largestBlock);
+    }
+    DEBUG_PRINTLN("==================");
+}
+
+// The trace ring, oldest event first, for tools/trace_to_chrome.py. One
+// line per event: sequence, core, cycles, phase, name, then its arguments
+// by name. Recording stays paused from requestTraceDump() until the end.
+void printTrace() {
+    uint32_t end = traceNext;
+    uint32_t kept = traceEventsKept();
+    DEBUG_PRINTF("=== Trace: %u events, %u MHz, %s ===\n", (unsigned)kept,
+                 (unsigned)getCpuFrequencyMhz(), traceDumpReason);
+    for (uint32_t i = end - kept; i != end; i++) {
+        const TraceEvent& event = traceRing[i & (TRACE_RING_SIZE - 1)];
+        if (event.id >= TRACE_ID_COUNT) {
+            continue;
+        }
+        const TraceKind& kind = TRACE_KINDS[event.id];
+        DEBUG_PRINTF("T %u %u %u %c %s", (unsigned)i, (unsigned)event.core, (unsigned)event.cycles,
+                     kind.phase, kind.name);
+        if (event.id == TRACE_STATE) {
+            DEBUG_PRINTF(" %s=%s %s=%s\n", kind.arg, getStateName(event.arg),
+                         kind.arg2, getStateName(event.arg2));
+        } else if (kind.arg2) {
+            DEBUG_PRINTF(" %s=%u %s=%u\n", kind.arg, (unsigned)event.arg, kind.arg2, (unsigned)event.arg2);
+        } else {
+            DEBUG_PRINTF(" %s=%u\n", kind.arg, (unsigned)event.arg);
+        }
+    }
+    DEBUG_PRINTLN("=== End trace ===");
+    traceDumpRequested = false;
+    traceRecording = true;
+}
+
+void printSensorRecording() {
+    DEBUG_PRINTLN("=== Sensor Recording ===");
+    if (!SENSOR_RECORD_ENABLED) {
+        DEBUG_PRINTLN("Disabled (SENSOR_RECORD_ENABLED)");
+        return;
+    }
+    DEBUG_PRINTF("%s: %u of %u bytes\n", SENSOR_RECORD_FILE, (unsigned)sensorRecordBytes,
+                 (unsigned)SENSOR_RECORD_MAX_BYTES);
+    DEBUG_PRINTF("Edges this boot: %u written, %u waiting, %u lost (queue full), %u skipped (file full)\n",
+                 (unsigned)sensorEdgesRecorded, (unsigned)sensorEdges.count(),
+                 (unsigned)sensorEdges.dropped, (unsigned)sensorEdgesSkipped);
+    DEBUG_PRINTLN("==================");
+}
+
+// The recorded edges as text for tools/sensor_replay.cpp: "B" starts a
+// boot, "E <micros> <0 blocked|1 clear>" is an edge. Edges still waiting
+// in RAM are not in the file yet.
+void printSensorEdges() {
+    if (!SPIFFS.exists(SENSOR_RECORD_FILE)) {
+        DEBUG_PRINTLN("No sensor edges recorded");
+        return;
+    }
+    File file = SPIFFS.open(SENSOR_RECORD_FILE, FILE_READ);
+    DEBUG_PRINTF("=== Sensor edges: %u records ===\n", (unsigned)(file.size() / sizeof(SensorEdgeRecord)));
+    SensorEdgeRecord edges[32];
+    size_t bytes;
+    while ((bytes = file.read((uint8_t*)edges, sizeof(edges))) >= sizeof(SensorEdgeRecord)) {
+        for (size_t i = 0; i < bytes / sizeof(SensorEdgeRecord); i++) {
+            if (edges[i].level == SENSOR_EDGE_BOOT) {
+                DEBUG_PRINTLN("B");
+            } else {
+                DEBUG_PRINTF("E %u %u\n", (unsigned)edges[i].timeUs, (unsigned)edges[i].level);
+            }
+        }
+    }
+    file.close();
+    DEBUG_PRINTLN("=== End sensor edges ===");
+}
+
+// Per-task CPU since the last 'stats' (percent of one core) and the least
+// free stack each task has had. Shows whether anything on core 1 besides
+// loop() and the timer wheel is eating into the control path.
+void printTaskStats() {
+    static TaskStatus_t tasks[TASK_STATS_MAX];
+    static TaskHandle_t lastHandles[TASK_STATS_MAX];
+    static uint32_t lastRunTime[TASK_STATS_MAX];
+    static uint32_t lastTotal = 0;
+    
+    DEBUG_PRINTLN("=== Task Stats ===");
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    uint32_t total;
+    UBaseType_t count = uxTaskGetSystemState(tasks, TASK_STATS_MAX, &total);
+    uint32_t elapsed = total - lastTotal;
+    DEBUG_PRINTLN("task            core prio   cpu%  stack free");
+    for (UBaseType_t i = 0; i < count; i++) {
+        const TaskStatus_t& t = tasks[i];
+        uint32_t previous = 0;
+        for (int j = 0; j < TASK_STATS_MAX; j++) {
+            if (lastHandles[j] == t.xHandle) {
+                previous = lastRunTime[j];
+                break;
+            }
+        }
+        uint32_t percent = elapsed ? (uint64_t)(t.ulRunTimeCounter - previous) * 100 / elapsed : 0;
+        DEBUG_PRINTF("%-15s %4s %4u %6u  %10u\n", t.pcTaskName,
+                     t.xCoreID == 0 ? "0" : t.xCoreID == 1 ? "1" : "-",
+                     (unsigned)t.uxCurrentPriority, (unsigned)percent, (unsigned)t.usStackHighWaterMark);
+    }
+    for (int j = 0; j < TASK_STATS_MAX; j++) {
+        lastHandles[j] = j < (int)count ? tasks[j].xHandle : NULL;
+        lastRunTime[j] = j < (int)count ? tasks[j].ulRunTimeCounter : 0;
+    }
+    lastTotal = total;
+#else
+    DEBUG_PRINTLN("(FreeRTOS run time stats disabled; stack only)");
+    TaskHandle_t handles[] = {loopTask, storageTask, consoleTask};
+    for (TaskHandle_t handle : handles) {
+        if (handle) {
+            DEBUG_PRINTF("%-15s stack free %u\n", pcTaskGetName(handle),
+                         (unsigned)uxTaskGetStackHighWaterMark(handle));
+        }
+    }
+#endif
+    
+    DEBUG_PRINT("Control Loop: ");
+    DEBUG_PRINT(loopPasses);
+    DEBUG_PRINT(" passes, longest ");
+    DEBUG_PRINT(maxLoopPassUs);
+    DEBUG_PRINTLN("us");
+    DEBUG_PRINT("Image Saves: ");
+    DEBUG_PRINT(imageSaves.count());
+    DEBUG_PRINT(" queued, ");
+    DEBUG_PRINT(imageSaves.highWater);
+    DEBUG_PRINT(" max, ");
+    DEBUG_PRINT(imageSavesInline);
+    DEBUG_PRINTLN(" written by loop()");
+    DEBUG_PRINT("Finished Coins: ");
+    DEBUG_PRINT(finishedCoins.count());
+    DEBUG_PRINT(" queued, ");
+    DEBUG_PRINT(finishedCoins.highWater);
+    DEBUG_PRINT(" max, ");
+    DEBUG_PRINT(coinsFinishedInline);
+    DEBUG_PRINT(" stored by loop(), ");
+    DEBUG_PRINT(recordWriteFailures);
+    DEBUG_PRINTLN(" record writes failed");
+    DEBUG_PRINTLN("==================");
+}
+
+void printLogLevels() {
+    DEBUG_PRINT("Log levels (compiled up to ");
+    DEBUG_PRINT(LOG_LEVEL_NAMES[LOG_COMPILED_LEVEL]);
+    DEBUG_PRINTLN("):");
+    for (uint8_t s = 0; s < LOG_SYS_COUNT; s++) {
+        DEBUG_PRINT("  ");
+        DEBUG_PRINT(LOG_SUBSYSTEM_NAMES[s]);
+        DEBUG_PRINT(": ");
+        DEBUG_PRINTLN(LOG_LEVEL_NAMES[logLevels[s]]);
+    }
+}
+
+// "log <subsystem|all> <level>"
+bool setLogLevel(const char* args) {
+    const char* space = strchr(args, ' ');
+    if (!space) {
+        return false;
+    }
+    size_t subsystemLength = space - args;
+    const char* level = skipSpaces(space);
+    
+    for (uint8_t l = LOG_LEVEL_OFF; l <= LOG_LEVEL_DEBUG; l++) {
+        if (strcmp(level, LOG_LEVEL_NAMES[l]) != 0) {
+            continue;
+        }
+        bool found = false;
+        for (uint8_t s = 0; s < LOG_SYS_COUNT; s++) {
+            const char* name = LOG_SUBSYSTEM_NAMES[s];
+            if ((subsystemLength == 3 && strncmp(args, "all", 3) == 0) ||
+                (strlen(name) == subsystemLength && strncmp(args, name, subsystemLength) == 0)) {
+                logLevels[s] = l;
+                found = true;
+            }
+        }
+        if (found && l > LOG_COMPILED_LEVEL) {
+            DEBUG_PRINTLN("Note: levels above the compiled level stay silent");
+        }
+        return found;
+    }
+    return false;
+}
+
+// Commands that drive hardware or the state machine, run by loop()
+void runControlCommands() {
+    ConsoleCommand command;
+    while (controlCommands.pop(command)) {
+        if (strcmp(command.text, "test") == 0) {
+            performSystemTest();
+        } else if (strcmp(command.text, "calibrate") == 0) {
+            if (!calibrateCameraExposure()) {
+                DEBUG_PRINTLN("Calibration failed");
+            }
+        } else if (strcmp(command.text, "servocal") == 0) {
+            calibrateServoTiming();
+        } else if (strcmp(command.text, "reset") == 0) {
+            stateMachine.dispatch(EVENT_RESET, millis());
+        } else if (strcmp(command.text, "placebench") == 0) {
+            // Restarts the camera; a coin mid-photo would lose its shots, and
+            // frames still queued for the storage task would be freed under it
+            if (stateMachine.current() != STATE_WAITING_FOR_COIN || !isStorageIdle()) {
+                DEBUG_PRINTLN("Busy; run placebench between coins");
+            } else if (!benchmarkPlacement()) {
+                lastError = STATUS_CAMERA_ERROR;
+                stateMachine.dispatch(EVENT_FAULT, millis());
+            }
+        }
+    }
+}
+
+void forwardToControl(const char* text) {
+    ConsoleCommand command;
+    strlcpy(command.text, text, sizeof(command.text));
+    if (controlCommands.push(command)) {
+        wakeLoop();
+    } else {
+        DEBUG_PRINTLN("Busy; try again");
+    }
+}
+
+const char* skipSpaces(const char* text) {
+    while (*text == ' ') {
+        text++;
+    }
+    return text;
+}
+
+// Collects serial input a character at a time, without blocking or the
+// heap. Returns the trimmed line once its newline arrives, else NULL.
+// Anything past CONSOLE_LINE_MAX is dropped.
+const char* readConsoleLine() {
+    static char line[CONSOLE_LINE_MAX];
+    static size_t length = 0;
+    
+    while (Serial.available()) {
+        char c = Serial.read();
+        if (c != '\n') {
+            if (length < sizeof(line) - 1) {
+                line[length++] = c;
+            }
+            continue;
+        }
+        while (length > 0 && isspace((unsigned char)line[length - 1])) {
+            length--;
+        }
+        line[length] = '\0';
+        length = 0;
+        const char* start = line;
+        while (isspace((unsigned char)*start)) {
+            start++;
+        }
+        return start;
+    }
+    return NULL;
+}
+
+// Serial commands, read and answered on the console task (core 0).
+// Anything that touches hardware goes to loop() via forwardToControl().
 void processSerialCommands() {
-    if (Serial.available()) {
-        String command = Serial.readStringUntil('\n');
-        command.trim();
-        
-        if (command == "status") {
+    const char* command = readConsoleLine();
+    if (command) {
+        if (strcmp(command, "status") == 0) {
             printSystemStatus();
-        } else if (command == "test") {
-            performSystemTest();
-        } else if (command == "reset") {
-            systemReset();
-            changeState(STATE_WAITING_FOR_COIN);
-        } else if (command == "photos") {
+        } else if (strcmp(command, "stats") == 0) {
+            printTaskStats();
+        } else if (strcmp(command, "mem") == 0) {
+            printMemoryStats();
+        } else if (strcmp(command, "trace") == 0) {
+            requestTraceDump("command");
+        } else if (strcmp(command, "trace clear") == 0) {
+            traceNext = 0;
+            DEBUG_PRINTLN("Trace cleared");
+        } else if (strcmp(command, "edges") == 0) {
+            printSensorRecording();
+        } else if (strcmp(command, "edges dump") == 0) {
+            printSensorEdges();
+        } else if (strcmp(command, "edges clear") == 0) {
+            // The storage task owns the file
+            sensorRecordClearRequested = true;
+            DEBUG_PRINTLN("Clearing sensor edges");
+        } else if (strcmp(command, "boot") == 0) {
+            printInitReport(COIN_MACHINE_INIT_STEPS, INIT_STEP_COUNT, initResults, initTimeMs);
+        } else if (strcmp(command, "log") == 0) {
+            printLogLevels();
+        } else if (strncmp(command, "log ", 4) == 0) {
+            if (setLogLevel(skipSpaces(command + 4))) {
+                printLogLevels();
+            } else {
+                DEBUG_PRINTLN("Usage: log <sensor|servo|camera|storage|state|memory|all> <off|error|warn|info|debug>");
+            }
+        } else if (strcmp(command, "test") == 0 || strcmp(command, "calibrate") == 0 ||
+                   strcmp(command, "servocal") == 0 || strcmp(command, "reset") == 0 ||
+                   strcmp(command, "placebench") == 0) {
+            forwardToControl(command);
+        } else if (strcmp(command, "plan") == 0) {
+            printPhotoPlans();
+        } else if (strncmp(command, "plan ", 5) == 0) {
+            const char* name = skipSpaces(command + 5);
+            if (selectPhotoPlan(name)) {
+                DEBUG_PRINT("Photo plan: ");
+                DEBUG_PRINTLN(name);
+            } else {
+                DEBUG_PRINTLN("Unknown plan; 'plan' lists them");
+            }
+        } else if (strncmp(command, "prune ", 6) == 0) {
+            // Frees space by deleting the oldest coins; nothing else does
+            unsigned long coins = strtoul(skipSpaces(command + 6), NULL, 10);
+            if (coins == 0 || coins > UINT16_MAX) {
+                DEBUG_PRINTLN("Usage: prune <coins>, oldest first");
+            } else if (!storageTask) {
+                DEBUG_PRINTLN("No storage task");
+            } else {
+                pruneCoinsRequested = coins;
+                xTaskNotifyGive(storageTask);
+                DEBUG_PRINT("Pruning the oldest ");
+                DEBUG_PRINT(coins);
+                DEBUG_PRINTLN(" coins");
+            }
+        } else if (strcmp(command, "photos") == 0) {
             // List stored photos
             File root = SPIFFS.open("/");
             File file = root.openNextFile();
             DEBUG_PRINTLN("=== Stored Images ===");
             while (file) {
-                if (String(file.name()).startsWith(IMAGE_FILENAME_PREFIX)) {
+                if (isImageFile(file.name())) {
                     DEBUG_PRINT("- ");
                     DEBUG_PRINT(file.name());
                     DEBUG_PRINT(" (");
@@ -453,7 +1086,86 @@ void processSerialCommands() {
             }
             DEBUG_PRINTLN("==================");
         } else {
-            DEBUG_PRINTLN("Available commands: status, test, reset, photos");
+            DEBUG_PRINTLN("Available commands: status, stats, mem, trace [clear], edges [dump|clear], boot, log [subsystem level], test, calibrate, servocal, placebench, reset, plan [name], photos, prune <coins>");
         }
     }
+}
+
+// ==================== TELEMETRY ====================
+// Snapshot for the fleet collector. Runs on the console task and reads
+// loop()'s counters without a lock; a frame may mix values a pass apart.
+void buildTelemetryFrame(TelemetryFrame& frame, uint8_t reason) {
+    memset(&frame, 0, sizeof(frame));
+    frame.unitId = getUnitId();
+    frame.sequence = telemetrySequence++;
+    frame.uptimeMs = millis();
+    frame.reason = reason;
+    frame.state = stateMachine.current();
+    frame.lastError = lastError;
+    uint32_t freeBytes = storageFreeBytes;
+    frame.storageFillPercent = storageTotalBytes ? 100 - (uint64_t)freeBytes * 100 / storageTotalBytes : 0;
+    frame.temperatureDeciC = (int16_t)(temperatureRead() * 10);
+    frame.errorCount = errorCount;
+    frame.coinsSensed = getSensorTriggerCount();
+    frame.coinsPhotographed = coinsPhotographed;
+    frame.coinsRejected = coinsRejected;
+    frame.coinsStored = coinsStored;
+    frame.storageFreeBytes = freeBytes;
+    frame.freeHeap = ESP.getFreeHeap();
+    frame.largestFreeBlock = ESP.getMaxAllocHeap();
+    frame.logDropped = logDroppedTotal;
+    frame.queueDrops = coinQueue.dropped + imageSaves.dropped + finishedCoins.dropped;
+    frame.recordWriteFailures = recordWriteFailures;
+    frame.maxLoopPassUs = maxLoopPassUs;
+    frame.lastDenomination = lastPrediction.denomination;
+    frame.lastConfidence = lastPrediction.confidence;
+    frame.photoPlan = activePlan;
+    frame.jpegQuality = imageQuality.quality;
+    frame.loopPassUs = loopPassHistogram;
+    frame.imageWriteMs = imageWriteHistogram;
+    frame.coinCycleMs = coinCycleHistogram;
+    telemetrySeal(frame);
+}
+
+// A frame every TELEMETRY_INTERVAL, and soon after each coin
+void runTelemetry() {
+    if (!TELEMETRY_ENABLED) {
+        return;
+    }
+    unsigned long now = millis();
+    if (!telemetryRequested && now - lastTelemetryMs < TELEMETRY_INTERVAL) {
+        return;
+    }
+    uint8_t reason = telemetryRequested ? TELEMETRY_COIN : TELEMETRY_PERIODIC;
+    telemetryRequested = false;
+    lastTelemetryMs = now;
+    
+    static TelemetryFrame frame;
+    unsigned long start = micros();
+    buildTelemetryFrame(frame, reason);
+    unsigned long built = micros();
+    sendTelemetryFrame(frame);
+    telemetryBuildUs += built - start;
+    telemetrySendUs += micros() - built;
+}
+
+void consoleTaskLoop(void*) {
+    for (;;) {
+        drainEventLog();
+        traceSyncIfDue(consoleTraceSyncMs);
+        if (traceDumpRequested) {
+            printTrace();
+        }
+        sampleMemoryIfDue();
+        runTelemetry();
+        processSerialCommands();
+        vTaskDelay(pdMS_TO_TICKS(CONSOLE_POLL_INTERVAL));
+    }
+}
+
+void startConsoleTask() {
+    if (xTaskCreatePinnedToCore(consoleTaskLoop, "console", CONSOLE_TASK_STACK, NULL,
+                                CONSOLE_TASK_PRIORITY, &consoleTask, CONSOLE_TASK_CORE) != pdPASS) {
+        DEBUG_PRINTLN("ERROR: Console task creation failed");
+    }
 } 
\ No newline at end of file
@@ -0,0 +1,79 @@
+#ifndef COIN_QUEUE_H
+#define COIN_QUEUE_H
+
+// Coins between the sensor and the flipper. The sensor interrupt pushes an
+// entry per coin and the state machine admits them to the flipper in
+// order. One producer (the ISR, which only moves tail) and one consumer
+// (loop(), which only moves head), so no locking is needed. Indices run
+// freely and wrap at 256; COIN_QUEUE_SIZE must be a power of two.
+
+#include <stdint.h>
+#include "config.h"
+
+#define COIN_QUEUE_MASK (COIN_QUEUE_SIZE - 1)
+
+struct QueuedCoin {
+    uint32_t sensedAt;        // millis() when the coin first blocked the sensor
+    uint32_t blockTimeMs;     // How long it blocked the sensor, 0 until it clears
+};
+
+struct CoinQueue {
+    QueuedCoin coins[COIN_QUEUE_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    volatile uint32_t dropped;    // Coins sensed while the queue was full
+};
+
+inline uint8_t coinQueueCount(const CoinQueue& q) {
+    return (uint8_t)(q.tail - q.head);
+}
+
+// Producer side (sensor ISR)
+inline bool coinQueuePush(CoinQueue& q, uint32_t sensedAt) {
+    if (coinQueueCount(q) >= COIN_QUEUE_SIZE) {
+        q.dropped++;
+        return false;
+    }
+    QueuedCoin& coin = q.coins[q.tail & COIN_QUEUE_MASK];
+    coin.sensedAt = sensedAt;
+    coin.blockTimeMs = 0;
+    q.tail++;
+    return true;
+}
+
+// The newest coin has cleared the sensor
+inline void coinQueueSetBlockTime(CoinQueue& q, uint32_t blockTimeMs) {
+    if (coinQueueCount(q) > 0) {
+        q.coins[(uint8_t)(q.tail - 1) & COIN_QUEUE_MASK].blockTimeMs = blockTimeMs;
+    }
+}
+
+// Consumer side (loop)
+inline const QueuedCoin& coinQueueFront(const CoinQueue& q) {
+    return q.coins[q.head & COIN_QUEUE_MASK];
+}
+
+inline void coinQueueDrop(CoinQueue& q, uint8_t count) {
+    uint8_t queued = coinQueueCount(q);
+    q.head += count < queued ? count : queued;
+}
+
+inline void coinQueueClear(CoinQueue& q) {
+    q.head = q.tail;
+}
+
+// Coins that arrived within windowMs of the front one, itself included
+inline uint8_t coinQueueCountWithin(const CoinQueue& q, uint32_t windowMs) {
+    uint8_t queued = coinQueueCount(q);
+    if (queued == 0) {
+        return 0;
+    }
+    uint32_t first = coinQueueFront(q).sensedAt;
+    uint8_t n = 1;
+    while (n < queued && q.coins[(uint8_t)(q.head + n) & COIN_QUEUE_MASK].sensedAt - first < windowMs) {
+        n++;
+    }
+    return n;
+}
+
+#endif // COIN_QUEUE_H
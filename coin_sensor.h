@@ -0,0 +1,79 @@
+#ifndef COIN_SENSOR_H
+#define COIN_SENSOR_H
+
+// Turning optical sensor edges into queued coins, and the multiple coin
+// window the state machine checks them against. The sensor ISR in
+// hardware_functions.h and tools/sensor_replay.cpp both run this, so a
+// recorded edge sequence replays through exactly the firmware's logic.
+// Time is passed in; kept free of Arduino dependencies like coin_queue.h.
+
+#include <stdint.h>
+#include "config.h"
+#include "coin_queue.h"
+
+// Debounce and block-time tracking between edges. Written by the ISR only.
+struct SensorState {
+    volatile uint32_t lastTrigger;        // ms of the last counted coin
+    volatile uint32_t triggerCount;       // Coins sensed since boot
+    volatile uint32_t blockStart;         // ms the current coin blocked the sensor, 0 if clear
+    volatile uint32_t lastBlockTime;      // How long the last coin blocked it (ms)
+};
+
+// One sensor edge. Returns true if it was a new coin, which is then queued.
+inline bool sensorEdge(SensorState& sensor, CoinQueue& queue, bool blocked, uint32_t nowMs) {
+    // Rising edge: the coin has cleared the sensor
+    if (!blocked) {
+        if (sensor.blockStart != 0) {
+            sensor.lastBlockTime = nowMs - sensor.blockStart;
+            coinQueueSetBlockTime(queue, sensor.lastBlockTime);
+            sensor.blockStart = 0;
+        }
+        return false;
+    }
+
+    // Debounce check
+    if (nowMs - sensor.lastTrigger < SENSOR_DEBOUNCE_TIME) {
+        return false;
+    }
+
+    sensor.lastTrigger = nowMs;
+    sensor.blockStart = nowMs;
+    sensor.triggerCount++;
+    coinQueuePush(queue, nowMs);
+    return true;
+}
+
+// Coins that dropped together with the next queued coin
+inline uint8_t coinsInWindow(const CoinQueue& queue) {
+    return coinQueueCountWithin(queue, MULTI_COIN_TIMEOUT);
+}
+
+// Time left in the next queued coin's detection window (ms)
+inline uint32_t detectionWindowRemaining(const CoinQueue& queue, uint32_t nowMs) {
+    if (coinQueueCount(queue) == 0) {
+        return 0;
+    }
+    uint32_t elapsed = nowMs - coinQueueFront(queue).sensedAt;
+    return elapsed >= MULTI_COIN_TIMEOUT ? 0 : MULTI_COIN_TIMEOUT - elapsed;
+}
+
+inline bool multipleCoinsInWindow(const CoinQueue& queue) {
+    return coinsInWindow(queue) >= MULTI_COIN_THRESHOLD;
+}
+
+// ==================== EDGE RECORDING ====================
+// SENSOR_RECORD_FILE holds SensorEdgeRecords as the ISR saw them. Each boot
+// starts with a SENSOR_EDGE_BOOT record. timeUs wraps every 71 minutes;
+// readers unwrap it, which only shortens idle gaps longer than that.
+#define SENSOR_EDGE_BLOCKED   0
+#define SENSOR_EDGE_CLEAR     1
+#define SENSOR_EDGE_BOOT      0xFF    // Start of a boot's edges, timeUs 0
+
+struct __attribute__((packed)) SensorEdgeRecord {
+    uint32_t timeUs;              // micros() at the interrupt
+    uint8_t level;                // SENSOR_EDGE_*
+};
+
+static_assert(sizeof(SensorEdgeRecord) == 5, "SensorEdgeRecord is stored packed");
+
+#endif // COIN_SENSOR_H
@@ -37,16 +37,40 @@
 // ==================== TIMING CONSTANTS ====================
 // Servo timing (milliseconds)
 #define TRAPDOOR_OPEN_TIME    2000    // How long trapdoor stays open
+#define TRAPDOOR_CLOSE_TIME   1000    // Time allowed for the trapdoor to close
+#define TRAPDOOR_DROP_TIME    300     // Open this long before rejected coins are clear of the chute
 #define SERVO_MOVE_DELAY      500     // Delay between servo movements
 #define FLIPPER_PHOTO_DELAY   300     // Delay after flipper moves before photo
+#define SERVO_SETTLE_MARGIN   40      // Added to every calibrated settle time
+#define SERVO_MIN_SETTLE      100     // Floor for calibrated settle times
 
 // Sensor timing
 #define SENSOR_DEBOUNCE_TIME  50      // Debounce delay for optical sensor
 #define MULTI_COIN_TIMEOUT    1000    // Time window to detect multiple coins
+#define COIN_SETTLE_TIME      500     // Coin settling on the flipper before photos
 
 // Camera timing
 #define CAMERA_FLASH_DURATION 200     // LED flash duration during photo
 #define CAMERA_WARMUP_TIME    100     // Camera stabilization time
+#define CALIBRATION_MIN_FRAMES 5      // Frames before exposure is checked for convergence
+#define CALIBRATION_MAX_FRAMES 40     // Give up converging after this many frames
+#define CALIBRATION_STABLE_FRAMES 3   // Unchanged frames that count as converged
+
+// Motion detection (frame differencing over the coin ROI)
+#define MOTION_THRESHOLD      6       // Mean luma change per grid cell that counts as motion
+#define MOTION_STABLE_FRAMES  2       // Quiet frames in a row that count as settled
+
+// How photo steps decide the flipper has come to rest
+#define SETTLE_TIMED          0       // Wait the modelled settle time
+#define SETTLE_CAMERA         1       // Capture as soon as the camera sees no motion
+#define FLIPPER_SETTLE_POLICY SETTLE_CAMERA
+#define SETTLE_DETECT_TIMEOUT 1000    // Capture anyway after this long (ms)
+
+// Deadline scheduling (see TIMER WHEEL in hardware_functions.h)
+#define TIMER_WHEEL_SLOTS     8       // Timed actions that can be pending at once
+#define TIMER_EVENT_QUEUE     8       // Completion events waiting for loop() (power of two)
+#define LOOP_IDLE_MS          10      // Longest loop() sleeps when nothing wakes it
+#define CHUTE_POLL_INTERVAL   10      // Recheck a blocked sensor before declaring the chute clear (ms)
 
 // State timeouts
 #define PROCESSING_TIMEOUT    10000   // Max time in processing state
@@ -61,23 +85,111 @@
 #define FLIPPER_HOME          0       // Starting position
 #define FLIPPER_SIDE_1        90      // First photo position
 #define FLIPPER_SIDE_2        180     // Second photo position (flipped)
+#define FLIPPER_EDGE          135     // Rim towards the camera (detail plan)
+
+// Flipper motion profile (jerk-limited, streamed from a hardware timer)
+#define FLIPPER_PROFILED_MOVES true   // false = single Servo::write() per move
+#define FLIPPER_MAX_SPEED     600     // deg/s
+#define FLIPPER_MAX_ACCEL     8000    // deg/s^2
+#define FLIPPER_MAX_JERK      200000  // deg/s^3
+#define FLIPPER_PROFILE_PERIOD_MS 10  // Pulse width update interval
+#define FLIPPER_PROFILE_SETTLE 60     // Wait after a profiled move ends (uncalibrated)
+#define SERVO_MIN_PULSE_US    544     // Pulse width at 0 degrees
+#define SERVO_MAX_PULSE_US    2400    // Pulse width at 180 degrees
 
 // ==================== SENSOR THRESHOLDS ====================
 #define MIN_COIN_BLOCK_TIME   10      // Minimum ms for valid coin detection
 #define MAX_SINGLE_COIN_TIME  200     // Maximum ms for single coin passage
 #define MULTI_COIN_THRESHOLD  2       // Number of interrupts indicating multiple coins
+#define COIN_QUEUE_SIZE       8       // Coins that can wait in the chute for the flipper
+
+#if COIN_QUEUE_SIZE & (COIN_QUEUE_SIZE - 1) || COIN_QUEUE_SIZE > 128
+    #error "COIN_QUEUE_SIZE must be a power of two, at most 128"
+#endif
+#if TIMER_EVENT_QUEUE & (TIMER_EVENT_QUEUE - 1) || TIMER_EVENT_QUEUE > 128
+    #error "TIMER_EVENT_QUEUE must be a power of two, at most 128"
+#endif
 
 // ==================== CAMERA SETTINGS ====================
 #define CAMERA_FRAME_SIZE     FRAMESIZE_VGA  // 640x480
 #define CAMERA_JPEG_QUALITY   10             // JPEG quality (0-63, lower = better)
 #define CAMERA_BRIGHTNESS     0              // -2 to 2
 #define CAMERA_CONTRAST       0              // -2 to 2
+#define CAMERA_FB_COUNT       2              // Frame buffers; also stale frames flushed per capture
+#if CAMERA_FB_COUNT < 2
+    #error "CAMERA_FB_COUNT must be at least 2: one frame is lent to the storage task"
+#endif
+#define CAMERA_FRAME_WIDTH    640            // Must match CAMERA_FRAME_SIZE
+#define CAMERA_FRAME_HEIGHT   480
+
+// ==================== CAPTURE MODE ====================
+// JPEG stores the whole frame as captured. The raw modes store only the
+// coin ROI, uncompressed, in a small container (see writeRawCrop()) and
+// leave any JPEG encoding to the host.
+#define CAPTURE_MODE_JPEG      0
+#define CAPTURE_MODE_GRAYSCALE 1      // 1 byte per pixel (Y)
+#define CAPTURE_MODE_YUV422    2      // 2 bytes per pixel (YUYV)
+#define CAPTURE_MODE          CAPTURE_MODE_JPEG
+
+// ==================== FRAME STACKING ====================
+// Average several frames per photo (raw capture modes, needs PSRAM)
+#define STACK_FRAMES          1       // Frames per photo, 1 = off (max 255)
+#define STACK_SEARCH_RADIUS   4       // Registration search range in pixels
+#define STACK_GRID_STEP       8       // Registration samples every Nth pixel
+
+#if STACK_FRAMES > 1 && CAPTURE_MODE == CAPTURE_MODE_JPEG
+    #error "Frame stacking needs a raw CAPTURE_MODE"
+#endif
+#if STACK_FRAMES > 255
+    #error "STACK_FRAMES must fit the 16-bit accumulator"
+#endif
+
+// ==================== IMAGE QUALITY CONTROL ====================
+// CAMERA_JPEG_QUALITY / CAMERA_FRAME_SIZE are the best settings; the
+// controller degrades from there as storage fills or writes slow down
+#define QUALITY_WORST         40      // Coarsest jpeg_quality before reducing frame size
+#define QUALITY_STEP          4       // jpeg_quality increase per adjustment
+#define QUALITY_SETTLE_FRAMES 2       // Frames to average before the next adjustment
+#define QUALITY_MAX_IMAGE_BYTES 40000 // Per-image budget ceiling
+#define QUALITY_RESERVE_IMAGES  40    // Free space is budgeted over this many images
+#define QUALITY_MAX_WRITE_MS  150     // Average write time that counts as backing up
+#define QUALITY_MIN_FREE_BYTES 20000  // Below this, coins are rejected unphotographed until 'prune'
+#define QUALITY_REDUCED_FRAME_SIZE    FRAMESIZE_QVGA  // 320x240
+#define QUALITY_REDUCED_FRAME_DIVISOR 2               // VGA width / reduced width
+
+// ==================== CLASSIFIER SETTINGS ====================
+// Region of the frame the coin sits in while on the flipper (full-frame pixels)
+#define COIN_ROI_X            160
+#define COIN_ROI_Y            80
+#define COIN_ROI_WIDTH        320
+#define COIN_ROI_HEIGHT       320
+#define CLASSIFIER_SCALE      8       // JPEG decode downscale (1, 2, 4 or 8)
+#define CLASSIFIER_JPEG_MAX   (CAMERA_FRAME_WIDTH * CAMERA_FRAME_HEIGHT / 5)  // Largest JPEG the camera driver will hand out
+#define COIN_EDGE_THRESHOLD   40      // Luma difference from background marking coin pixels
 
 // ==================== LED SETTINGS ====================
 #define NUM_CAMERA_LEDS       8       // Number of WS2812B LEDs
 #define CAMERA_LED_BRIGHTNESS 128     // 0-255
 #define STATUS_LED_BRIGHTNESS 100     // PWM value for status LED
 
+// ==================== PHOTO PLANS ====================
+// Shots per coin are data (see photo_plans.h); these are the per-shot options
+#define LIGHTS_OFF            0
+#define LIGHTS_FULL           1       // Whole strip
+#define LIGHTS_RAKING         2       // First half of the strip: low-angle light for rims and lettering
+#define EXPOSURE_SESSION      0       // Session exposure lock as calibrated
+#define EXPOSURE_PLUS_1EV     1       // Double the locked exposure, e.g. under raking light
+#define EXPOSURE_MINUS_1EV    2       // Half the locked exposure
+#define PHOTO_PLAN_MAX_SHOTS  4       // Longest plan
+#define DEFAULT_PHOTO_PLAN    0       // Index into PHOTO_PLANS ("standard")
+
+// Steps of the PHOTOGRAPHING state, per shot and then once per coin
+enum PhotoStep {
+    PHOTO_MOVE,               // Wait for the timer wheel to move the flipper to the shot's angle
+    PHOTO_SHOOT,              // Wait for it to settle, then capture
+    PHOTO_FINISH              // All shots taken; classify while the flipper returns home
+};
+
 // ==================== SYSTEM STATES ====================
 enum CoinMachineState {
     STATE_INIT,
@@ -86,7 +198,22 @@ enum CoinMachineState {
     STATE_PROCESSING,
     STATE_PHOTOGRAPHING,
     STATE_REJECTING,
-    STATE_ERROR
+    STATE_ERROR,
+    STATE_COUNT
+};
+
+// ==================== STATE MACHINE EVENTS ====================
+enum CoinMachineEvent {
+    EVENT_START,              // setup() finished
+    EVENT_COIN_SENSED,        // Optical sensor triggered
+    EVENT_TIMEOUT,            // Time in state reached the state's timeout
+    EVENT_PHOTOS_DONE,        // Photo sequence finished
+    EVENT_FAULT,              // Something failed; lastError says what
+    EVENT_RECOVERED,          // Error recovery finished
+    EVENT_RESET,              // Reset requested from the console
+    EVENT_CHUTE_CLEAR,        // Rejected coins have dropped through the trapdoor
+    EVENT_WINDOW_CLOSED,      // The next coin's multi-coin detection window is over
+    EVENT_COUNT
 };
 
 // ==================== STATUS CODES ====================
@@ -112,20 +239,136 @@ const RGBColor LED_ERROR = {255, 0, 255};      // Magenta - error
 const RGBColor LED_OFF = {0, 0, 0};            // Off
 
 // ==================== FILE STORAGE ====================
-#define MAX_IMAGES_STORED     100     // Maximum images before cleanup
 #define IMAGE_FILENAME_PREFIX "/coin_"
-#define IMAGE_FILENAME_SUFFIX ".jpg"
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+    #define IMAGE_FILENAME_SUFFIX ".jpg"
+#else
+    #define IMAGE_FILENAME_SUFFIX ".raw"
+#endif
+#define COIN_RECORD_FILE      "/coins.csv"  // One line per photographed coin
+#define COIN_RECORD_TEMP_FILE "/coins.tmp"  // COIN_RECORD_FILE being rewritten by 'prune'
+#define IMAGE_FILENAME_MAX    32      // Longest image path, terminator included
+#define EXTRA_IMAGES_MAX      (PHOTO_PLAN_MAX_SHOTS > 2 ? IMAGE_FILENAME_MAX * (PHOTO_PLAN_MAX_SHOTS - 2) : 1)  // A record's ';'-separated extra shots
+#define COIN_RECORD_LINE_MAX  (2 * IMAGE_FILENAME_MAX + EXTRA_IMAGES_MAX + 192)  // Longest coins.csv row
+
+// ==================== SENSOR RECORDING ====================
+// Raw sensor edges for tools/sensor_replay.cpp (see coin_sensor.h)
+#define SENSOR_RECORD_ENABLED true
+#define SENSOR_RECORD_FILE    "/sensor_edges.bin"
+#define SENSOR_RECORD_MAX_BYTES 65536 // Recording stops here until 'edges clear' (~13000 edges)
+#define SENSOR_RECORD_QUEUE_SIZE 64   // Edges waiting for the storage task (power of two, at most 128)
+#define SENSOR_RECORD_BUFFER  64      // Edges per append to the file
+#define SENSOR_RECORD_FLUSH_INTERVAL 10000  // Longest an edge waits in RAM (ms)
+
+// ==================== MEMORY PLACEMENT ====================
+// Where the big buffers live. Internal RAM is fast and scarce; PSRAM is
+// large but sits behind the flash cache. Rings, thumbnails and anything an
+// ISR or the timer wheel touches always stay in internal RAM.
+#define PLACEMENT_AUTO        0       // PSRAM when fitted, else internal
+#define PLACEMENT_INTERNAL    1
+#define PLACEMENT_PSRAM       2       // Fails without PSRAM
+#define FRAME_BUFFER_PLACEMENT PLACEMENT_AUTO   // Camera frame buffers
+#define SCRATCH_PLACEMENT     PLACEMENT_AUTO    // Per-coin analysis scratch and stacking buffers
+#define CAMERA_GRAB_MODE      CAMERA_GRAB_WHEN_EMPTY  // Captures flush stale frames themselves
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+    #define SCRATCH_POOL_BYTES CLASSIFIER_JPEG_MAX  // The JPEG being classified
+#else
+    #define SCRATCH_POOL_BYTES 0      // Raw images are classified a row at a time
+#endif
+#define PLACEMENT_BENCH_SHOTS 5       // Captures per placement in 'placebench'
+#define PLACEMENT_BENCH_FILE  "/placebench.tmp"
+
+#if FRAME_BUFFER_PLACEMENT > PLACEMENT_PSRAM || SCRATCH_PLACEMENT > PLACEMENT_PSRAM
+    #error "Placements must be PLACEMENT_AUTO, PLACEMENT_INTERNAL or PLACEMENT_PSRAM"
+#endif
+
+// ==================== TASKS ====================
+// loop() is the control task: Arduino pins it to core 1 (ARDUINO_RUNNING_CORE).
+// It owns the state machine, sensor, servos and capture. Work that can
+// wait runs on core 0, fed through SpscQueues (spsc_queue.h).
+#define CONTROL_TASK_PRIORITY 5       // Above every core 0 task
+#define STORAGE_TASK_CORE     0       // Image writes, classification, coin records
+#define STORAGE_TASK_PRIORITY 2
+#define STORAGE_TASK_STACK    8192    // Bytes
+#define CONSOLE_TASK_CORE     0       // Serial commands and status output
+#define CONSOLE_TASK_PRIORITY 1
+#define CONSOLE_TASK_STACK    6144    // Bytes
+#define CONSOLE_POLL_INTERVAL 20      // ms between serial checks
+#define INIT_TASK_CORE        0       // Concurrent init steps (init_table.h), beside setup() on core 1
+#define INIT_TASK_PRIORITY    3
+#define INIT_TASK_STACK       4096    // Bytes
+#define STORAGE_QUEUE_SIZE    8       // Images or coins waiting for the storage task (power of two)
+#define COMMAND_QUEUE_SIZE    4       // Console commands waiting for loop() (power of two)
+#define COMMAND_MAX_LENGTH    32
+#define CONSOLE_LINE_MAX      64      // Longest serial command line
+#define TASK_STATS_MAX        24      // Tasks listed by the stats command
+
+// ==================== MEMORY TELEMETRY ====================
+#define MEM_SAMPLE_INTERVAL   300000  // Console task samples heap and stacks this often (ms)
+#define MEM_SAMPLE_COUNT      48      // Samples kept: four hours at the interval above
+#define MEM_LOW_BLOCK_BYTES   (CAMERA_FRAME_WIDTH * CAMERA_FRAME_HEIGHT / 5)  // One JPEG frame buffer; warn below this
+
+#if MEM_SAMPLE_COUNT < 1 || MEM_SAMPLE_COUNT > 255
+    #error "MEM_SAMPLE_COUNT must be 1-255"
+#endif
+
+// ==================== TELEMETRY ====================
+// Binary frames for tools/telemetry_collector.py (see telemetry.h)
+#define TELEMETRY_ENABLED     true
+#define TELEMETRY_INTERVAL    10000   // Periodic frame (ms); one is also sent per coin
+#define TELEMETRY_SERIAL      true    // Frames go out between the text lines
+#define TELEMETRY_UDP         false   // Also send to a collector on the local network
+#define TELEMETRY_WIFI_SSID   ""
+#define TELEMETRY_WIFI_PASSWORD ""
+#define TELEMETRY_UDP_HOST    "192.168.1.10"
+#define TELEMETRY_UDP_PORT    5005
 
 // ==================== DEBUG SETTINGS ====================
 #define DEBUG_ENABLED         true
 #define SERIAL_BAUD_RATE      115200
+#define SERIAL_STARTUP_WAIT   1000    // Cold boot only: time for a serial monitor to attach (ms)
+#define SERVO_HOME_WAIT       1000    // Cold boot only: servos reaching home before anything moves (ms)
+#define LOG_ENABLED           true    // Hot-path event log (event_log.h); cheap enough for production
+
+// Event log levels; each event in LOG_FORMATS has one
+#define LOG_LEVEL_OFF         0
+#define LOG_LEVEL_ERROR       1
+#define LOG_LEVEL_WARN        2
+#define LOG_LEVEL_INFO        3
+#define LOG_LEVEL_DEBUG       4
+#define LOG_COMPILED_LEVEL    LOG_LEVEL_DEBUG   // Higher levels compile out; LOG_LEVEL_INFO for production
+#define LOG_DEFAULT_LEVEL     LOG_LEVEL_INFO    // Per subsystem at boot; the 'log' command changes it
+#define LOG_RING_SIZE         256     // Events waiting for the console task (power of two)
+#define LOG_LINE_MAX          128     // Longest formatted event
+
+#if LOG_RING_SIZE & (LOG_RING_SIZE - 1)
+    #error "LOG_RING_SIZE must be a power of two"
+#endif
+
+// Flight recorder (trace.h); the 'trace' command dumps it
+#define TRACE_ENABLED         true
+#define TRACE_RING_SIZE       1024    // Events kept, oldest overwritten (power of two)
+#define TRACE_SYNC_INTERVAL   1000    // Per-core clock anchor (ms); cycle counters wrap in under 18s
+#define TRACE_DUMP_ON_ERROR   true    // Dump the lead-up whenever the machine enters ERROR
+#define TRACE_DUMP_ON_REJECT  false   // Also after every rejected coin
+
+#if TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)
+    #error "TRACE_RING_SIZE must be a power of two"
+#endif
+#if TRACE_SYNC_INTERVAL >= 10000
+    #error "TRACE_SYNC_INTERVAL must be well inside the cycle counter's wrap"
+#endif
 
 #if DEBUG_ENABLED
     #define DEBUG_PRINT(x)    Serial.print(x)
     #define DEBUG_PRINTLN(x)  Serial.println(x)
+    #define DEBUG_PRINTF(...) Serial.printf(__VA_ARGS__)
 #else
     #define DEBUG_PRINT(x)
     #define DEBUG_PRINTLN(x)
+    // Still type-checks its arguments, so values computed only to print
+    // them don't become unused variables
+    #define DEBUG_PRINTF(...) do { if (0) Serial.printf(__VA_ARGS__); } while (0)
 #endif
 
 #endif // CONFIG_H 
\ No newline at end of file
@@ -0,0 +1,194 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+// Deferred-format logging. The hot path records a LogEvent (format id,
+// timestamp, raw arguments) into a RAM ring, which costs a few words of
+// copying; the console task turns them into text later (see EVENT LOG in
+// hardware_functions.h). String arguments must outlive the event: literals,
+// state and plan names, never a String's buffer. Kept free of Arduino
+// dependencies so the formatter also runs on the host.
+//
+// Every event has a subsystem and a level. Events above LOG_COMPILED_LEVEL
+// are removed at compile time by LOG_EVENT(); the rest are checked against
+// a per-subsystem level that the console can change at runtime.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "config.h"
+
+#define LOG_MAX_ARGS          4
+#define LOG_STR(s)            ((uintptr_t)(const char*)(s))
+
+enum LogSubsystem : uint8_t {
+    LOG_SYS_SENSOR,
+    LOG_SYS_SERVO,
+    LOG_SYS_CAMERA,
+    LOG_SYS_STORAGE,
+    LOG_SYS_STATE,
+    LOG_SYS_MEMORY,
+    LOG_SYS_COUNT
+};
+
+// Console names, in LogSubsystem / LOG_LEVEL_* order
+const char* const LOG_SUBSYSTEM_NAMES[LOG_SYS_COUNT] = {"sensor", "servo", "camera", "storage", "state", "memory"};
+const char* const LOG_LEVEL_NAMES[] = {"off", "error", "warn", "info", "debug"};
+
+enum LogId : uint8_t {
+    LOG_STATE_CHANGE,
+    LOG_SENSOR_TRIGGERED,
+    LOG_WINDOW_RESULT,
+    LOG_COIN_ACCEPTED,
+    LOG_MULTIPLE_COINS,
+    LOG_STORAGE_FULL,
+    LOG_PHOTO_START,
+    LOG_FLIPPER_QUEUED,
+    LOG_FLIPPER_MOVED,
+    LOG_FLIPPER_SETTLED,
+    LOG_SETTLE_NOT_DETECTED,
+    LOG_PHOTO_TAKING,
+    LOG_CAPTURE_FAILED,
+    LOG_IMAGE_QUEUED,
+    LOG_IMAGE_SAVED,
+    LOG_IMAGE_SAVE_FAILED,
+    LOG_FLIPPER_HOMING,
+    LOG_PHOTOS_DONE,
+    LOG_PHOTO_TIMEOUT,
+    LOG_TRAPDOOR_OPENING,
+    LOG_TRAPDOOR_MOVED,
+    LOG_COIN_CLASSIFIED,
+    LOG_TIMER_WHEEL_FULL,
+    LOG_COINS_PRUNED,
+    LOG_PRUNE_FAILED,
+    LOG_CYCLE_ALLOCATED,
+    LOG_FRAME_BLOCK_LOW,
+    LOG_ID_COUNT
+};
+
+struct LogEvent {
+    uint32_t timeUs;              // micros() when recorded
+    uint8_t id;                   // LogId
+    uintptr_t args[LOG_MAX_ARGS];
+};
+
+// Formats use %d, %u, %s and %% only, without flags or widths
+struct LogFormat {
+    uint8_t id;                   // Must equal the entry's index
+    uint8_t subsystem;            // LogSubsystem
+    uint8_t level;                // LOG_LEVEL_ERROR .. LOG_LEVEL_DEBUG
+    const char* text;
+};
+
+constexpr LogFormat LOG_FORMATS[] = {
+    {LOG_STATE_CHANGE,        LOG_SYS_STATE,     LOG_LEVEL_INFO,  "State change: %s -> %s"},
+    {LOG_SENSOR_TRIGGERED,    LOG_SYS_SENSOR,    LOG_LEVEL_DEBUG, "Sensor triggered, queued: %u"},
+    {LOG_WINDOW_RESULT,       LOG_SYS_SENSOR,    LOG_LEVEL_DEBUG, "Coin detection complete. Count: %u, Multiple: %s"},
+    {LOG_COIN_ACCEPTED,       LOG_SYS_STATE,     LOG_LEVEL_INFO,  "Single coin detected - processing"},
+    {LOG_MULTIPLE_COINS,      LOG_SYS_SENSOR,    LOG_LEVEL_WARN,  "Multiple coins detected - rejecting"},
+    {LOG_STORAGE_FULL,        LOG_SYS_STORAGE,   LOG_LEVEL_WARN,  "Storage full - rejecting coin unphotographed"},
+    {LOG_PHOTO_START,         LOG_SYS_CAMERA,    LOG_LEVEL_INFO,  "Starting photography sequence (%s plan)"},
+    {LOG_FLIPPER_QUEUED,      LOG_SYS_SERVO,     LOG_LEVEL_DEBUG, "Moving flipper to %d"},
+    {LOG_FLIPPER_MOVED,       LOG_SYS_SERVO,     LOG_LEVEL_DEBUG, "Flipper moved to: %d"},
+    {LOG_FLIPPER_SETTLED,     LOG_SYS_SERVO,     LOG_LEVEL_DEBUG, "Flipper settled after %ums"},
+    {LOG_SETTLE_NOT_DETECTED, LOG_SYS_CAMERA,    LOG_LEVEL_WARN,  "WARNING: Flipper settle not detected, capturing anyway"},
+    {LOG_PHOTO_TAKING,        LOG_SYS_CAMERA,    LOG_LEVEL_DEBUG, "Taking photo %u of %u"},
+    {LOG_CAPTURE_FAILED,      LOG_SYS_CAMERA,    LOG_LEVEL_ERROR, "ERROR: Photo capture failed"},
+    {LOG_IMAGE_QUEUED,        LOG_SYS_CAMERA,    LOG_LEVEL_DEBUG, "Image queued: %u bytes"},
+    {LOG_IMAGE_SAVED,         LOG_SYS_STORAGE,   LOG_LEVEL_DEBUG, "Image saved: %u bytes in %ums"},
+    {LOG_IMAGE_SAVE_FAILED,   LOG_SYS_STORAGE,   LOG_LEVEL_ERROR, "ERROR: Image save failed"},
+    {LOG_FLIPPER_HOMING,      LOG_SYS_SERVO,     LOG_LEVEL_DEBUG, "Returning flipper to home position"},
+    {LOG_PHOTOS_DONE,         LOG_SYS_CAMERA,    LOG_LEVEL_INFO,  "Photography sequence complete: coin %u, %u images"},
+    {LOG_PHOTO_TIMEOUT,       LOG_SYS_CAMERA,    LOG_LEVEL_ERROR, "ERROR: Photography sequence timeout"},
+    {LOG_TRAPDOOR_OPENING,    LOG_SYS_SERVO,     LOG_LEVEL_INFO,  "Opening rejection trapdoor"},
+    {LOG_TRAPDOOR_MOVED,      LOG_SYS_SERVO,     LOG_LEVEL_DEBUG, "Trapdoor moved to: %d"},
+    {LOG_COIN_CLASSIFIED,     LOG_SYS_CAMERA,    LOG_LEVEL_INFO,  "Coin %u classified as %s (%u%%) in %uus"},
+    {LOG_TIMER_WHEEL_FULL,    LOG_SYS_STATE,     LOG_LEVEL_WARN,  "WARNING: Timer wheel full"},
+    {LOG_COINS_PRUNED,        LOG_SYS_STORAGE,   LOG_LEVEL_INFO,  "Pruned %u oldest coins, %u images"},
+    {LOG_PRUNE_FAILED,        LOG_SYS_STORAGE,   LOG_LEVEL_ERROR, "ERROR: Could not rewrite coin records; pruned rows kept"},
+    {LOG_CYCLE_ALLOCATED,     LOG_SYS_MEMORY,    LOG_LEVEL_WARN,  "WARNING: %u heap allocations on the control task this cycle"},
+    {LOG_FRAME_BLOCK_LOW,     LOG_SYS_MEMORY,    LOG_LEVEL_WARN,  "WARNING: Largest free block %u bytes, a frame buffer needs %u"}
+};
+
+// ==================== STATIC CHECKS ====================
+template<size_t N>
+constexpr bool logFormatsIndexed(const LogFormat (&formats)[N], size_t i = 0) {
+    return i >= N || (formats[i].id == i && logFormatsIndexed(formats, i + 1));
+}
+
+// Conversions in a format, %% excluded
+constexpr size_t logArgCount(const char* text) {
+    return *text == '\0' ? 0 :
+           (*text == '%' && text[1] == '%') ? logArgCount(text + 2) :
+           (*text == '%') + logArgCount(text + 1);
+}
+
+template<size_t N>
+constexpr bool logArgsFit(const LogFormat (&formats)[N], size_t i = 0) {
+    return i >= N || (logArgCount(formats[i].text) <= LOG_MAX_ARGS && logArgsFit(formats, i + 1));
+}
+
+static_assert(sizeof(LOG_FORMATS) / sizeof(LOG_FORMATS[0]) == LOG_ID_COUNT,
+              "Every LogId needs a row in LOG_FORMATS");
+static_assert(logFormatsIndexed(LOG_FORMATS), "LOG_FORMATS must be in LogId order");
+static_assert(logArgsFit(LOG_FORMATS), "A log format takes more than LOG_MAX_ARGS arguments");
+
+// ==================== COMPILE-TIME FILTER ====================
+template<uint8_t Id>
+struct LogCompiledIn {
+    static constexpr bool value = LOG_ENABLED && LOG_FORMATS[Id].level <= LOG_COMPILED_LEVEL;
+};
+
+// Record an event unless its level is compiled out. Call sites keep their
+// arguments type-checked, but the call and its argument evaluation vanish.
+#define LOG_EVENT(id, ...) \
+    do { \
+        if (LogCompiledIn<id>::value) { \
+            logEvent(id, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+// ==================== FORMATTING ====================
+// Render an event's message (without timestamp) into out. Returns its length.
+inline size_t formatLogEvent(const LogEvent& event, char* out, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    const char* text = event.id < LOG_ID_COUNT ? LOG_FORMATS[event.id].text : "Unknown event %u";
+    uintptr_t unknownArgs[LOG_MAX_ARGS] = {event.id};
+    const uintptr_t* args = event.id < LOG_ID_COUNT ? event.args : unknownArgs;
+    size_t len = 0;
+    int arg = 0;
+
+    for (const char* p = text; *p && len + 1 < size; p++) {
+        if (*p != '%' || p[1] == '\0') {
+            out[len++] = *p;
+            continue;
+        }
+        p++;
+        int n = 0;
+        switch (*p) {
+            case 'd':
+                n = snprintf(out + len, size - len, "%ld", (long)(intptr_t)args[arg++]);
+                break;
+            case 'u':
+                n = snprintf(out + len, size - len, "%lu", (unsigned long)args[arg++]);
+                break;
+            case 's': {
+                const char* s = (const char*)args[arg++];
+                n = snprintf(out + len, size - len, "%s", s ? s : "(null)");
+                break;
+            }
+            default:
+                out[len++] = *p;
+                break;
+        }
+        len += n;
+        if (len >= size) {
+            len = size - 1;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+#endif // EVENT_LOG_H
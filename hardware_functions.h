@@ -2,19 +2,218 @@
 #define HARDWARE_FUNCTIONS_H
 
 #include "config.h"
+#include "coin_classifier.h"
+#include "quality_controller.h"
+#include "coin_queue.h"
+#include "coin_sensor.h"
+#include "spsc_queue.h"
+#include "event_log.h"
+#include "init_graph.h"
+#include "alloc_counter.h"
+#include "scratch_pool.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "esp_camera.h"
+#include "img_converters.h"
 #include "FS.h"
 #include "SPIFFS.h"
+#include <Preferences.h>
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
 #include <ESP32Servo.h>
 #include <FastLED.h>
+#if TELEMETRY_UDP
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#endif
 
 // ==================== GLOBAL HARDWARE OBJECTS ====================
 extern Servo trapdoorServo;
 extern Servo flipperServo;
 extern CRGB cameraLEDs[NUM_CAMERA_LEDS];
 
+// Defined further down, used by the camera functions
+void setStatusLED(RGBColor color);
+void setCameraLights(bool on);
+void setCameraLightPattern(uint8_t pattern);
+
+// Last value commanded to each output. The setters only touch hardware
+// (and log) when the value changes, so states can re-assert outputs freely.
+struct OutputCache {
+    RGBColor statusLED;
+    bool statusLEDValid;          // False until the first write
+    uint8_t cameraLights;         // LIGHTS_* pattern
+    bool cameraLightsValid;
+    int trapdoorAngle;            // -1 until the first write
+    unsigned long writes;         // Hardware writes issued
+    unsigned long skipped;        // Writes dropped as unchanged
+};
+
+OutputCache outputs = {{0, 0, 0}, false, LIGHTS_OFF, false, -1, 0, 0};
+
+// ==================== EVENT LOG ====================
+// Ring of LogEvents shared by every task, the timer wheel and the sensor
+// ISR. Recording takes the lock for a 24-byte copy; the console task
+// formats and prints events at its own pace. When the ring is full new
+// events are counted and dropped, so what is printed stays in order.
+// Record with LOG_EVENT() (event_log.h) so compiled-out levels cost nothing.
+LogEvent logRing[LOG_RING_SIZE];
+uint32_t logHead = 0;
+uint32_t logTail = 0;
+uint32_t logDropped = 0;              // Since the console last printed
+uint32_t logDroppedTotal = 0;         // Since boot
+portMUX_TYPE logLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Runtime level per LogSubsystem, set from the console
+DRAM_ATTR volatile uint8_t logLevels[LOG_SYS_COUNT] = {
+    LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL,
+    LOG_DEFAULT_LEVEL
+};
+static_assert(LOG_SYS_COUNT == 6, "Give every subsystem a default level in logLevels");
+
+// Record an event; see LOG_FORMATS for each id's arguments. Safe from ISRs.
+void IRAM_ATTR logEvent(uint8_t id, uintptr_t a = 0, uintptr_t b = 0, uintptr_t c = 0, uintptr_t d = 0) {
+#if LOG_ENABLED
+    const LogFormat& format = LOG_FORMATS[id];
+    if (format.level > logLevels[format.subsystem]) {
+        return;
+    }
+    uint32_t now = micros();
+    portENTER_CRITICAL_SAFE(&logLock);
+    if (logTail - logHead >= LOG_RING_SIZE) {
+        logDropped++;
+        logDroppedTotal++;
+    } else {
+        LogEvent& event = logRing[logTail & (LOG_RING_SIZE - 1)];
+        event.timeUs = now;
+        event.id = id;
+        event.args[0] = a;
+        event.args[1] = b;
+        event.args[2] = c;
+        event.args[3] = d;
+        logTail++;
+    }
+    portEXIT_CRITICAL_SAFE(&logLock);
+#endif
+}
+
+// Print everything recorded so far. Console task only.
+void drainEventLog() {
+    char line[LOG_LINE_MAX];
+    for (;;) {
+        LogEvent event;
+        portENTER_CRITICAL(&logLock);
+        bool pending = logHead != logTail;
+        if (pending) {
+            event = logRing[logHead & (LOG_RING_SIZE - 1)];
+            logHead++;
+        }
+        uint32_t dropped = logDropped;
+        logDropped = 0;
+        portEXIT_CRITICAL(&logLock);
+        
+        if (dropped > 0) {
+            Serial.printf("[log] %u events dropped\n", (unsigned)dropped);
+        }
+        if (!pending) {
+            return;
+        }
+        formatLogEvent(event, line, sizeof(line));
+        const LogFormat& format = LOG_FORMATS[event.id];
+        Serial.printf("[%8lu.%03lu] %-7s %s\n", (unsigned long)(event.timeUs / 1000),
+                      (unsigned long)(event.timeUs % 1000), LOG_SUBSYSTEM_NAMES[format.subsystem], line);
+    }
+}
+
+// ==================== TRACE ====================
+// Ring of TraceEvents from every task and the sensor ISR. Recording claims
+// a slot with one atomic add, reads the cycle counter and writes three
+// words, with no lock, so it can sit on paths too hot for the event log.
+// The ring always holds the last TRACE_RING_SIZE events; the console task
+// dumps it (printTrace()) with recording paused.
+DRAM_ATTR TraceEvent traceRing[TRACE_RING_SIZE];
+DRAM_ATTR volatile uint32_t traceNext = 0;            // Events recorded since boot or 'trace clear'
+DRAM_ATTR volatile bool traceRecording = true;
+volatile bool traceDumpRequested = false;
+const char* traceDumpReason = "";
+
+// Record an event; see TRACE_KINDS for each id's arguments. Safe from ISRs.
+void IRAM_ATTR traceEvent(uint8_t id, uint32_t arg = 0, uint16_t arg2 = 0) {
+    if (!traceRecording) {
+        return;
+    }
+    uint32_t slot = __atomic_fetch_add(&traceNext, 1, __ATOMIC_RELAXED);
+    TraceEvent& event = traceRing[slot & (TRACE_RING_SIZE - 1)];
+    event.cycles = ESP.getCycleCount();
+    event.arg = arg;
+    event.arg2 = arg2;
+    event.id = id;
+    event.core = xPortGetCoreID();
+}
+
+// Anchor this core's cycle counter to esp_timer. Called by loop() and the
+// console task, which between them cover both cores.
+void traceSyncIfDue(unsigned long& lastSyncMs) {
+    unsigned long now = millis();
+    if (now - lastSyncMs >= TRACE_SYNC_INTERVAL) {
+        lastSyncMs = now;
+        TRACE(TRACE_SYNC, (uint32_t)esp_timer_get_time());
+    }
+}
+
+// Stop recording so the ring keeps what led up to now, and have the
+// console task print it. Recording resumes after the dump.
+void requestTraceDump(const char* reason) {
+    if (!TRACE_ENABLED || traceDumpRequested) {
+        return;
+    }
+    TRACE(TRACE_SYNC, (uint32_t)esp_timer_get_time());
+    traceRecording = false;
+    traceDumpReason = reason;
+    traceDumpRequested = true;
+}
+
+uint32_t traceEventsKept() {
+    uint32_t recorded = traceNext;
+    return recorded < TRACE_RING_SIZE ? recorded : TRACE_RING_SIZE;
+}
+
+// ==================== MEMORY PLACEMENT ====================
+// Large buffers are allocated once, at startup, where their PLACEMENT_*
+// policy says (see config.h)
+bool placeInPsram(uint8_t placement) {
+    return placement == PLACEMENT_PSRAM || (placement == PLACEMENT_AUTO && psramFound());
+}
+
+void* allocatePlaced(size_t bytes, uint8_t placement) {
+    if (placement == PLACEMENT_PSRAM && !psramFound()) {
+        return NULL;
+    }
+    return placeInPsram(placement) ? ps_malloc(bytes)
+                                   : heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+const char* getPlacementName(bool psram) {
+    return psram ? "PSRAM" : "internal";
+}
+
 // ==================== CAMERA FUNCTIONS ====================
-bool initializeCamera() {
+#if CAPTURE_MODE == CAPTURE_MODE_YUV422
+    #define RAW_PIXEL_FORMAT    PIXFORMAT_YUV422
+    #define RAW_BYTES_PER_PIXEL 2
+#else
+    #define RAW_PIXEL_FORMAT    PIXFORMAT_GRAYSCALE
+    #define RAW_BYTES_PER_PIXEL 1
+#endif
+
+QualityController imageQuality;
+
+bool allocateStackBuffers();
+
+// Configure and start the camera with its frame buffers in PSRAM or
+// internal RAM. Sensor settings made after a start are lost on restart.
+bool startCamera(bool framesInPsram) {
     camera_config_t config;
     config.ledc_channel = LEDC_CHANNEL_0;
     config.ledc_timer = LEDC_TIMER_0;
@@ -35,276 +234,2312 @@ bool initializeCamera() {
     config.pin_pwdn = -1;
     config.pin_reset = CAMERA_RESET_PIN;
     config.xclk_freq_hz = 20000000;
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
     config.pixel_format = PIXFORMAT_JPEG;
+#else
+    config.pixel_format = RAW_PIXEL_FORMAT;
+#endif
+    
+    // Frame size and quality settings
+    config.frame_size = CAMERA_FRAME_SIZE;
+    config.jpeg_quality = CAMERA_JPEG_QUALITY;
+    config.fb_count = CAMERA_FB_COUNT;
+    config.fb_location = framesInPsram ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+    config.grab_mode = CAMERA_GRAB_MODE;
+    
+    // Initialize camera
+    esp_err_t err = esp_camera_init(&config);
+    if (err != ESP_OK) {
+        DEBUG_PRINTLN("Camera init failed");
+        return false;
+    }
+    
+    // Set camera parameters
+    sensor_t * s = esp_camera_sensor_get();
+    s->set_brightness(s, CAMERA_BRIGHTNESS);
+    s->set_contrast(s, CAMERA_CONTRAST);
+    return true;
+}
+
+bool initializeCamera() {
+    if (FRAME_BUFFER_PLACEMENT == PLACEMENT_PSRAM && !psramFound()) {
+        DEBUG_PRINTLN("Frame buffers need PSRAM, none found");
+        return false;
+    }
+    if (!startCamera(placeInPsram(FRAME_BUFFER_PLACEMENT))) {
+        return false;
+    }
+    
+    qualityControllerInit(imageQuality);
+    
+    // Stacking buffers now, not on the first coin
+    if (STACK_FRAMES > 1 && !allocateStackBuffers()) {
+        DEBUG_PRINTLN("WARNING: No room for stacking buffers; storing single frames");
+    }
+    
+    DEBUG_PRINT("Frame buffers in ");
+    DEBUG_PRINTLN(getPlacementName(placeInPsram(FRAME_BUFFER_PLACEMENT)));
+
+    DEBUG_PRINTLN("Camera initialized successfully");
+    return true;
+}
+
+// ==================== EXPOSURE LOCK ====================
+// OV2640 sensor-bank registers (bit 8 selects the sensor bank in get_reg/set_reg)
+#define OV2640_REG_GAIN       0x100
+#define OV2640_REG_AEC_LO     0x104   // REG04[1:0] = AEC[1:0]
+#define OV2640_REG_AEC        0x110   // AEC[9:2]
+#define OV2640_REG_AEC_HI     0x145   // REG45[5:0] = AEC[15:10]
+// DSP-bank white balance: 0x40 in WB_MODE replaces AWB with the gains below
+#define OV2640_REG_WB_MODE    0xC7
+#define OV2640_WB_MANUAL      0x40
+#define OV2640_REG_WB_RED     0xCC
+#define OV2640_REG_WB_GREEN   0xCD
+#define OV2640_REG_WB_BLUE    0xCE
+
+struct ExposureLock {
+    uint16_t aec;
+    uint8_t gain;
+    uint8_t wbGains[3];           // Red, green, blue as AWB left them
+    bool whiteBalance;            // wbGains are valid; older calibrations lack them
+    bool locked;
+};
+
+ExposureLock exposureLock = {0, 0, {0, 0, 0}, false, false};
+uint8_t activeExposurePreset = EXPOSURE_SESSION;
+
+uint16_t readSensorExposure(sensor_t * s) {
+    return ((s->get_reg(s, OV2640_REG_AEC_HI, 0x3F) & 0x3F) << 10) |
+           ((s->get_reg(s, OV2640_REG_AEC, 0xFF) & 0xFF) << 2) |
+           (s->get_reg(s, OV2640_REG_AEC_LO, 0x03) & 0x03);
+}
+
+void writeSensorExposure(sensor_t * s, uint16_t aec) {
+    s->set_reg(s, OV2640_REG_AEC_HI, 0x3F, aec >> 10);
+    s->set_reg(s, OV2640_REG_AEC, 0xFF, (aec >> 2) & 0xFF);
+    s->set_reg(s, OV2640_REG_AEC_LO, 0x03, aec & 0x03);
+}
+
+// Switch AEC/AGC/AWB off and pin the sensor to the stored exposure, gain
+// and white balance gains
+void applyExposureLock(sensor_t * s) {
+    s->set_exposure_ctrl(s, 0);
+    s->set_gain_ctrl(s, 0);
+    writeSensorExposure(s, exposureLock.aec);
+    s->set_reg(s, OV2640_REG_GAIN, 0xFF, exposureLock.gain);
+    if (exposureLock.whiteBalance) {
+        // The white balance stage stays on, applying fixed gains
+        s->set_whitebal(s, 1);
+        s->set_reg(s, OV2640_REG_WB_RED, 0xFF, exposureLock.wbGains[0]);
+        s->set_reg(s, OV2640_REG_WB_GREEN, 0xFF, exposureLock.wbGains[1]);
+        s->set_reg(s, OV2640_REG_WB_BLUE, 0xFF, exposureLock.wbGains[2]);
+        s->set_reg(s, OV2640_REG_WB_MODE, 0xFF, OV2640_WB_MANUAL);
+    } else {
+        s->set_whitebal(s, 0);
+    }
+    exposureLock.locked = true;
+    activeExposurePreset = EXPOSURE_SESSION;
+}
+
+// Offset the locked exposure for one shot of a photo plan. Needs a lock;
+// gain stays at the locked value so only shutter time changes.
+void applyExposurePreset(uint8_t preset) {
+    if (!exposureLock.locked || preset == activeExposurePreset) {
+        return;
+    }
+    uint32_t aec = exposureLock.aec;
+    if (preset == EXPOSURE_PLUS_1EV) {
+        aec = min(aec * 2, (uint32_t)0xFFFF);
+    } else if (preset == EXPOSURE_MINUS_1EV) {
+        aec = max(aec / 2, (uint32_t)1);
+    }
+    writeSensorExposure(esp_camera_sensor_get(), aec);
+    activeExposurePreset = preset;
+}
+
+void saveExposureLock() {
+    Preferences prefs;
+    prefs.begin("camera", false);
+    prefs.putUShort("aec", exposureLock.aec);
+    prefs.putUChar("gain", exposureLock.gain);
+    prefs.putBytes("wb", exposureLock.wbGains, sizeof(exposureLock.wbGains));
+    prefs.end();
+}
+
+// Fall back to the last calibration if this session's one fails
+bool loadExposureLock() {
+    sensor_t * s = esp_camera_sensor_get();
+    if (!s || s->id.PID != OV2640_PID) {
+        return false;
+    }
+    
+    Preferences prefs;
+    prefs.begin("camera", true);
+    bool found = prefs.isKey("aec");
+    if (found) {
+        exposureLock.aec = prefs.getUShort("aec");
+        exposureLock.gain = prefs.getUChar("gain");
+        exposureLock.whiteBalance = prefs.getBytes("wb", exposureLock.wbGains, sizeof(exposureLock.wbGains)) ==
+                                    sizeof(exposureLock.wbGains);
+    }
+    prefs.end();
+    
+    if (!found) {
+        DEBUG_PRINTLN("No stored exposure calibration");
+        return false;
+    }
+    
+    applyExposureLock(s);
+    DEBUG_PRINT("Loaded exposure lock, AEC: ");
+    DEBUG_PRINT(exposureLock.aec);
+    DEBUG_PRINT(", gain: ");
+    DEBUG_PRINTLN(exposureLock.gain);
+    return true;
+}
+
+// Let AEC/AGC/AWB converge on the empty flipper under the camera lights,
+// then freeze them so every capture shares the same exposure and colour
+bool calibrateCameraExposure() {
+    sensor_t * s = esp_camera_sensor_get();
+    if (!s || s->id.PID != OV2640_PID) {
+        DEBUG_PRINTLN("Exposure calibration needs an OV2640");
+        return false;
+    }
+    
+    DEBUG_PRINTLN("Calibrating camera exposure...");
+    exposureLock.locked = false;
+    s->set_exposure_ctrl(s, 1);
+    s->set_gain_ctrl(s, 1);
+    s->set_reg(s, OV2640_REG_WB_MODE, 0xFF, 0);
+    s->set_whitebal(s, 1);
+    s->set_awb_gain(s, 1);
+    setCameraLights(true);
+    
+    uint16_t lastAec = 0;
+    int stableFrames = 0;
+    int frames = 0;
+    while (frames < CALIBRATION_MAX_FRAMES && stableFrames < CALIBRATION_STABLE_FRAMES) {
+        camera_fb_t * fb = esp_camera_fb_get();
+        if (!fb) {
+            DEBUG_PRINTLN("Calibration frame capture failed");
+            setCameraLights(false);
+            return false;
+        }
+        esp_camera_fb_return(fb);
+        frames++;
+        
+        uint16_t aec = readSensorExposure(s);
+        if (frames >= CALIBRATION_MIN_FRAMES && aec == lastAec) {
+            stableFrames++;
+        } else {
+            stableFrames = 0;
+        }
+        lastAec = aec;
+    }
+    
+    exposureLock.aec = lastAec;
+    exposureLock.gain = s->get_reg(s, OV2640_REG_GAIN, 0xFF);
+    exposureLock.wbGains[0] = s->get_reg(s, OV2640_REG_WB_RED, 0xFF);
+    exposureLock.wbGains[1] = s->get_reg(s, OV2640_REG_WB_GREEN, 0xFF);
+    exposureLock.wbGains[2] = s->get_reg(s, OV2640_REG_WB_BLUE, 0xFF);
+    exposureLock.whiteBalance = true;
+    applyExposureLock(s);
+    setCameraLights(false);
+    saveExposureLock();
+    
+    DEBUG_PRINT("Exposure locked after ");
+    DEBUG_PRINT(frames);
+    DEBUG_PRINT(" frames, AEC: ");
+    DEBUG_PRINT(exposureLock.aec);
+    DEBUG_PRINT(", gain: ");
+    DEBUG_PRINT(exposureLock.gain);
+    DEBUG_PRINTF(", white balance: %u/%u/%u\n", exposureLock.wbGains[0], exposureLock.wbGains[1],
+                 exposureLock.wbGains[2]);
+    if (stableFrames < CALIBRATION_STABLE_FRAMES) {
+        DEBUG_PRINTLN("WARNING: Exposure did not fully converge");
+    }
+    return true;
+}
+
+// ==================== RAW CAPTURE ====================
+// Raw capture container: this header, then `height` rows of `stride` bytes.
+// Little-endian, as written by the ESP32. tools/raw_to_image.py reads it.
+#define RAW_IMAGE_MAGIC       0x57415243   // "CRAW"
+#define RAW_IMAGE_VERSION     1
+#define RAW_FORMAT_GRAY8      1
+#define RAW_FORMAT_YUYV       2
+
+struct __attribute__((packed)) RawImageHeader {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t format;           // RAW_FORMAT_*
+    uint16_t headerSize;      // Offset of the first row
+    uint16_t width;           // Pixels per row
+    uint16_t height;          // Rows
+    uint32_t stride;          // Bytes per row
+    uint16_t originX;         // Crop origin within the captured frame
+    uint16_t originY;
+    uint16_t frameWidth;      // Captured frame the crop was taken from
+    uint16_t frameHeight;
+    uint32_t timestampMs;
+};
+
+// Header for a crop of the coin ROI out of the given raw frame
+RawImageHeader makeRawHeader(camera_fb_t * fb) {
+    int divisor = CAMERA_FRAME_WIDTH / fb->width;
+    
+    RawImageHeader header;
+    header.magic = RAW_IMAGE_MAGIC;
+    header.version = RAW_IMAGE_VERSION;
+    header.format = (RAW_BYTES_PER_PIXEL == 2) ? RAW_FORMAT_YUYV : RAW_FORMAT_GRAY8;
+    header.headerSize = sizeof(RawImageHeader);
+    header.originX = (COIN_ROI_X / divisor) & ~1;   // Keep YUYV pairs whole
+    header.originY = COIN_ROI_Y / divisor;
+    header.width = (COIN_ROI_WIDTH / divisor) & ~1;
+    header.height = COIN_ROI_HEIGHT / divisor;
+    header.stride = header.width * RAW_BYTES_PER_PIXEL;
+    header.frameWidth = fb->width;
+    header.frameHeight = fb->height;
+    header.timestampMs = millis();
+    return header;
+}
+
+// Write a raw container. `rows` points at the first pixel of the crop and
+// rowPitch is the distance in bytes between consecutive source rows.
+size_t writeRawImage(File& file, const uint8_t* rows, size_t rowPitch, const RawImageHeader& header) {
+    size_t written = file.write((const uint8_t*)&header, sizeof(header));
+    for (int y = 0; y < header.height; y++) {
+        written += file.write(rows, header.stride);
+        rows += rowPitch;
+    }
+    return written;
+}
+
+// Crop the coin ROI out of a raw frame and write it as a raw container.
+// Returns the number of bytes written.
+size_t writeRawCrop(File& file, camera_fb_t * fb) {
+    RawImageHeader header = makeRawHeader(fb);
+    const uint8_t* first = fb->buf + (header.originY * fb->width + header.originX) * RAW_BYTES_PER_PIXEL;
+    return writeRawImage(file, first, fb->width * RAW_BYTES_PER_PIXEL, header);
+}
+
+// ==================== FRAME STACKING ====================
+// Averages STACK_FRAMES frames of the ROI to cut sensor noise. Each frame
+// after the first is aligned to it by an integer-pixel SAD search on a
+// subsampled grid, then summed into a PSRAM accumulator.
+#define STACK_GRID_WIDTH      ((COIN_ROI_WIDTH + STACK_GRID_STEP - 1) / STACK_GRID_STEP)
+#define STACK_GRID_HEIGHT     ((COIN_ROI_HEIGHT + STACK_GRID_STEP - 1) / STACK_GRID_STEP)
+#define STACK_BUFFER_BYTES    (COIN_ROI_WIDTH * COIN_ROI_HEIGHT * RAW_BYTES_PER_PIXEL)
+
+uint16_t* stackAccumulator = NULL;    // One running sum per ROI byte
+uint8_t* stackResult = NULL;
+uint8_t stackReference[STACK_GRID_WIDTH * STACK_GRID_HEIGHT];
+unsigned long lastStackTimeMs = 0;    // Latency stacking added to the last capture
+
+bool allocateStackBuffers() {
+    if (stackAccumulator && stackResult) {
+        return true;
+    }
+    if (!stackAccumulator) {
+        stackAccumulator = (uint16_t*)allocatePlaced(STACK_BUFFER_BYTES * sizeof(uint16_t), SCRATCH_PLACEMENT);
+    }
+    if (!stackResult) {
+        stackResult = (uint8_t*)allocatePlaced(STACK_BUFFER_BYTES, SCRATCH_PLACEMENT);
+    }
+    return stackAccumulator && stackResult;
+}
+
+// Luma of a raw pixel (Y is the first byte in both formats)
+uint8_t rawLuma(camera_fb_t * fb, int x, int y) {
+    return fb->buf[(y * fb->width + x) * RAW_BYTES_PER_PIXEL];
+}
+
+// Find the shift that best lines `fb` up with the reference grid
+void registerFrame(camera_fb_t * fb, const RawImageHeader& header, int* bestDx, int* bestDy) {
+    uint32_t bestSad = UINT32_MAX;
+    *bestDx = 0;
+    *bestDy = 0;
+    
+    // YUYV shifts must be even so chroma pairs stay aligned
+    int step = RAW_BYTES_PER_PIXEL;
+    for (int dy = -STACK_SEARCH_RADIUS; dy <= STACK_SEARCH_RADIUS; dy++) {
+        for (int dx = -STACK_SEARCH_RADIUS & ~(step - 1); dx <= STACK_SEARCH_RADIUS; dx += step) {
+            int x0 = header.originX + dx;
+            int y0 = header.originY + dy;
+            if (x0 < 0 || y0 < 0 || x0 + header.width > (int)fb->width || y0 + header.height > (int)fb->height) {
+                continue;
+            }
+            
+            uint32_t sad = 0;
+            int i = 0;
+            for (int y = 0; y < header.height && sad < bestSad; y += STACK_GRID_STEP) {
+                for (int x = 0; x < header.width; x += STACK_GRID_STEP) {
+                    sad += abs(rawLuma(fb, x0 + x, y0 + y) - stackReference[i++]);
+                }
+            }
+            
+            if (sad < bestSad) {
+                bestSad = sad;
+                *bestDx = dx;
+                *bestDy = dy;
+            }
+        }
+    }
+}
+
+void accumulateFrame(camera_fb_t * fb, const RawImageHeader& header, int dx, int dy, bool first) {
+    const uint8_t* row = fb->buf + ((header.originY + dy) * fb->width + header.originX + dx) * RAW_BYTES_PER_PIXEL;
+    uint16_t* sum = stackAccumulator;
+    for (int y = 0; y < header.height; y++) {
+        for (uint32_t i = 0; i < header.stride; i++) {
+            sum[i] = first ? row[i] : sum[i] + row[i];
+        }
+        row += fb->width * RAW_BYTES_PER_PIXEL;
+        sum += header.stride;
+    }
+}
+
+// Stack `fb` with the next STACK_FRAMES - 1 frames and write the average.
+// The caller keeps ownership of `fb`.
+size_t writeStackedCrop(File& file, camera_fb_t * fb) {
+    unsigned long start = millis();
+    
+    if (!allocateStackBuffers()) {
+        DEBUG_PRINTLN("No stacking buffers, storing single frame");
+        lastStackTimeMs = 0;
+        return writeRawCrop(file, fb);
+    }
+    
+    RawImageHeader header = makeRawHeader(fb);
+    
+    // The first frame is the registration reference
+    int i = 0;
+    for (int y = 0; y < header.height; y += STACK_GRID_STEP) {
+        for (int x = 0; x < header.width; x += STACK_GRID_STEP) {
+            stackReference[i++] = rawLuma(fb, header.originX + x, header.originY + y);
+        }
+    }
+    accumulateFrame(fb, header, 0, 0, true);
+    
+    int stacked = 1;
+    for (int frame = 1; frame < STACK_FRAMES; frame++) {
+        camera_fb_t * next = esp_camera_fb_get();
+        if (!next) {
+            break;
+        }
+        if (next->width == fb->width) {
+            int dx, dy;
+            registerFrame(next, header, &dx, &dy);
+            accumulateFrame(next, header, dx, dy, false);
+            stacked++;
+        }
+        esp_camera_fb_return(next);
+    }
+    
+    // Average with a 16.16 fixed-point reciprocal instead of a divide per byte
+    uint32_t reciprocal = (65536 + stacked / 2) / stacked;
+    uint32_t bytes = header.stride * header.height;
+    for (uint32_t b = 0; b < bytes; b++) {
+        stackResult[b] = (stackAccumulator[b] * reciprocal + 32768) >> 16;
+    }
+    
+    lastStackTimeMs = millis() - start;
+    return writeRawImage(file, stackResult, header.stride, header);
+}
+
+// ==================== IMAGE SAVES ====================
+// Captured frames go to the storage task on core 0 together with their
+// filename, so loop() never waits on SPIFFS. The frame buffer is returned
+// once written. At most CAMERA_FB_COUNT - 1 frames are lent out this way,
+// so the driver always has one to fill and esp_camera_fb_get() on loop()
+// cannot block on the storage task; callers check isCaptureFrameFree().
+struct ImageSave {
+    camera_fb_t * fb;
+    char filename[IMAGE_FILENAME_MAX];
+    uint32_t coinId;              // The coin this is the first image of, else 0
+};
+
+// Outcome of a queued save, for the quality controller (owned by loop())
+struct ImageSaveResult {
+    uint32_t bytes;               // 0 if the write failed
+    uint32_t writeMs;
+};
+
+SpscQueue<ImageSave, STORAGE_QUEUE_SIZE> imageSaves;
+SpscQueue<ImageSaveResult, STORAGE_QUEUE_SIZE> imageSaveResults;
+TaskHandle_t storageTask = NULL;
+volatile uint8_t framesInFlight = 0;      // Queued or being written by the storage task
+unsigned long imageSavesInline = 0;       // Written by loop() itself: queue full or no task
+volatile uint32_t storageFreeBytes = 0;   // Refreshed by the storage task after each write
+uint32_t storageTotalBytes = 0;
+TelemetryHistogram imageWriteHistogram;   // Write times as loop() learns them (telemetry)
+
+// A capture now would not leave the driver without a frame buffer
+bool isCaptureFrameFree() {
+    return framesInFlight < CAMERA_FB_COUNT - 1;
+}
+
+// Write fb in the capture mode's format. Returns the bytes written, 0 on failure.
+size_t writeImageFile(const char* filename, camera_fb_t * fb) {
+    File file = SPIFFS.open(filename, FILE_WRITE);
+    if (!file) {
+        DEBUG_PRINTLN("Failed to open file for writing");
+        return 0;
+    }
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+    size_t written = file.write(fb->buf, fb->len);
+#else
+    size_t written = (STACK_FRAMES > 1) ? writeStackedCrop(file, fb) : writeRawCrop(file, fb);
+#endif
+    file.close();
+    return written;
+}
+
+// Feed finished queued saves to the quality controller. Returns false if
+// any of them failed.
+bool collectImageSaves() {
+    bool ok = true;
+    ImageSaveResult result;
+    while (imageSaveResults.pop(result)) {
+        if (result.bytes == 0) {
+            ok = false;
+        } else {
+            qualityControllerAddFrame(imageQuality, result.bytes, result.writeMs);
+            histogramAdd(imageWriteHistogram, result.writeMs);
+        }
+    }
+    return ok;
+}
+
+// coinId: set for a coin's first image, which the storage task measures for
+// the classifier as soon as it is written (see EarlyFeatures)
+bool captureAndSaveImage(const char* filename, uint8_t lights = LIGHTS_FULL, uint32_t coinId = 0) {
+    // Turn on camera lights
+    setCameraLightPattern(lights);
+    if (exposureLock.locked) {
+        // No convergence needed; just drop frames exposed before the lights came on
+        for (int i = 0; i < CAMERA_FB_COUNT; i++) {
+            camera_fb_t * stale = esp_camera_fb_get();
+            if (stale) {
+                esp_camera_fb_return(stale);
+            }
+        }
+        TRACE(TRACE_FRAMES_FLUSHED, CAMERA_FB_COUNT);
+    } else {
+        delay(CAMERA_WARMUP_TIME);
+    }
+    
+    // Capture image
+    camera_fb_t * fb = esp_camera_fb_get();
+    if (!fb) {
+        DEBUG_PRINTLN("Camera capture failed");
+        setCameraLights(false);
+        return false;
+    }
+    TRACE(TRACE_FRAME_READY, fb->len);
+    
+    // Hand the frame to the storage task. Stacking pulls more frames from
+    // the camera, so it has to finish here.
+    if (STACK_FRAMES == 1 && storageTask) {
+        ImageSave save;
+        save.fb = fb;
+        strlcpy(save.filename, filename, sizeof(save.filename));
+        save.coinId = coinId;
+        if (imageSaves.push(save)) {
+            __atomic_fetch_add(&framesInFlight, 1, __ATOMIC_RELAXED);
+            xTaskNotifyGive(storageTask);
+            setCameraLights(false);
+            LOG_EVENT(LOG_IMAGE_QUEUED, fb->len);
+            return true;
+        }
+    }
+    
+    // Save to SPIFFS
+    imageSavesInline++;
+    unsigned long writeStart = millis();
+    TRACE(TRACE_WRITE_BEGIN, fb->len);
+    size_t written = writeImageFile(filename, fb);
+    TRACE(TRACE_WRITE_END, written);
+    esp_camera_fb_return(fb);
+    
+    // Turn off camera lights
+    setCameraLights(false);
+    
+    if (written == 0) {
+        return false;
+    }
+    unsigned long writeMs = millis() - writeStart;
+    qualityControllerAddFrame(imageQuality, written, writeMs);
+    histogramAdd(imageWriteHistogram, writeMs);
+    LOG_EVENT(LOG_IMAGE_SAVED, written, writeMs);
+    return true;
+}
+
+// Width of the frames currently being captured
+uint16_t getCaptureFrameWidth() {
+    return imageQuality.reducedFrame ? CAMERA_FRAME_WIDTH / QUALITY_REDUCED_FRAME_DIVISOR : CAMERA_FRAME_WIDTH;
+}
+
+// Re-evaluate the image budget against free storage and push any new
+// quality / frame size to the sensor. Called between coins so both sides
+// of a coin share the same settings.
+void updateImageQuality() {
+    // The storage task's last figure; asking SPIFFS here could wait behind its writes
+    if (!qualityControllerUpdate(imageQuality, storageFreeBytes)) {
+        return;
+    }
+    
+    sensor_t * s = esp_camera_sensor_get();
+    s->set_framesize(s, imageQuality.reducedFrame ? QUALITY_REDUCED_FRAME_SIZE : CAMERA_FRAME_SIZE);
+    s->set_quality(s, imageQuality.quality);
+    
+    DEBUG_PRINT("Image quality now ");
+    DEBUG_PRINT(imageQuality.quality);
+    DEBUG_PRINT(imageQuality.reducedFrame ? " (reduced frame)" : "");
+    DEBUG_PRINT(", budget ");
+    DEBUG_PRINT(imageQuality.budgetBytes);
+    DEBUG_PRINTLN(" bytes");
+}
+
+bool isStorageFull() {
+    return imageQuality.storageFull;
+}
+
+// ==================== TIMER WHEEL ====================
+// Deadline scheduler on a single esp_timer. Actions run in the esp_timer
+// task at their deadline, to the microsecond, rather than on the next
+// loop() pass. They must be short and must not block (servo writes and the
+// like). Anything for the state machine is handed over as a completion
+// event with postTimerEvent(), which also wakes loop().
+typedef void (*TimerAction)(uint32_t arg);
+
+struct TimerSlot {
+    int64_t deadlineUs;           // esp_timer_get_time() clock
+    TimerAction action;
+    uint32_t arg;
+    bool active;
+};
+
+TimerSlot timerSlots[TIMER_WHEEL_SLOTS];
+esp_timer_handle_t timerWheelTimer = NULL;
+portMUX_TYPE timerWheelLock = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t loopTask = NULL;
+
+// Completion events; the esp_timer task is the only producer and loop()
+// the only consumer, so head and tail need no lock
+volatile uint8_t timerEvents[TIMER_EVENT_QUEUE];
+volatile uint8_t timerEventHead = 0;
+volatile uint8_t timerEventTail = 0;
+unsigned long timerEventsDropped = 0;
+
+// How late actions started against their deadline
+unsigned long timerActionsRun = 0;
+uint32_t timerMaxLateUs = 0;
+uint32_t timerAvgLateUs = 0;
+
+// Arm the esp_timer for the earliest pending deadline. Call with the lock held.
+void armTimerWheel() {
+    int64_t earliest = INT64_MAX;
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        if (timerSlots[i].active && timerSlots[i].deadlineUs < earliest) {
+            earliest = timerSlots[i].deadlineUs;
+        }
+    }
+    esp_timer_stop(timerWheelTimer);
+    if (earliest != INT64_MAX) {
+        int64_t wait = earliest - esp_timer_get_time();
+        esp_timer_start_once(timerWheelTimer, wait > 0 ? wait : 0);
+    }
+}
+
+void runTimerWheel(void*) {
+    for (;;) {
+        int64_t now = esp_timer_get_time();
+        int due = -1;
+        
+        portENTER_CRITICAL(&timerWheelLock);
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            if (timerSlots[i].active && timerSlots[i].deadlineUs <= now &&
+                (due < 0 || timerSlots[i].deadlineUs < timerSlots[due].deadlineUs)) {
+                due = i;
+            }
+        }
+        if (due < 0) {
+            armTimerWheel();
+            portEXIT_CRITICAL(&timerWheelLock);
+            return;
+        }
+        TimerSlot slot = timerSlots[due];
+        timerSlots[due].active = false;
+        portEXIT_CRITICAL(&timerWheelLock);
+        
+        uint32_t lateUs = now - slot.deadlineUs;
+        timerMaxLateUs = max(timerMaxLateUs, lateUs);
+        timerAvgLateUs = (timerAvgLateUs * 7 + lateUs) / 8;
+        timerActionsRun++;
+        slot.action(slot.arg);
+    }
+}
+
+// Run action(arg) at deadlineUs. Returns false if every slot is taken.
+bool scheduleAt(int64_t deadlineUs, TimerAction action, uint32_t arg) {
+    bool scheduled = false;
+    portENTER_CRITICAL(&timerWheelLock);
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        if (!timerSlots[i].active) {
+            timerSlots[i].deadlineUs = deadlineUs;
+            timerSlots[i].action = action;
+            timerSlots[i].arg = arg;
+            timerSlots[i].active = true;
+            scheduled = true;
+            break;
+        }
+    }
+    if (scheduled) {
+        armTimerWheel();
+    }
+    portEXIT_CRITICAL(&timerWheelLock);
+    
+    if (!scheduled) {
+        LOG_EVENT(LOG_TIMER_WHEEL_FULL);
+    }
+    return scheduled;
+}
+
+bool scheduleAfter(uint32_t delayUs, TimerAction action, uint32_t arg) {
+    return scheduleAt(esp_timer_get_time() + delayUs, action, arg);
+}
+
+// Drop every pending run of action
+void cancelTimerAction(TimerAction action) {
+    portENTER_CRITICAL(&timerWheelLock);
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        if (timerSlots[i].action == action) {
+            timerSlots[i].active = false;
+        }
+    }
+    armTimerWheel();
+    portEXIT_CRITICAL(&timerWheelLock);
+}
+
+void wakeLoop() {
+    if (loopTask) {
+        xTaskNotifyGive(loopTask);
+    }
+}
+
+void IRAM_ATTR wakeLoopFromISR() {
+    if (loopTask) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(loopTask, &woken);
+        if (woken) {
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+// loop() sleeps here until a timer action or the sensor wakes it, or maxMs passes
+void waitForWork(unsigned long maxMs) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(maxMs));
+}
+
+// From timer actions only
+bool postTimerEvent(uint8_t event) {
+    if ((uint8_t)(timerEventTail - timerEventHead) >= TIMER_EVENT_QUEUE) {
+        timerEventsDropped++;
+        return false;
+    }
+    timerEvents[timerEventTail & (TIMER_EVENT_QUEUE - 1)] = event;
+    timerEventTail++;
+    wakeLoop();
+    return true;
+}
+
+// From loop() only
+bool takeTimerEvent(uint8_t* event) {
+    if (timerEventHead == timerEventTail) {
+        return false;
+    }
+    *event = timerEvents[timerEventHead & (TIMER_EVENT_QUEUE - 1)];
+    timerEventHead++;
+    return true;
+}
+
+// Must run from loop()'s task, before anything schedules
+bool initializeTimerWheel() {
+    loopTask = xTaskGetCurrentTaskHandle();
+    
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = runTimerWheel;
+    timerArgs.dispatch_method = ESP_TIMER_TASK;
+    timerArgs.name = "wheel";
+    if (esp_timer_create(&timerArgs, &timerWheelTimer) != ESP_OK) {
+        DEBUG_PRINTLN("Timer wheel creation failed");
+        return false;
+    }
+    return true;
+}
+
+// ==================== HEAP ====================
+// Once setup() is done, loop()'s task must not allocate: no Strings, no
+// per-coin buffers. The coin cycle check in coin_machine_firmware.ino
+// watches controlAllocs for regressions. Other tasks are counted apart;
+// the Arduino file system allocates on every open, which the storage and
+// console tasks absorb. Counting needs ESP-IDF's CONFIG_HEAP_USE_HOOKS;
+// without it both counters stay at zero.
+AllocCounter controlAllocs = {};
+AllocCounter otherAllocs = {};
+
+#ifdef CONFIG_HEAP_USE_HOOKS
+#define ALLOC_COUNTING        true
+
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    countAllocation(xTaskGetCurrentTaskHandle() == loopTask ? controlAllocs : otherAllocs, size);
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void* ptr) {
+}
+#else
+#define ALLOC_COUNTING        false
+#endif
+
+// ==================== SERVO FUNCTIONS ====================
+// Flipper moves follow a minimum-jerk (quintic S-curve) profile instead of
+// one step to the target, so the coin arrives without overshoot and
+// ringing. A one-shot esp_timer streams the intermediate pulse widths,
+// each step arming the next.
+//
+// Moves start on loop() or on the esp_timer task (moveFlipperAction()),
+// and esp_timer_stop() doesn't wait out a step that is already running.
+// So the profile is only read or changed under flipperProfileLock, and
+// each start bumps profileGeneration: a step left over from the previous
+// profile sees the change and neither re-arms nor records its pulse.
+esp_timer_handle_t flipperProfileTimer = NULL;
+portMUX_TYPE flipperProfileLock = portMUX_INITIALIZER_UNLOCKED;
+volatile bool flipperProfileActive = false;
+volatile int flipperPulseUs = 0;      // Last pulse width sent to the flipper
+uint32_t profileGeneration = 0;
+int profileFromUs = 0;
+int profileToUs = 0;
+int64_t profileStartUs = 0;
+uint32_t profileDurationUs = 0;
+
+int angleToPulse(int angle) {
+    return SERVO_MIN_PULSE_US + (long)(SERVO_MAX_PULSE_US - SERVO_MIN_PULSE_US) * angle / 180;
+}
+
+// Shortest duration for a move of `distance` degrees that keeps the quintic's
+// peak speed, acceleration and jerk within limits
+uint32_t getFlipperProfileTime(int distance) {
+    if (distance == 0) {
+        return 0;
+    }
+    float speedLimited = 1.875f * distance / FLIPPER_MAX_SPEED;
+    float accelLimited = sqrtf(5.7735f * distance / FLIPPER_MAX_ACCEL);
+    float jerkLimited = cbrtf(60.0f * distance / FLIPPER_MAX_JERK);
+    float seconds = max(speedLimited, max(accelLimited, jerkLimited));
+    return (uint32_t)(seconds * 1000.0f) + 1;
+}
+
+void flipperProfileStep(void*) {
+    portENTER_CRITICAL(&flipperProfileLock);
+    if (!flipperProfileActive) {
+        portEXIT_CRITICAL(&flipperProfileLock);
+        return;
+    }
+    uint32_t generation = profileGeneration;
+    int64_t elapsed = esp_timer_get_time() - profileStartUs;
+    int pulse;
+    bool last = elapsed >= profileDurationUs;
+    if (last) {
+        pulse = profileToUs;
+        flipperProfileActive = false;
+    } else {
+        float t = (float)elapsed / profileDurationUs;
+        float s = t * t * t * (10.0f + t * (-15.0f + 6.0f * t));
+        pulse = profileFromUs + (int)((profileToUs - profileFromUs) * s);
+    }
+    portEXIT_CRITICAL(&flipperProfileLock);
+    
+    // A newer profile's next step corrects this write if one started since
+    flipperServo.writeMicroseconds(pulse);
+    
+    portENTER_CRITICAL(&flipperProfileLock);
+    bool current = generation == profileGeneration;
+    if (current) {
+        flipperPulseUs = pulse;
+    }
+    portEXIT_CRITICAL(&flipperProfileLock);
+    if (current && !last) {
+        esp_timer_start_once(flipperProfileTimer, FLIPPER_PROFILE_PERIOD_MS * 1000UL);
+    }
+}
+
+void startFlipperProfile(int angle) {
+    portENTER_CRITICAL(&flipperProfileLock);
+    profileGeneration++;
+    // Start from wherever the last profile left the flipper
+    profileFromUs = flipperPulseUs;
+    profileToUs = angleToPulse(angle);
+    int distance = abs(profileToUs - profileFromUs) * 180 / (SERVO_MAX_PULSE_US - SERVO_MIN_PULSE_US);
+    profileDurationUs = getFlipperProfileTime(distance) * 1000UL;
+    profileStartUs = esp_timer_get_time();
+    flipperProfileActive = true;
+    portEXIT_CRITICAL(&flipperProfileLock);
+    
+    // The old profile's pending step, if any; this one arms its own
+    esp_timer_stop(flipperProfileTimer);
+    flipperProfileStep(NULL);
+}
+
+bool isFlipperMoving() {
+    return flipperProfileActive;
+}
+
+// Trapdoor reject cycle: open, hold TRAPDOOR_OPEN_TIME, close, allow
+// TRAPDOOR_CLOSE_TIME. Runs alongside the state machine so it can take the
+// next coin as soon as the chute is clear. Every step runs on loop(); the
+// timer wheel only wakes it at the deadline, so a step can never race a
+// new reject or an early close.
+enum TrapdoorPhase {
+    TRAPDOOR_IDLE,
+    TRAPDOOR_HOLDING,
+    TRAPDOOR_CLOSING
+};
+
+volatile TrapdoorPhase trapdoorPhase = TRAPDOOR_IDLE;
+unsigned long trapdoorStepAt = 0;         // millis() of the next step
+unsigned long trapdoorCycles = 0;
+
+// Settle time model: settle = base + perDegree * |angle moved|. Calibrated
+// by calibrateServoTiming(); until then a move waits its profile time plus
+// FLIPPER_PROFILE_SETTLE, or SERVO_MOVE_DELAY when profiles are off.
+struct ServoTimingModel {
+    uint16_t baseMs;
+    uint16_t perDegreeUs;
+    bool calibrated;
+};
+
+// Moves may start on the esp_timer task (moveFlipperAction()) while loop()
+// reads these, so all of them are volatile. A move writes its angle, settle
+// time and start before bumping flipperMoveCount.
+ServoTimingModel flipperTiming = {SERVO_MOVE_DELAY, 0, false};
+volatile int flipperAngle = FLIPPER_HOME;
+volatile unsigned long flipperSettleMs = SERVO_MOVE_DELAY;   // Wait needed by the last move
+volatile unsigned long flipperMoveStart = 0;
+volatile unsigned long flipperMoveCount = 0;
+volatile unsigned long flipperSettledMove = 0;      // Last move whose settle time has passed
+volatile bool flipperSettlePolled = false;          // The wheel was full; poll the settle deadline
+
+unsigned long getFlipperSettleTime(int fromAngle, int toAngle) {
+    if (!flipperTiming.calibrated) {
+        if (FLIPPER_PROFILED_MOVES) {
+            return getFlipperProfileTime(abs(toAngle - fromAngle)) + FLIPPER_PROFILE_SETTLE;
+        }
+        return SERVO_MOVE_DELAY;
+    }
+    unsigned long settle = flipperTiming.baseMs + (unsigned long)flipperTiming.perDegreeUs * abs(toAngle - fromAngle) / 1000;
+    settle += SERVO_SETTLE_MARGIN;
+    return max(settle, (unsigned long)SERVO_MIN_SETTLE);
+}
+
+bool loadServoTiming() {
+    Preferences prefs;
+    prefs.begin("servo", true);
+    bool found = prefs.isKey("base");
+    if (found) {
+        flipperTiming.baseMs = prefs.getUShort("base");
+        flipperTiming.perDegreeUs = prefs.getUShort("perdeg");
+        flipperTiming.calibrated = true;
+    }
+    prefs.end();
+    return found;
+}
+
+void saveServoTiming() {
+    Preferences prefs;
+    prefs.begin("servo", false);
+    prefs.putUShort("base", flipperTiming.baseMs);
+    prefs.putUShort("perdeg", flipperTiming.perDegreeUs);
+    prefs.end();
+}
+
+// waitForHome: hold off until the servos have reached home. A warm boot
+// can skip it; they were in use a moment ago.
+bool initializeServos(bool waitForHome) {
+    // Keep the servos off LEDC timer 0, whose channel 0 drives the camera's
+    // XCLK (initializeCamera()), so they can attach whether or not the
+    // camera is up
+    ESP32PWM::allocateTimer(1);
+    ESP32PWM::allocateTimer(2);
+    ESP32PWM::allocateTimer(3);
+    trapdoorServo.attach(TRAPDOOR_SERVO_PIN);
+    flipperServo.attach(FLIPPER_SERVO_PIN, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
+    
+    // Move to home positions
+    trapdoorServo.write(TRAPDOOR_CLOSED);
+    outputs.trapdoorAngle = TRAPDOOR_CLOSED;
+    flipperServo.write(FLIPPER_HOME);
+    flipperPulseUs = angleToPulse(FLIPPER_HOME);
+    
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = flipperProfileStep;
+    timerArgs.dispatch_method = ESP_TIMER_TASK;
+    timerArgs.name = "flipper";
+    if (esp_timer_create(&timerArgs, &flipperProfileTimer) != ESP_OK) {
+        DEBUG_PRINTLN("Flipper profile timer creation failed");
+        return false;
+    }
+    
+    if (waitForHome) {
+        delay(SERVO_HOME_WAIT); // Allow servos to reach position
+    }
+    
+    if (loadServoTiming()) {
+        DEBUG_PRINT("Flipper timing: ");
+        DEBUG_PRINT(flipperTiming.baseMs);
+        DEBUG_PRINT("ms + ");
+        DEBUG_PRINT(flipperTiming.perDegreeUs);
+        DEBUG_PRINTLN("us/deg");
+    }
+    
+    DEBUG_PRINTLN("Servos initialized");
+    return true;
+}
+
+void setTrapdoorPosition(int angle) {
+    if (angle == outputs.trapdoorAngle) {
+        outputs.skipped++;
+        return;
+    }
+    trapdoorServo.write(angle);
+    outputs.trapdoorAngle = angle;
+    outputs.writes++;
+    TRACE(TRACE_TRAPDOOR_MOVE, angle);
+    LOG_EVENT(LOG_TRAPDOOR_MOVED, angle);
+}
+
+void flipperSettledAction(uint32_t moveCount) {
+    flipperSettledMove = moveCount;
+    wakeLoop();
+}
+
+// May run from a timer action (see moveFlipperAction())
+void setFlipperPosition(int angle) {
+    flipperSettleMs = getFlipperSettleTime(flipperAngle, angle);
+    flipperAngle = angle;
+    flipperMoveStart = millis();
+    flipperMoveCount++;
+    cancelTimerAction(flipperSettledAction);
+    flipperSettlePolled = !scheduleAfter(flipperSettleMs * 1000UL, flipperSettledAction, flipperMoveCount);
+    if (FLIPPER_PROFILED_MOVES) {
+        startFlipperProfile(angle);
+    } else {
+        flipperServo.write(angle);
+        flipperPulseUs = angleToPulse(angle);
+    }
+    TRACE(TRACE_FLIPPER_MOVE, angle);
+    LOG_EVENT(LOG_FLIPPER_MOVED, angle);
+}
+
+void openTrapdoor() {
+    setTrapdoorPosition(TRAPDOOR_OPEN);
+}
+
+void closeTrapdoor() {
+    setTrapdoorPosition(TRAPDOOR_CLOSED);
+}
+
+void moveFlipperHome() {
+    setFlipperPosition(FLIPPER_HOME);
+}
+
+void moveFlipperToSide1() {
+    setFlipperPosition(FLIPPER_SIDE_1);
+}
+
+void moveFlipperToSide2() {
+    setFlipperPosition(FLIPPER_SIDE_2);
+}
+
+// Timed flipper move, e.g. FLIPPER_PHOTO_DELAY after a capture
+void moveFlipperAction(uint32_t angle) {
+    setFlipperPosition(angle);
+    wakeLoop();
+}
+
+void trapdoorWakeAction(uint32_t) {
+    wakeLoop();
+}
+
+// If the wheel is full the step waits for loop()'s next idle pass instead
+void scheduleTrapdoorStep(unsigned long delayMs) {
+    trapdoorStepAt = millis() + delayMs;
+    cancelTimerAction(trapdoorWakeAction);
+    scheduleAfter(delayMs * 1000UL, trapdoorWakeAction, 0);
+}
+
+void trapdoorCycleStep() {
+    if (trapdoorPhase == TRAPDOOR_HOLDING) {
+        closeTrapdoor();
+        trapdoorPhase = TRAPDOOR_CLOSING;
+        scheduleTrapdoorStep(TRAPDOOR_CLOSE_TIME);
+    } else {
+        trapdoorPhase = TRAPDOOR_IDLE;
+        cancelTimerAction(trapdoorWakeAction);
+    }
+}
+
+// Every loop() pass: take the cycle's next step once it is due
+void runTrapdoorCycle(unsigned long now) {
+    if (trapdoorPhase != TRAPDOOR_IDLE && (long)(now - trapdoorStepAt) >= 0) {
+        trapdoorCycleStep();
+    }
+}
+
+// Open the trapdoor and let the cycle close it. Restarts the hold if a
+// cycle is already running.
+void startRejectCycle() {
+    openTrapdoor();
+    trapdoorPhase = TRAPDOOR_HOLDING;
+    trapdoorCycles++;
+    scheduleTrapdoorStep(TRAPDOOR_OPEN_TIME);
+}
+
+// Close now instead of at the end of the hold, e.g. because the next coin
+// is already on its way
+void endTrapdoorHold() {
+    if (trapdoorPhase == TRAPDOOR_HOLDING) {
+        trapdoorCycleStep();
+    }
+}
+
+// Stop the cycle and leave the trapdoor closed
+void stopRejectCycle() {
+    cancelTimerAction(trapdoorWakeAction);
+    trapdoorPhase = TRAPDOOR_IDLE;
+    closeTrapdoor();
+}
+
+bool isTrapdoorIdle() {
+    return trapdoorPhase == TRAPDOOR_IDLE;
+}
+
+// ==================== LED FUNCTIONS ====================
+bool initializeLEDs() {
+    // Initialize status LED pins
+    pinMode(STATUS_LED_R_PIN, OUTPUT);
+    pinMode(STATUS_LED_G_PIN, OUTPUT);
+    pinMode(STATUS_LED_B_PIN, OUTPUT);
+    
+    // Initialize camera LEDs (WS2812B)
+    FastLED.addLeds<WS2812B, CAMERA_LIGHTS_PIN, GRB>(cameraLEDs, NUM_CAMERA_LEDS);
+    FastLED.setBrightness(CAMERA_LED_BRIGHTNESS);
+    
+    // Turn off all LEDs initially
+    setStatusLED(LED_OFF);
+    setCameraLights(false);
+    
+    DEBUG_PRINTLN("LEDs initialized");
+    return true;
+}
+
+void setStatusLED(RGBColor color) {
+    if (outputs.statusLEDValid && color.r == outputs.statusLED.r &&
+        color.g == outputs.statusLED.g && color.b == outputs.statusLED.b) {
+        outputs.skipped++;
+        return;
+    }
+    outputs.statusLED = color;
+    outputs.statusLEDValid = true;
+    outputs.writes++;
+    analogWrite(STATUS_LED_R_PIN, map(color.r, 0, 255, 0, STATUS_LED_BRIGHTNESS));
+    analogWrite(STATUS_LED_G_PIN, map(color.g, 0, 255, 0, STATUS_LED_BRIGHTNESS));
+    analogWrite(STATUS_LED_B_PIN, map(color.b, 0, 255, 0, STATUS_LED_BRIGHTNESS));
+}
+
+void setCameraLightPattern(uint8_t pattern) {
+    if (outputs.cameraLightsValid && pattern == outputs.cameraLights) {
+        outputs.skipped++;
+        return;
+    }
+    outputs.cameraLights = pattern;
+    outputs.cameraLightsValid = true;
+    outputs.writes++;
+    fill_solid(cameraLEDs, NUM_CAMERA_LEDS, CRGB::Black);
+    if (pattern == LIGHTS_FULL) {
+        fill_solid(cameraLEDs, NUM_CAMERA_LEDS, CRGB::White);
+    } else if (pattern == LIGHTS_RAKING) {
+        fill_solid(cameraLEDs, NUM_CAMERA_LEDS / 2, CRGB::White);
+    }
+    FastLED.show();
+}
+
+void setCameraLights(bool on) {
+    setCameraLightPattern(on ? LIGHTS_FULL : LIGHTS_OFF);
+}
+
+void flashCameraLights() {
+    setCameraLights(true);
+    delay(CAMERA_FLASH_DURATION);
+    setCameraLights(false);
+}
+
+// ==================== SENSOR FUNCTIONS ====================
+// Every coin the sensor sees goes into coinQueue until the state machine
+// admits it to the flipper or rejects it. The edge handling itself is in
+// coin_sensor.h, shared with the host replay tool.
+CoinQueue coinQueue;
+SensorState sensorState;
+SpscQueue<SensorEdgeRecord, SENSOR_RECORD_QUEUE_SIZE> sensorEdges;   // For SENSOR RECORDING
+
+void IRAM_ATTR sensorInterrupt() {
+    unsigned long currentTime = millis();
+    int level = digitalRead(OPTICAL_SENSOR_PIN);
+    TRACE(TRACE_SENSOR_EDGE, level);
+    if (SENSOR_RECORD_ENABLED) {
+        SensorEdgeRecord edge = {(uint32_t)micros(), (uint8_t)(level == HIGH ? SENSOR_EDGE_CLEAR : SENSOR_EDGE_BLOCKED)};
+        sensorEdges.push(edge);
+    }
+    
+    if (sensorEdge(sensorState, coinQueue, level == LOW, currentTime)) {
+        wakeLoopFromISR();
+        LOG_EVENT(LOG_SENSOR_TRIGGERED, coinQueueCount(coinQueue));
+    }
+}
+
+bool initializeSensor() {
+    pinMode(OPTICAL_SENSOR_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(OPTICAL_SENSOR_PIN), sensorInterrupt, CHANGE);
+    
+    DEBUG_PRINTLN("Optical sensor initialized");
+    return true;
+}
+
+// A sensed coin is waiting to be admitted or rejected
+bool hasQueuedCoin() {
+    return coinQueueCount(coinQueue) > 0;
+}
+
+unsigned long getSensorTriggerCount() {
+    return sensorState.triggerCount;
+}
+
+// How long the most recent coin blocked the sensor (ms)
+unsigned long getLastBlockTime() {
+    return sensorState.lastBlockTime;
+}
+
+// A coin is in front of the sensor right now
+bool isSensorBlocked() {
+    return sensorState.blockStart != 0;
+}
+
+// Each watch of the chute gets a number, bumped when it starts or stops.
+// A check the wheel had already taken when the watch was cancelled still
+// runs; it carries its watch's number, so neither its re-arm nor its
+// "clear" outlives that watch (compare flipperSettledAction()).
+volatile uint32_t chuteWatch = 0;
+volatile uint32_t chuteClearWatch = 0;      // Watch that found the chute clear, 0 if none
+
+// Reports the chute clear once nothing is passing the sensor. Scheduled
+// TRAPDOOR_DROP_TIME after the trapdoor opens (see watchChute()).
+void chuteCheckAction(uint32_t watch) {
+    if (watch != chuteWatch) {
+        return;
+    }
+    if (isSensorBlocked()) {
+        scheduleAfter(CHUTE_POLL_INTERVAL * 1000UL, chuteCheckAction, watch);
+    } else {
+        chuteClearWatch = watch;
+        wakeLoop();
+    }
+}
+
+void bumpChuteWatch() {
+    // 0 means "no watch" in chuteClearWatch
+    if (++chuteWatch == 0) {
+        chuteWatch = 1;
+    }
+}
+
+void watchChute() {
+    cancelTimerAction(chuteCheckAction);
+    bumpChuteWatch();
+    scheduleAfter(TRAPDOOR_DROP_TIME * 1000UL, chuteCheckAction, chuteWatch);
+}
+
+void stopWatchingChute() {
+    cancelTimerAction(chuteCheckAction);
+    bumpChuteWatch();
+}
+
+// From loop(): true once per watch, when the current one found the chute clear
+bool takeChuteClear() {
+    uint32_t watch = chuteClearWatch;
+    if (watch == 0 || watch != chuteWatch) {
+        return false;
+    }
+    chuteClearWatch = 0;
+    return true;
+}
+
+// Forget every queued coin, e.g. after a reset when their positions are unknown
+void resetSensorCount() {
+    coinQueueClear(coinQueue);
+}
+
+// Coins that dropped together with the next queued coin
+uint8_t getCoinsInWindow() {
+    return coinsInWindow(coinQueue);
+}
+
+// Time left in the next queued coin's detection window (ms)
+unsigned long getDetectionWindowRemaining() {
+    return detectionWindowRemaining(coinQueue, millis());
+}
+
+bool isMultipleCoinDetected() {
+    uint8_t coins = getCoinsInWindow();
+    bool multipleCoins = multipleCoinsInWindow(coinQueue);
+    LOG_EVENT(LOG_WINDOW_RESULT, coins, LOG_STR(multipleCoins ? "YES" : "NO"));
+    return multipleCoins;
+}
+
+// ==================== CLASSIFIER FUNCTIONS ====================
+#define CLASSIFIER_THUMB_WIDTH  (CAMERA_FRAME_WIDTH / CLASSIFIER_SCALE)
+#define CLASSIFIER_THUMB_HEIGHT (CAMERA_FRAME_HEIGHT / CLASSIFIER_SCALE)
+
+#if CLASSIFIER_SCALE == 8
+    #define CLASSIFIER_JPEG_SCALE JPG_SCALE_8X
+#elif CLASSIFIER_SCALE == 4
+    #define CLASSIFIER_JPEG_SCALE JPG_SCALE_4X
+#elif CLASSIFIER_SCALE == 2
+    #define CLASSIFIER_JPEG_SCALE JPG_SCALE_2X
+#else
+    #define CLASSIFIER_JPEG_SCALE JPG_SCALE_NONE
+#endif
+
+// Downscaled RGB565 copy of the frame being classified (big-endian pixels).
+// Classification runs on the storage task and motion detection in loop(),
+// so each has its own.
+uint8_t classifierThumb[CLASSIFIER_THUMB_WIDTH * CLASSIFIER_THUMB_HEIGHT * 2];
+uint8_t motionThumb[CLASSIFIER_THUMB_WIDTH * CLASSIFIER_THUMB_HEIGHT * 2];
+
+uint8_t thumbLuma(const uint8_t* thumb, int stride, int x, int y, uint8_t* r, uint8_t* g, uint8_t* b) {
+    int index = (y * stride + x) * 2;
+    uint16_t pixel = (thumb[index] << 8) | thumb[index + 1];
+    *r = (pixel >> 11) << 3;
+    *g = ((pixel >> 5) & 0x3F) << 2;
+    *b = (pixel & 0x1F) << 3;
+    return (*r * 77 + *g * 150 + *b * 29) >> 8;
+}
+
+void yuvToRgb(uint8_t y, uint8_t u, uint8_t v, uint8_t* r, uint8_t* g, uint8_t* b) {
+    int d = u - 128;
+    int e = v - 128;
+    *r = constrain(y + ((359 * e) >> 8), 0, 255);
+    *g = constrain(y - ((88 * d + 183 * e) >> 8), 0, 255);
+    *b = constrain(y + ((454 * d) >> 8), 0, 255);
+}
+
+// Fill the ROI part of classifierThumb from a raw capture by sampling
+// every CLASSIFIER_SCALE-th pixel. Grayscale captures give r = g = b.
+bool loadRawThumb(File& file, int frameDivisor) {
+    static uint8_t row[COIN_ROI_WIDTH * RAW_BYTES_PER_PIXEL];
+    
+    RawImageHeader header;
+    if (file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != RAW_IMAGE_MAGIC || header.stride > sizeof(row)) {
+        return false;
+    }
+    
+    int stride = CAMERA_FRAME_WIDTH / (CLASSIFIER_SCALE * frameDivisor);
+    for (int y = 0; y < header.height; y += CLASSIFIER_SCALE) {
+        file.seek(header.headerSize + y * header.stride);
+        if (file.read(row, header.stride) != header.stride) {
+            return false;
+        }
+        
+        int ty = (header.originY + y) / CLASSIFIER_SCALE;
+        for (int x = 0; x < header.width; x += CLASSIFIER_SCALE) {
+            uint8_t r, g, b;
+            if (header.format == RAW_FORMAT_YUYV) {
+                int pair = (x & ~1) * 2;
+                yuvToRgb(row[x * 2], row[pair + 1], row[pair + 3], &r, &g, &b);
+            } else {
+                r = g = b = row[x];
+            }
+            
+            int tx = (header.originX + x) / CLASSIFIER_SCALE;
+            uint16_t pixel = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            int index = (ty * stride + tx) * 2;
+            classifierThumb[index] = pixel >> 8;
+            classifierThumb[index + 1] = pixel & 0xFF;
+        }
+    }
+    return true;
+}
+
+// Measure diameter and mean colour of the coin inside the ROI. The ROI border
+// is taken as background; anything far enough from it counts as coin.
+// frameDivisor is how much smaller than CAMERA_FRAME_WIDTH the image was.
+bool measureCoinFeatures(CoinFeatures& features, int frameDivisor) {
+    int scale = CLASSIFIER_SCALE * frameDivisor;
+    int stride = CAMERA_FRAME_WIDTH / scale;
+    int x0 = COIN_ROI_X / scale;
+    int y0 = COIN_ROI_Y / scale;
+    int x1 = x0 + COIN_ROI_WIDTH / scale - 1;
+    int y1 = y0 + COIN_ROI_HEIGHT / scale - 1;
+    uint8_t r, g, b;
+    
+    unsigned long borderSum = 0;
+    int borderCount = 0;
+    for (int x = x0; x <= x1; x++) {
+        borderSum += thumbLuma(classifierThumb, stride, x, y0, &r, &g, &b) +
+                     thumbLuma(classifierThumb, stride, x, y1, &r, &g, &b);
+        borderCount += 2;
+    }
+    for (int y = y0 + 1; y < y1; y++) {
+        borderSum += thumbLuma(classifierThumb, stride, x0, y, &r, &g, &b) +
+                     thumbLuma(classifierThumb, stride, x1, y, &r, &g, &b);
+        borderCount += 2;
+    }
+    int background = borderSum / borderCount;
+    
+    unsigned long coinPixels = 0;
+    unsigned long sumR = 0, sumG = 0, sumB = 0;
+    for (int y = y0 + 1; y < y1; y++) {
+        for (int x = x0 + 1; x < x1; x++) {
+            int luma = thumbLuma(classifierThumb, stride, x, y, &r, &g, &b);
+            if (abs(luma - background) > COIN_EDGE_THRESHOLD) {
+                coinPixels++;
+                sumR += r;
+                sumG += g;
+                sumB += b;
+            }
+        }
+    }
+    
+    if (coinPixels == 0) {
+        DEBUG_PRINTLN("No coin found in ROI");
+        return false;
+    }
+    
+    // Diameter of a disc with the same area, back in full-frame pixels
+    features.diameterPx = (uint16_t)(2.0f * sqrtf(coinPixels / 3.14159f) * scale);
+    features.meanR = sumR / coinPixels;
+    features.meanG = sumG / coinPixels;
+    features.meanB = sumB / coinPixels;
+    return true;
+}
+
+// Per-coin analysis buffers for the storage task: one block allocated at
+// startup where SCRATCH_PLACEMENT says, handed out again for every coin
+ScratchPool classifierScratch;
+bool classifierScratchPsram = false;
+
+bool allocateClassifierScratch() {
+    if (SCRATCH_POOL_BYTES == 0 || classifierScratch.size() > 0) {
+        return true;
+    }
+    classifierScratchPsram = placeInPsram(SCRATCH_PLACEMENT);
+    classifierScratch.begin((uint8_t*)allocatePlaced(SCRATCH_POOL_BYTES, SCRATCH_PLACEMENT), SCRATCH_POOL_BYTES);
+    return classifierScratch.size() > 0;
+}
+
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+// Read a whole JPEG into `jpeg` and decode it downscaled into `thumb`
+bool loadJpegThumb(File& file, uint8_t* jpeg, size_t size, uint8_t* thumb) {
+    size_t len = file.size();
+    if (!jpeg || len > size || file.read(jpeg, len) != len) {
+        return false;
+    }
+    return jpg2rgb565(jpeg, len, thumb, CLASSIFIER_JPEG_SCALE);
+}
+#endif
+
+bool extractCoinFeatures(const char* filename, CoinFeatures& features, int frameDivisor) {
+    File file = SPIFFS.open(filename, FILE_READ);
+    if (!file) {
+        DEBUG_PRINTLN("Failed to open image for classification");
+        return false;
+    }
+    
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+    size_t len = file.size();
+    uint8_t* jpeg = (uint8_t*)classifierScratch.alloc(len);
+    bool decoded = loadJpegThumb(file, jpeg, len, classifierThumb);
+    file.close();
+    if (!decoded) {
+        DEBUG_PRINTLN(jpeg ? "Failed to decode image for classification"
+                           : "No scratch room to read image for classification");
+        return false;
+    }
+#else
+    bool loaded = loadRawThumb(file, frameDivisor);
+    file.close();
+    if (!loaded) {
+        DEBUG_PRINTLN("Failed to read raw image for classification");
+        return false;
+    }
+#endif
+    
+    return measureCoinFeatures(features, frameDivisor);
+}
+
+// ==================== MOTION DETECTION ====================
+// Coarse luma grid over the ROI, one cell per CLASSIFIER_SCALE pixels
+#define MOTION_GRID_WIDTH     (COIN_ROI_WIDTH / CLASSIFIER_SCALE)
+#define MOTION_GRID_HEIGHT    (COIN_ROI_HEIGHT / CLASSIFIER_SCALE)
+#define MOTION_GRID_CELLS     (MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT)
+
+// Grab a frame and reduce its ROI to a luma grid
+bool grabMotionGrid(uint8_t* grid) {
+    if (!isCaptureFrameFree()) {
+        return false;
+    }
+    camera_fb_t * fb = esp_camera_fb_get();
+    if (!fb) {
+        return false;
+    }
+    
+    int frameWidth = fb->width;
+    int divisor = CAMERA_FRAME_WIDTH / frameWidth;
+    int x0 = COIN_ROI_X / divisor;
+    int y0 = COIN_ROI_Y / divisor;
+    int i = 0;
+    
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+    bool decoded = jpg2rgb565(fb->buf, fb->len, motionThumb, CLASSIFIER_JPEG_SCALE);
+    esp_camera_fb_return(fb);
+    if (!decoded) {
+        return false;
+    }
+    
+    int stride = frameWidth / CLASSIFIER_SCALE;
+    uint8_t r, g, b;
+    for (int y = 0; y < MOTION_GRID_HEIGHT; y++) {
+        for (int x = 0; x < MOTION_GRID_WIDTH; x++) {
+            grid[i++] = (y * CLASSIFIER_SCALE < COIN_ROI_HEIGHT / divisor && x * CLASSIFIER_SCALE < COIN_ROI_WIDTH / divisor)
+                      ? thumbLuma(motionThumb, stride, x0 / CLASSIFIER_SCALE + x, y0 / CLASSIFIER_SCALE + y, &r, &g, &b) : 0;
+        }
+    }
+#else
+    int step = CLASSIFIER_SCALE / divisor;
+    for (int y = 0; y < MOTION_GRID_HEIGHT; y++) {
+        for (int x = 0; x < MOTION_GRID_WIDTH; x++) {
+            grid[i++] = (y * step < COIN_ROI_HEIGHT / divisor && x * step < COIN_ROI_WIDTH / divisor)
+                      ? rawLuma(fb, x0 + x * step, y0 + y * step) : 0;
+        }
+    }
+    esp_camera_fb_return(fb);
+#endif
+    return true;
+}
+
+// Mean absolute luma change per cell between two grids
+uint32_t motionBetween(const uint8_t* a, const uint8_t* b) {
+    uint32_t sad = 0;
+    for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+        sad += abs(a[i] - b[i]);
+    }
+    return sad / MOTION_GRID_CELLS;
+}
+
+// ==================== SETTLE DETECTION ====================
+// Watches the ROI after each flipper move, one frame per call, and reports
+// the flipper settled once motion has stayed under MOTION_THRESHOLD for
+// MOTION_STABLE_FRAMES. Adapts to servo wear, battery sag and coin weight
+// where a fixed wait has to assume the worst case.
+struct SettleDetector {
+    uint8_t grids[2][MOTION_GRID_CELLS];
+    int current;
+    bool primed;                  // Have a previous frame to compare against
+    bool moved;                   // Motion seen since the move started
+    int quietFrames;
+    unsigned long moveCount;      // Move this detector is tracking
+};
+
+SettleDetector settleDetector;
+unsigned long lastSettleMs = 0;   // How long the last move took to settle
+
+bool pollSettleDetection() {
+    SettleDetector& d = settleDetector;
+    if (d.moveCount != flipperMoveCount) {
+        // New move: start over, with the lights on so motion is visible
+        d.moveCount = flipperMoveCount;
+        d.current = 0;
+        d.primed = false;
+        d.moved = false;
+        d.quietFrames = 0;
+        setCameraLights(true);
+    }
+    
+    unsigned long elapsed = millis() - flipperMoveStart;
+    if (elapsed >= SETTLE_DETECT_TIMEOUT) {
+        LOG_EVENT(LOG_SETTLE_NOT_DETECTED);
+        lastSettleMs = elapsed;
+        return true;
+    }
+    
+    int next = d.primed ? d.current ^ 1 : d.current;
+    if (!grabMotionGrid(d.grids[next])) {
+        return false;
+    }
+    if (!d.primed) {
+        d.primed = true;
+        return false;
+    }
+    
+    uint32_t motion = motionBetween(d.grids[d.current], d.grids[next]);
+    d.current = next;
+    if (motion > MOTION_THRESHOLD) {
+        d.moved = true;
+        d.quietFrames = 0;
+        return false;
+    }
+    
+    // Quiet frames only count once motion was seen or the profile has ended,
+    // so frames from before the servo starts moving don't pass as settled
+    if (d.moved || !isFlipperMoving()) {
+        d.quietFrames++;
+    }
+    if (d.quietFrames >= MOTION_STABLE_FRAMES) {
+        lastSettleMs = millis() - flipperMoveStart;
+        return true;
+    }
+    return false;
+}
+
+// Whether the flipper has come to rest after its last move
+bool isFlipperSettled(uint8_t policy = FLIPPER_SETTLE_POLICY) {
+    if (policy == SETTLE_CAMERA) {
+        return pollSettleDetection();
+    }
+    // Timed: the settle action for this move has run, or without one its
+    // deadline has passed (loop() polls at least every LOOP_IDLE_MS)
+    if (flipperSettledMove == flipperMoveCount ||
+        (flipperSettlePolled && millis() - flipperMoveStart >= flipperSettleMs)) {
+        lastSettleMs = flipperSettleMs;
+        return true;
+    }
+    return false;
+}
+
+// ==================== SERVO CALIBRATION ====================
+// Flipper moves used to fit the settle model; covers the distances the
+// photo sequence actually uses plus a short one to anchor the base time
+const int SERVO_CALIBRATION_ANGLES[] = {
+    FLIPPER_SIDE_1 / 2, FLIPPER_SIDE_1, FLIPPER_SIDE_2, FLIPPER_HOME,
+    FLIPPER_SIDE_1, FLIPPER_SIDE_2, FLIPPER_HOME
+};
+
+// Time from commanding a move until the camera sees the scene stop
+// moving, or 0 if no motion was seen at all
+unsigned long measureFlipperSettle(int angle) {
+    static uint8_t grids[2][MOTION_GRID_CELLS];
+    int current = 0;
+    if (!grabMotionGrid(grids[current])) {
+        return 0;
+    }
+    
+    unsigned long start = millis();
+    setFlipperPosition(angle);
+    
+    bool moved = false;
+    int quietFrames = 0;
+    unsigned long quietSince = 0;
+    while (millis() - start < 2 * SERVO_MOVE_DELAY) {
+        int next = current ^ 1;
+        if (!grabMotionGrid(grids[next])) {
+            return 0;
+        }
+        unsigned long frameTime = millis();
+        uint32_t motion = motionBetween(grids[current], grids[next]);
+        current = next;
+        
+        if (motion > MOTION_THRESHOLD) {
+            moved = true;
+            quietFrames = 0;
+        } else if (moved) {
+            if (quietFrames++ == 0) {
+                quietSince = frameTime;
+            }
+            if (quietFrames >= MOTION_STABLE_FRAMES) {
+                return quietSince - start;
+            }
+        }
+    }
+    return 0;
+}
+
+// Fit settle = base + perDegree * distance over the calibration moves
+// with least squares, then store the model in NVS
+bool calibrateServoTiming() {
+    DEBUG_PRINTLN("Calibrating flipper timing...");
+    setCameraLights(true);
+    setFlipperPosition(FLIPPER_HOME);
+    delay(SERVO_MOVE_DELAY);
     
-    // Frame size and quality settings
-    config.frame_size = CAMERA_FRAME_SIZE;
-    config.jpeg_quality = CAMERA_JPEG_QUALITY;
-    config.fb_count = 2;
+    // Measure against the fixed fallback, not a previous calibration
+    flipperTiming.calibrated = false;
     
-    // Initialize camera
-    esp_err_t err = esp_camera_init(&config);
-    if (err != ESP_OK) {
-        DEBUG_PRINTLN("Camera init failed");
+    int from = FLIPPER_HOME;
+    int samples = 0;
+    float sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+    for (size_t i = 0; i < sizeof(SERVO_CALIBRATION_ANGLES) / sizeof(SERVO_CALIBRATION_ANGLES[0]); i++) {
+        int to = SERVO_CALIBRATION_ANGLES[i];
+        unsigned long settle = measureFlipperSettle(to);
+        int distance = abs(to - from);
+        from = to;
+        delay(SERVO_MOVE_DELAY);
+        
+        DEBUG_PRINT("  ");
+        DEBUG_PRINT(distance);
+        DEBUG_PRINT(" deg: ");
+        DEBUG_PRINT(settle);
+        DEBUG_PRINTLN("ms");
+        if (settle == 0) {
+            continue;
+        }
+        
+        samples++;
+        sumX += distance;
+        sumY += settle;
+        sumXX += (float)distance * distance;
+        sumXY += (float)distance * settle;
+    }
+    
+    setFlipperPosition(FLIPPER_HOME);
+    setCameraLights(false);
+    
+    float denominator = samples * sumXX - sumX * sumX;
+    if (samples < 2 || denominator <= 0) {
+        DEBUG_PRINTLN("Flipper calibration failed, keeping previous timing");
+        loadServoTiming();
         return false;
     }
     
-    // Set camera parameters
-    sensor_t * s = esp_camera_sensor_get();
-    s->set_brightness(s, CAMERA_BRIGHTNESS);
-    s->set_contrast(s, CAMERA_CONTRAST);
+    float perDegree = (samples * sumXY - sumX * sumY) / denominator;
+    float base = (sumY - perDegree * sumX) / samples;
+    flipperTiming.perDegreeUs = (uint16_t)constrain(perDegree * 1000.0f, 0.0f, 65535.0f);
+    flipperTiming.baseMs = (uint16_t)constrain(base, 0.0f, (float)SERVO_MOVE_DELAY);
+    flipperTiming.calibrated = true;
+    saveServoTiming();
     
-    DEBUG_PRINTLN("Camera initialized successfully");
+    DEBUG_PRINT("Flipper timing: ");
+    DEBUG_PRINT(flipperTiming.baseMs);
+    DEBUG_PRINT("ms + ");
+    DEBUG_PRINT(flipperTiming.perDegreeUs);
+    DEBUG_PRINTLN("us/deg");
     return true;
 }
 
-bool captureAndSaveImage(const char* filename) {
-    // Turn on camera lights
-    setCameraLights(true);
-    delay(CAMERA_WARMUP_TIME);
-    
-    // Capture image
-    camera_fb_t * fb = esp_camera_fb_get();
-    if (!fb) {
-        DEBUG_PRINTLN("Camera capture failed");
-        setCameraLights(false);
+// ==================== STORAGE FUNCTIONS ====================
+struct CoinRecord {
+    unsigned long id;
+    unsigned long detectedAt;
+    char image1[IMAGE_FILENAME_MAX];
+    char image2[IMAGE_FILENAME_MAX];
+    CoinFeatures features;
+    CoinPrediction prediction;
+    unsigned long classifyTimeUs;
+    unsigned long stackTimeMs;
+    unsigned long queueMs;          // Sensor to flipper, including the detection window
+    const char* plan;               // Photo plan name
+    char extraImages[EXTRA_IMAGES_MAX]; // Shots after the second, ';'-separated
+    bool classified;
+    uint8_t jpegQuality;
+    uint16_t frameWidth;
+};
+
+bool initializeStorage() {
+    if (!SPIFFS.begin(true)) {
+        DEBUG_PRINTLN("SPIFFS initialization failed");
         return false;
     }
     
-    // Save to SPIFFS
-    File file = SPIFFS.open(filename, FILE_WRITE);
+    storageTotalBytes = SPIFFS.totalBytes();
+    storageFreeBytes = storageTotalBytes - SPIFFS.usedBytes();
+    DEBUG_PRINTLN("SPIFFS initialized");
+    return true;
+}
+
+// Writes into the caller's buffer; IMAGE_FILENAME_MAX always fits
+void generateImageFilename(char* filename, size_t size) {
+    static unsigned long imageCounter = 0;
+    imageCounter++;
+    
+    snprintf(filename, size, IMAGE_FILENAME_PREFIX "%lu_%lu" IMAGE_FILENAME_SUFFIX,
+             (unsigned long)millis(), imageCounter);
+}
+
+bool isImageFile(const char* name) {
+    return strncmp(name, IMAGE_FILENAME_PREFIX, sizeof(IMAGE_FILENAME_PREFIX) - 1) == 0;
+}
+
+bool appendCoinRecord(const CoinRecord& record) {
+    bool newFile = !SPIFFS.exists(COIN_RECORD_FILE);
+    File file = SPIFFS.open(COIN_RECORD_FILE, FILE_APPEND);
     if (!file) {
-        DEBUG_PRINTLN("Failed to open file for writing");
-        esp_camera_fb_return(fb);
-        setCameraLights(false);
+        DEBUG_PRINTLN("Failed to open coin record file");
         return false;
     }
     
-    file.write(fb->buf, fb->len);
+    if (newFile) {
+        file.print("id,detected_ms,image1,image2,denomination,confidence,"
+                   "diameter_px,mean_r,mean_g,mean_b,block_ms,classify_us,"
+                   "jpeg_quality,frame_width,stack_ms,queue_ms,plan,extra_images\n");
+    }
+    file.printf("%lu,%lu,%s,%s,%s,%u,%u,%u,%u,%u,%u,%lu,%u,%u,%lu,%lu,%s,%s\n",
+                record.id, record.detectedAt,
+                record.image1, record.image2,
+                getDenominationName(record.prediction.denomination),
+                record.prediction.confidence,
+                record.features.diameterPx,
+                record.features.meanR, record.features.meanG, record.features.meanB,
+                record.features.blockTimeMs, record.classifyTimeUs,
+                record.jpegQuality, record.frameWidth, record.stackTimeMs, record.queueMs,
+                record.plan, record.extraImages);
     file.close();
-    esp_camera_fb_return(fb);
-    
-    // Turn off camera lights
-    setCameraLights(false);
-    
-    DEBUG_PRINT("Image saved: ");
-    DEBUG_PRINTLN(filename);
     return true;
 }
 
-// ==================== SERVO FUNCTIONS ====================
-bool initializeServos() {
-    trapdoorServo.attach(TRAPDOOR_SERVO_PIN);
-    flipperServo.attach(FLIPPER_SERVO_PIN);
-    
-    // Move to home positions
-    trapdoorServo.write(TRAPDOOR_CLOSED);
-    flipperServo.write(FLIPPER_HOME);
+// Nothing deletes coins on its own: when storage fills up, coins are
+// rejected unphotographed (quality_controller.h) until an operator frees
+// space with 'prune <coins>'. Set by the console, done by the storage task,
+// which owns the files.
+volatile uint16_t pruneCoinsRequested = 0;
+
+// Delete every image a coins.csv row names. Fields are image1, image2 and
+// extra_images (';'-separated, last); the rest never start like an image.
+uint8_t removeRowImages(char* row) {
+    uint8_t removed = 0;
+    char* field = row;
+    while (field) {
+        char* next = strpbrk(field, ",;");
+        if (next) {
+            *next++ = '\0';
+        }
+        if (isImageFile(field) && SPIFFS.remove(field)) {
+            removed++;
+        }
+        field = next;
+    }
+    return removed;
+}
+
+// Remove the oldest coins, images and rows, by copying the rows to keep
+// into COIN_RECORD_TEMP_FILE. Each row's images go before the copy grows,
+// so it has room even on a full filesystem. Storage task only.
+void pruneOldestCoins(uint32_t coins) {
+    static char row[COIN_RECORD_LINE_MAX];
+    File in = SPIFFS.open(COIN_RECORD_FILE, FILE_READ);
+    if (!in) {
+        return;
+    }
+    File out = SPIFFS.open(COIN_RECORD_TEMP_FILE, FILE_WRITE);
+    if (!out) {
+        in.close();
+        LOG_EVENT(LOG_PRUNE_FAILED);
+        return;
+    }
     
-    delay(1000); // Allow servos to reach position
+    uint32_t line = 0;
+    uint32_t pruned = 0;
+    unsigned images = 0;
+    bool copied = true;
+    while (in.available()) {
+        size_t length = in.readBytesUntil('\n', row, sizeof(row) - 1);
+        row[length] = '\0';
+        // Line 0 is the header
+        if (line > 0 && pruned < coins) {
+            images += removeRowImages(row);
+            pruned++;
+        } else if (out.write((const uint8_t*)row, length) != length || out.write('\n') != 1) {
+            copied = false;
+            break;
+        }
+        line++;
+    }
+    in.close();
+    out.close();
     
-    DEBUG_PRINTLN("Servos initialized");
-    return true;
+    if (copied) {
+        SPIFFS.remove(COIN_RECORD_FILE);
+        SPIFFS.rename(COIN_RECORD_TEMP_FILE, COIN_RECORD_FILE);
+        LOG_EVENT(LOG_COINS_PRUNED, pruned, images);
+    } else {
+        SPIFFS.remove(COIN_RECORD_TEMP_FILE);
+        LOG_EVENT(LOG_PRUNE_FAILED);
+    }
+    storageFreeBytes = SPIFFS.totalBytes() - SPIFFS.usedBytes();
 }
 
-void setTrapdoorPosition(int angle) {
-    trapdoorServo.write(angle);
-    DEBUG_PRINT("Trapdoor moved to: ");
-    DEBUG_PRINTLN(angle);
-}
+// ==================== SENSOR RECORDING ====================
+// Every edge the sensor ISR sees, appended to SENSOR_RECORD_FILE for
+// tools/sensor_replay.cpp. The ISR queues edges in sensorEdges; the storage
+// task buffers them and appends SENSOR_RECORD_BUFFER at a time, or after
+// SENSOR_RECORD_FLUSH_INTERVAL, so the flash sees a write every few coins.
+SensorEdgeRecord sensorEdgeBuffer[SENSOR_RECORD_BUFFER];
+uint8_t sensorEdgesBuffered = 0;
+unsigned long sensorEdgesFlushedAt = 0;
+volatile uint32_t sensorRecordBytes = 0;      // Size of SENSOR_RECORD_FILE
+volatile uint32_t sensorEdgesRecorded = 0;    // Appended since boot
+volatile uint32_t sensorEdgesSkipped = 0;     // File at SENSOR_RECORD_MAX_BYTES
+volatile bool sensorRecordClearRequested = false;
 
-void setFlipperPosition(int angle) {
-    flipperServo.write(angle);
-    DEBUG_PRINT("Flipper moved to: ");
-    DEBUG_PRINTLN(angle);
+void flushSensorEdges() {
+    uint32_t bytes = sensorEdgesBuffered * sizeof(SensorEdgeRecord);
+    if (sensorRecordBytes + bytes > SENSOR_RECORD_MAX_BYTES) {
+        sensorEdgesSkipped += sensorEdgesBuffered;
+    } else {
+        File file = SPIFFS.open(SENSOR_RECORD_FILE, FILE_APPEND);
+        if (file) {
+            size_t written = file.write((const uint8_t*)sensorEdgeBuffer, bytes);
+            file.close();
+            sensorRecordBytes += written;
+            sensorEdgesRecorded += written / sizeof(SensorEdgeRecord);
+        }
+    }
+    sensorEdgesBuffered = 0;
+    sensorEdgesFlushedAt = millis();
 }
 
-void openTrapdoor() {
-    setTrapdoorPosition(TRAPDOOR_OPEN);
+void bufferSensorEdge(const SensorEdgeRecord& edge) {
+    if (sensorEdgesBuffered == SENSOR_RECORD_BUFFER) {
+        flushSensorEdges();
+    }
+    sensorEdgeBuffer[sensorEdgesBuffered++] = edge;
 }
 
-void closeTrapdoor() {
-    setTrapdoorPosition(TRAPDOOR_CLOSED);
+// Storage task: a boot marker, so replays can tell boots apart
+void startSensorRecording() {
+    sensorRecordBytes = 0;
+    if (SPIFFS.exists(SENSOR_RECORD_FILE)) {
+        File file = SPIFFS.open(SENSOR_RECORD_FILE, FILE_READ);
+        sensorRecordBytes = file.size();
+        file.close();
+    }
+    SensorEdgeRecord boot = {0, SENSOR_EDGE_BOOT};
+    bufferSensorEdge(boot);
 }
 
-void moveFlipperHome() {
-    setFlipperPosition(FLIPPER_HOME);
+// Storage task: take what the ISR queued, append when due
+void recordSensorEdges() {
+    if (sensorRecordClearRequested) {
+        // A fresh recording; edges still buffered belong to the old one
+        SPIFFS.remove(SENSOR_RECORD_FILE);
+        sensorEdgesBuffered = 0;
+        sensorEdgesSkipped = 0;
+        sensorRecordClearRequested = false;
+        startSensorRecording();
+    }
+    SensorEdgeRecord edge;
+    while (sensorEdges.pop(edge)) {
+        bufferSensorEdge(edge);
+    }
+    if (sensorEdgesBuffered > 0 && millis() - sensorEdgesFlushedAt >= SENSOR_RECORD_FLUSH_INTERVAL) {
+        flushSensorEdges();
+    }
 }
 
-void moveFlipperToSide1() {
-    setFlipperPosition(FLIPPER_SIDE_1);
+// ==================== STORAGE TASK ====================
+// Runs on core 0 below loop()'s priority. Writes queued images, then
+// classifies each finished coin from its first image and appends its
+// record. A coin is taken off its queue before the images are drained, so
+// every image queued ahead of it is on disk by the time it is classified.
+//
+// Measuring the first image is most of classifying, so it happens as soon
+// as that image is written, ahead of the coin's other saves: by the time
+// the coin is finished only the nearest-prototype lookup is left, and the
+// record is written while the flipper is still returning home.
+SpscQueue<CoinRecord, STORAGE_QUEUE_SIZE> finishedCoins;
+unsigned long coinsFinishedInline = 0;    // Queue full or no task
+volatile unsigned long coinsStored = 0;
+volatile bool storageFinishing = false;   // A coin is off finishedCoins but not yet stored
+volatile unsigned long recordWriteFailures = 0;
+CoinPrediction lastPrediction = {COIN_UNKNOWN, 0, 0};
+unsigned long lastClassifyTimeUs = 0;
+
+// Features measured from a coin's first image, waiting for its record.
+// Two slots by coin id, since the next coin's first image can be written
+// before this coin comes off finishedCoins. A coin whose slot was reused or
+// whose image was written inline is measured in finishCoin() instead.
+struct EarlyFeatures {
+    uint32_t coinId;              // 0 if empty
+    bool measured;
+    CoinFeatures features;
+    unsigned long measureUs;
+};
+
+EarlyFeatures earlyFeatures[2];
+
+void measureEarlyFeatures(uint32_t coinId, const char* filename, int frameDivisor) {
+    EarlyFeatures& early = earlyFeatures[coinId & 1];
+    classifierScratch.reset();
+    unsigned long start = micros();
+    early.measured = extractCoinFeatures(filename, early.features, frameDivisor);
+    early.measureUs = micros() - start;
+    early.coinId = coinId;
 }
 
-void moveFlipperToSide2() {
-    setFlipperPosition(FLIPPER_SIDE_2);
+void writeQueuedImages() {
+    ImageSave save;
+    while (imageSaves.pop(save)) {
+        ImageSaveResult result;
+        unsigned long writeStart = millis();
+        TRACE(TRACE_WRITE_BEGIN, save.fb->len);
+        result.bytes = writeImageFile(save.filename, save.fb);
+        TRACE(TRACE_WRITE_END, result.bytes);
+        result.writeMs = millis() - writeStart;
+        int frameDivisor = CAMERA_FRAME_WIDTH / save.fb->width;
+        esp_camera_fb_return(save.fb);
+        __atomic_fetch_sub(&framesInFlight, 1, __ATOMIC_RELAXED);
+        wakeLoop();
+        storageFreeBytes = SPIFFS.totalBytes() - SPIFFS.usedBytes();
+        imageSaveResults.push(result);
+        if (result.bytes) {
+            LOG_EVENT(LOG_IMAGE_SAVED, result.bytes, result.writeMs);
+        } else {
+            LOG_EVENT(LOG_IMAGE_SAVE_FAILED);
+        }
+        if (save.coinId && result.bytes) {
+            measureEarlyFeatures(save.coinId, save.filename, frameDivisor);
+        }
+    }
 }
 
-// ==================== LED FUNCTIONS ====================
-bool initializeLEDs() {
-    // Initialize status LED pins
-    pinMode(STATUS_LED_R_PIN, OUTPUT);
-    pinMode(STATUS_LED_G_PIN, OUTPUT);
-    pinMode(STATUS_LED_B_PIN, OUTPUT);
+// Classify from the first image, then write the record
+void finishCoin(CoinRecord& record) {
+    TRACE(TRACE_CLASSIFY_BEGIN, record.id);
+    unsigned long start = micros();
+    unsigned long measureUs = 0;
+    bool measured;
+    EarlyFeatures& early = earlyFeatures[record.id & 1];
+    if (early.coinId == record.id) {
+        // Block time comes from the sensor, not the image
+        uint16_t blockTimeMs = record.features.blockTimeMs;
+        record.features = early.features;
+        record.features.blockTimeMs = blockTimeMs;
+        measured = early.measured;
+        measureUs = early.measureUs;
+        early.coinId = 0;
+    } else {
+        classifierScratch.reset();
+        measured = extractCoinFeatures(record.image1, record.features,
+                                       CAMERA_FRAME_WIDTH / record.frameWidth);
+    }
+    if (measured) {
+        record.prediction = classifyCoin(record.features);
+    }
+    record.classifyTimeUs = micros() - start + measureUs;
+    record.classified = true;
+    TRACE(TRACE_CLASSIFY_END, record.prediction.confidence, record.prediction.denomination);
+    lastPrediction = record.prediction;
+    lastClassifyTimeUs = record.classifyTimeUs;
     
-    // Initialize camera LEDs (WS2812B)
-    FastLED.addLeds<WS2812B, CAMERA_LIGHTS_PIN, GRB>(cameraLEDs, NUM_CAMERA_LEDS);
-    FastLED.setBrightness(CAMERA_LED_BRIGHTNESS);
+    LOG_EVENT(LOG_COIN_CLASSIFIED, record.id, LOG_STR(getDenominationName(record.prediction.denomination)),
+             record.prediction.confidence, record.classifyTimeUs);
     
-    // Turn off all LEDs initially
-    setStatusLED(LED_OFF);
-    setCameraLights(false);
+    if (!appendCoinRecord(record)) {
+        recordWriteFailures++;
+    }
+    storageFreeBytes = SPIFFS.totalBytes() - SPIFFS.usedBytes();
+    coinsStored++;
+}
+
+void storageTaskLoop(void*) {
+    storageFreeBytes = SPIFFS.totalBytes() - SPIFFS.usedBytes();
     
-    DEBUG_PRINTLN("LEDs initialized");
-    return true;
+    if (SENSOR_RECORD_ENABLED) {
+        startSensorRecording();
+    }
+    
+    CoinRecord record;
+    for (;;) {
+        // Sensor edges are collected on a timeout; the ISR doesn't notify
+        ulTaskNotifyTake(pdTRUE, SENSOR_RECORD_ENABLED ? pdMS_TO_TICKS(SENSOR_RECORD_FLUSH_INTERVAL / 4)
+                                                       : portMAX_DELAY);
+        writeQueuedImages();
+        for (;;) {
+            // Set before the pop so a coin is never in neither place
+            storageFinishing = true;
+            if (!finishedCoins.pop(record)) {
+                break;
+            }
+            writeQueuedImages();
+            finishCoin(record);
+        }
+        storageFinishing = false;
+        if (pruneCoinsRequested > 0) {
+            pruneOldestCoins(pruneCoinsRequested);
+            pruneCoinsRequested = 0;
+        }
+        if (SENSOR_RECORD_ENABLED) {
+            recordSensorEdges();
+        }
+    }
 }
 
-void setStatusLED(RGBColor color) {
-    analogWrite(STATUS_LED_R_PIN, map(color.r, 0, 255, 0, STATUS_LED_BRIGHTNESS));
-    analogWrite(STATUS_LED_G_PIN, map(color.g, 0, 255, 0, STATUS_LED_BRIGHTNESS));
-    analogWrite(STATUS_LED_B_PIN, map(color.b, 0, 255, 0, STATUS_LED_BRIGHTNESS));
+// From loop(): classify and store the coin in the background
+void queueFinishedCoin(const CoinRecord& record) {
+    if (storageTask && finishedCoins.push(record)) {
+        xTaskNotifyGive(storageTask);
+        return;
+    }
+    coinsFinishedInline++;
+    CoinRecord copy = record;
+    finishCoin(copy);
 }
 
-void setCameraLights(bool on) {
-    if (on) {
-        fill_solid(cameraLEDs, NUM_CAMERA_LEDS, CRGB::White);
-    } else {
-        fill_solid(cameraLEDs, NUM_CAMERA_LEDS, CRGB::Black);
+bool startStorageTask() {
+    if (!allocateClassifierScratch()) {
+        DEBUG_PRINTLN("WARNING: No classifier scratch; coins will be stored unclassified");
     }
-    FastLED.show();
+    if (xTaskCreatePinnedToCore(storageTaskLoop, "storage", STORAGE_TASK_STACK, NULL,
+                                STORAGE_TASK_PRIORITY, &storageTask, STORAGE_TASK_CORE) != pdPASS) {
+        DEBUG_PRINTLN("Storage task creation failed");
+        storageTask = NULL;
+        return false;
+    }
+    return true;
 }
 
-void flashCameraLights() {
-    setCameraLights(true);
-    delay(CAMERA_FLASH_DURATION);
-    setCameraLights(false);
+// Nothing queued for or being written by the storage task. From loop(),
+// the only producer, so it stays idle until loop() queues more.
+bool isStorageIdle() {
+    return framesInFlight == 0 && finishedCoins.count() == 0 && !storageFinishing;
 }
 
-// ==================== SENSOR FUNCTIONS ====================
-volatile bool sensorTriggered = false;
-volatile unsigned long lastSensorTrigger = 0;
-volatile int sensorTriggerCount = 0;
-unsigned long sensorWindowStart = 0;
+// ==================== PLACEMENT BENCHMARK ====================
+// Capture-to-stored latency with the frame buffers in each kind of RAM,
+// and read-and-decode time with the classifier scratch in each. Restarts
+// the camera twice, so it runs from loop() between coins with the storage
+// task idle: it must not hold a frame buffer across the restarts
+// ('placebench').
 
-void IRAM_ATTR sensorInterrupt() {
-    unsigned long currentTime = millis();
-    
-    // Debounce check
-    if (currentTime - lastSensorTrigger < SENSOR_DEBOUNCE_TIME) {
+// Sensor settings a camera restart forgets
+void restoreCameraSettings() {
+    sensor_t * s = esp_camera_sensor_get();
+    s->set_framesize(s, imageQuality.reducedFrame ? QUALITY_REDUCED_FRAME_SIZE : CAMERA_FRAME_SIZE);
+    s->set_quality(s, imageQuality.quality);
+    if (exposureLock.locked) {
+        applyExposureLock(s);
+    }
+}
+
+void benchmarkFramePlacement(bool psram) {
+    esp_camera_deinit();
+    if (!startCamera(psram)) {
+        DEBUG_PRINTF("Frames in %-8s: camera would not start\n", getPlacementName(psram));
         return;
     }
+    restoreCameraSettings();
     
-    lastSensorTrigger = currentTime;
-    
-    // Start new detection window if needed
-    if (sensorTriggerCount == 0) {
-        sensorWindowStart = currentTime;
+    unsigned long captureUs = 0;
+    unsigned long writeUs = 0;
+    unsigned long bytes = 0;
+    int shots = 0;
+    for (int i = 0; i < PLACEMENT_BENCH_SHOTS; i++) {
+        unsigned long start = micros();
+        camera_fb_t * fb = esp_camera_fb_get();
+        if (!fb) {
+            continue;
+        }
+        unsigned long captured = micros();
+        size_t written = writeImageFile(PLACEMENT_BENCH_FILE, fb);
+        unsigned long stored = micros();
+        esp_camera_fb_return(fb);
+        if (written > 0) {
+            captureUs += captured - start;
+            writeUs += stored - captured;
+            bytes += written;
+            shots++;
+        }
     }
-    
-    sensorTriggerCount++;
-    sensorTriggered = true;
-    
-    DEBUG_PRINT("Sensor triggered, count: ");
-    DEBUG_PRINTLN(sensorTriggerCount);
+    if (shots == 0) {
+        DEBUG_PRINTF("Frames in %-8s: no captures stored\n", getPlacementName(psram));
+        return;
+    }
+    DEBUG_PRINTF("Frames in %-8s: capture %lums, write %lums, capture-to-stored %lums (%lu bytes, %d shots)\n",
+                 getPlacementName(psram), captureUs / shots / 1000, writeUs / shots / 1000,
+                 (captureUs + writeUs) / shots / 1000, bytes / shots, shots);
 }
 
-bool initializeSensor() {
-    pinMode(OPTICAL_SENSOR_PIN, INPUT_PULLUP);
-    attachInterrupt(digitalPinToInterrupt(OPTICAL_SENSOR_PIN), sensorInterrupt, FALLING);
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+void benchmarkScratchPlacement(bool psram) {
+    uint8_t* buffer = (uint8_t*)allocatePlaced(CLASSIFIER_JPEG_MAX, psram ? PLACEMENT_PSRAM : PLACEMENT_INTERNAL);
+    if (!buffer) {
+        DEBUG_PRINTF("Scratch in %-7s: no room\n", getPlacementName(psram));
+        return;
+    }
+    unsigned long totalUs = 0;
+    int runs = 0;
+    for (int i = 0; i < PLACEMENT_BENCH_SHOTS; i++) {
+        File file = SPIFFS.open(PLACEMENT_BENCH_FILE, FILE_READ);
+        if (!file) {
+            break;
+        }
+        unsigned long start = micros();
+        bool decoded = loadJpegThumb(file, buffer, CLASSIFIER_JPEG_MAX, motionThumb);
+        totalUs += micros() - start;
+        file.close();
+        runs += decoded;
+    }
+    free(buffer);
+    if (runs == 0) {
+        DEBUG_PRINTF("Scratch in %-7s: decode failed\n", getPlacementName(psram));
+        return;
+    }
+    DEBUG_PRINTF("Scratch in %-7s: read and decode %luus\n", getPlacementName(psram), totalUs / runs);
+}
+#endif
+
+// Returns false if the camera did not come back with the configured placement
+bool benchmarkPlacement() {
+    DEBUG_PRINTLN("=== Placement Benchmark ===");
+    for (int psram = 0; psram <= (psramFound() ? 1 : 0); psram++) {
+        benchmarkFramePlacement(psram);
+#if CAPTURE_MODE == CAPTURE_MODE_JPEG
+        benchmarkScratchPlacement(psram);
+#endif
+    }
+    if (!psramFound()) {
+        DEBUG_PRINTLN("No PSRAM; internal RAM only");
+    }
+    SPIFFS.remove(PLACEMENT_BENCH_FILE);
     
-    DEBUG_PRINTLN("Optical sensor initialized");
+    // Back to the configured placement
+    esp_camera_deinit();
+    if (!startCamera(placeInPsram(FRAME_BUFFER_PLACEMENT))) {
+        DEBUG_PRINTLN("ERROR: Camera did not restart");
+        return false;
+    }
+    restoreCameraSettings();
+    DEBUG_PRINTLN("==================");
     return true;
 }
 
-bool isSensorTriggered() {
-    return sensorTriggered;
-}
+// ==================== MEMORY TELEMETRY ====================
+// The console task samples the heap every MEM_SAMPLE_INTERVAL into a ring,
+// so a slow leak or a shrinking largest block shows up as a trend long
+// before a frame buffer allocation fails. Only the console task touches
+// the ring, so it needs no lock.
+#define MEM_STACK_TASKS       3       // loop, storage, console
+
+struct MemorySample {
+    uint32_t timeS;               // Seconds since boot
+    uint32_t freeHeap;            // Internal RAM
+    uint32_t minFreeHeap;         // Lowest since boot
+    uint32_t largestBlock;        // Largest internal allocation that would succeed
+    uint32_t freePsram;           // 0 without PSRAM
+    uint32_t largestPsramBlock;
+    uint32_t stackFree[MEM_STACK_TASKS];  // Least free stack ever, bytes
+};
 
-void clearSensorTrigger() {
-    sensorTriggered = false;
+const char* const MEM_STACK_TASK_NAMES[MEM_STACK_TASKS] = {"loop", "storage", "console"};
+
+MemorySample memorySamples[MEM_SAMPLE_COUNT];
+unsigned long memorySamplesTaken = 0;
+unsigned long lastMemorySampleMs = 0;
+bool frameBlockLow = false;
+
+uint32_t stackFreeBytes(TaskHandle_t task) {
+    return task ? uxTaskGetStackHighWaterMark(task) : 0;
 }
 
-int getSensorTriggerCount() {
-    return sensorTriggerCount;
+// Call from the console task: its own stack is read as the caller's
+void readMemory(MemorySample& sample) {
+    sample.timeS = millis() / 1000;
+    sample.freeHeap = ESP.getFreeHeap();
+    sample.minFreeHeap = ESP.getMinFreeHeap();
+    sample.largestBlock = ESP.getMaxAllocHeap();
+    sample.freePsram = psramFound() ? ESP.getFreePsram() : 0;
+    sample.largestPsramBlock = psramFound() ? ESP.getMaxAllocPsram() : 0;
+    sample.stackFree[0] = stackFreeBytes(loopTask);
+    sample.stackFree[1] = stackFreeBytes(storageTask);
+    sample.stackFree[2] = uxTaskGetStackHighWaterMark(NULL);
 }
 
-void resetSensorCount() {
-    sensorTriggerCount = 0;
-    sensorWindowStart = 0;
+// Frame buffers come from PSRAM when there is any
+uint32_t frameBufferBlock(const MemorySample& sample) {
+    return psramFound() ? sample.largestPsramBlock : sample.largestBlock;
 }
 
-bool isMultipleCoinDetected() {
-    unsigned long currentTime = millis();
-    
-    // Check if we're within the detection window
-    if (sensorTriggerCount > 0 && (currentTime - sensorWindowStart) > MULTI_COIN_TIMEOUT) {
-        bool multipleCoins = (sensorTriggerCount >= MULTI_COIN_THRESHOLD);
-        DEBUG_PRINT("Coin detection complete. Count: ");
-        DEBUG_PRINT(sensorTriggerCount);
-        DEBUG_PRINT(", Multiple: ");
-        DEBUG_PRINTLN(multipleCoins ? "YES" : "NO");
-        return multipleCoins;
+void sampleMemoryIfDue() {
+    unsigned long now = millis();
+    if (memorySamplesTaken > 0 && now - lastMemorySampleMs < MEM_SAMPLE_INTERVAL) {
+        return;
     }
+    lastMemorySampleMs = now;
+    MemorySample& sample = memorySamples[memorySamplesTaken % MEM_SAMPLE_COUNT];
+    readMemory(sample);
+    memorySamplesTaken++;
     
-    return false;
+    // Warn once per dip, not every sample
+    bool low = frameBufferBlock(sample) < MEM_LOW_BLOCK_BYTES;
+    if (low && !frameBlockLow) {
+        LOG_EVENT(LOG_FRAME_BLOCK_LOW, frameBufferBlock(sample), MEM_LOW_BLOCK_BYTES);
+    }
+    frameBlockLow = low;
 }
 
-// ==================== STORAGE FUNCTIONS ====================
-bool initializeStorage() {
-    if (!SPIFFS.begin(true)) {
-        DEBUG_PRINTLN("SPIFFS initialization failed");
-        return false;
-    }
-    
-    DEBUG_PRINTLN("SPIFFS initialized");
+uint8_t memorySamplesKept() {
+    return memorySamplesTaken < MEM_SAMPLE_COUNT ? memorySamplesTaken : MEM_SAMPLE_COUNT;
+}
+
+// 0 is the oldest kept sample
+const MemorySample& memorySampleAt(uint8_t index) {
+    unsigned long first = memorySamplesTaken - memorySamplesKept();
+    return memorySamples[(first + index) % MEM_SAMPLE_COUNT];
+}
+
+// ==================== TELEMETRY ====================
+// Frames (telemetry.h) are built and sent by the console task. loop() only
+// adds to the histograms and asks for a frame after each coin, a few
+// increments per pass; the busy times below are what the rest costs.
+TelemetryHistogram loopPassHistogram;
+TelemetryHistogram coinCycleHistogram;
+volatile bool telemetryRequested = false;
+uint32_t telemetrySequence = 0;
+unsigned long lastTelemetryMs = 0;
+unsigned long telemetryBuildUs = 0;       // All frames so far
+unsigned long telemetrySendUs = 0;        // Includes waiting on the UART
+#if TELEMETRY_UDP
+WiFiUDP telemetryUdp;
+#endif
+
+// From loop(): send a frame soon, off the control path
+void requestTelemetry() {
+    telemetryRequested = true;
+}
+
+uint32_t getUnitId() {
+    return (uint32_t)ESP.getEfuseMac();
+}
+
+bool initializeTelemetry() {
+#if TELEMETRY_UDP
+    // Connects in the background; frames go by serial only until it has
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(TELEMETRY_WIFI_SSID, TELEMETRY_WIFI_PASSWORD);
+#endif
     return true;
 }
 
-String generateImageFilename() {
-    static int imageCounter = 0;
-    imageCounter++;
-    
-    String filename = IMAGE_FILENAME_PREFIX;
-    filename += String(millis());
-    filename += "_";
-    filename += String(imageCounter);
-    filename += IMAGE_FILENAME_SUFFIX;
-    
-    return filename;
-}
-
-void cleanupOldImages() {
-    // Simple cleanup - delete oldest files if we have too many
-    // This is a basic implementation; could be enhanced
-    File root = SPIFFS.open("/");
-    int fileCount = 0;
-    
-    File file = root.openNextFile();
-    while (file) {
-        if (String(file.name()).startsWith(IMAGE_FILENAME_PREFIX)) {
-            fileCount++;
-        }
-        file = root.openNextFile();
-    }
-    
-    if (fileCount > MAX_IMAGES_STORED) {
-        DEBUG_PRINTLN("Cleaning up old images...");
-        // Simple cleanup - in a real implementation, you'd sort by date
-        root.rewindDirectory();
-        file = root.openNextFile();
-        int deleted = 0;
-        while (file && deleted < (fileCount - MAX_IMAGES_STORED)) {
-            if (String(file.name()).startsWith(IMAGE_FILENAME_PREFIX)) {
-                String filename = "/" + String(file.name());
-                file.close();
-                SPIFFS.remove(filename);
-                deleted++;
-                DEBUG_PRINT("Deleted: ");
-                DEBUG_PRINTLN(filename);
-            } else {
-                file = root.openNextFile();
-            }
-        }
+void sendTelemetryFrame(const TelemetryFrame& frame) {
+#if TELEMETRY_SERIAL
+    Serial.write((const uint8_t*)&frame, sizeof(frame));
+#endif
+#if TELEMETRY_UDP
+    if (WiFi.status() == WL_CONNECTED) {
+        telemetryUdp.beginPacket(TELEMETRY_UDP_HOST, TELEMETRY_UDP_PORT);
+        telemetryUdp.write((const uint8_t*)&frame, sizeof(frame));
+        telemetryUdp.endPacket();
     }
+#endif
 }
 
 // ==================== UTILITY FUNCTIONS ====================
@@ -312,7 +2547,7 @@ void systemReset() {
     DEBUG_PRINTLN("Performing system reset...");
     
     // Reset all hardware to safe states
-    closeTrapdoor();
+    stopRejectCycle();
     moveFlipperHome();
     setStatusLED(LED_OFF);
     setCameraLights(false);
@@ -322,8 +2557,192 @@ void systemReset() {
     DEBUG_PRINTLN("System reset complete");
 }
 
+// ==================== INIT ORCHESTRATOR ====================
+// Runs an init graph (init_graph.h). Every step whose dependencies have
+// succeeded is started; concurrent ones get a short-lived task on
+// INIT_TASK_CORE and notify the caller when they finish, the rest run
+// right here. A step whose dependency failed is skipped, not run.
+struct InitTaskArgs {
+    const InitStep* step;
+    InitResult* result;
+    TaskHandle_t caller;
+};
+
+void runInitStep(const InitStep& step, InitResult& result) {
+    result.startMs = millis();
+    result.ok = step.run();
+    result.durationMs = millis() - result.startMs;
+}
+
+void initStepTask(void* arg) {
+    InitTaskArgs* args = (InitTaskArgs*)arg;
+    runInitStep(*args->step, *args->result);
+    args->result->finished = true;
+    xTaskNotifyGive(args->caller);
+    vTaskDelete(NULL);
+}
+
+// Returns false if any step failed or was skipped
+bool runInitSteps(const InitStep* steps, uint8_t count, InitResult* results) {
+    static InitTaskArgs taskArgs[INIT_MAX_STEPS];
+    const uint32_t all = count >= INIT_MAX_STEPS ? 0xFFFFFFFFUL : INIT_DEP(count) - 1;
+    uint32_t started = 0;
+    uint32_t done = 0;
+    uint32_t failed = 0;
+    
+    for (uint8_t i = 0; i < count; i++) {
+        results[i] = InitResult();
+    }
+    
+    while (done != all) {
+        bool ranHere = false;
+        
+        for (uint8_t i = 0; i < count; i++) {
+            const InitStep& step = steps[i];
+            if (started & INIT_DEP(i)) {
+                continue;
+            }
+            if (step.dependsOn & failed) {
+                results[i].skipped = true;
+                results[i].finished = true;
+                started |= INIT_DEP(i);
+                continue;
+            }
+            uint32_t waitsFor = step.dependsOn | step.after;
+            if ((waitsFor & done) != waitsFor) {
+                continue;
+            }
+            
+            started |= INIT_DEP(i);
+            if (step.concurrent) {
+                taskArgs[i] = {&step, &results[i], xTaskGetCurrentTaskHandle()};
+                if (xTaskCreatePinnedToCore(initStepTask, step.name, INIT_TASK_STACK, &taskArgs[i],
+                                            INIT_TASK_PRIORITY, NULL, INIT_TASK_CORE) == pdPASS) {
+                    results[i].concurrent = true;
+                    continue;
+                }
+                // No memory for a task: still worth running, just not in parallel
+            }
+            runInitStep(step, results[i]);
+            results[i].finished = true;
+            ranHere = true;
+        }
+        
+        for (uint8_t i = 0; i < count; i++) {
+            if ((started & ~done & INIT_DEP(i)) && results[i].finished) {
+                done |= INIT_DEP(i);
+                if (!results[i].ok) {
+                    failed |= INIT_DEP(i);
+                }
+            }
+        }
+        
+        // Something on core 0 is still running; sleep until it reports in
+        if (done != all && !ranHere) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOOP_IDLE_MS));
+        }
+    }
+    return failed == 0;
+}
+
+// One line per step: when it started relative to the first, how long it
+// took, and where it ran. Steps on the critical path are what to speed up.
+void printInitReport(const InitStep* steps, uint8_t count, const InitResult* results, unsigned long totalMs) {
+    unsigned long firstStartMs = results[0].startMs;
+    unsigned long stepTotalMs = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (!results[i].skipped && results[i].startMs < firstStartMs) {
+            firstStartMs = results[i].startMs;
+        }
+    }
+    
+    DEBUG_PRINTLN("=== Init Steps ===");
+    for (uint8_t i = 0; i < count; i++) {
+        DEBUG_PRINT(steps[i].name);
+        if (results[i].skipped) {
+            DEBUG_PRINTLN(": skipped, a dependency failed");
+            continue;
+        }
+        DEBUG_PRINT(": +");
+        DEBUG_PRINT(results[i].startMs - firstStartMs);
+        DEBUG_PRINT("ms, took ");
+        DEBUG_PRINT(results[i].durationMs);
+        DEBUG_PRINT("ms");
+        DEBUG_PRINT(results[i].concurrent ? " (core 0)" : " (setup)");
+        DEBUG_PRINTLN(results[i].ok ? "" : " FAILED");
+        stepTotalMs += results[i].durationMs;
+    }
+    DEBUG_PRINT("Init took ");
+    DEBUG_PRINT(totalMs);
+    DEBUG_PRINT("ms, ");
+    DEBUG_PRINT(stepTotalMs);
+    DEBUG_PRINTLN("ms if run one after another");
+}
+
+// ==================== BOOT ====================
+// A power-on or the reset button gets the full start: time for a serial
+// monitor, servos homed before anything moves, the actuator test and a
+// fresh exposure calibration. Any other reset (brown-out, watchdog, panic,
+// software) means the machine was running moments ago, so it comes
+// straight back with checks that move nothing.
+bool isColdBoot() {
+    switch (esp_reset_reason()) {
+        case ESP_RST_POWERON:
+        case ESP_RST_EXT:
+        case ESP_RST_UNKNOWN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+const char* getResetReasonName() {
+    switch (esp_reset_reason()) {
+        case ESP_RST_POWERON: return "power-on";
+        case ESP_RST_EXT: return "reset pin";
+        case ESP_RST_SW: return "software";
+        case ESP_RST_PANIC: return "panic";
+        case ESP_RST_INT_WDT:
+        case ESP_RST_TASK_WDT:
+        case ESP_RST_WDT: return "watchdog";
+        case ESP_RST_DEEPSLEEP: return "deep sleep";
+        case ESP_RST_BROWNOUT: return "brown-out";
+        default: return "unknown";
+    }
+}
+
+// Non-actuating checks for every boot: the camera answers with a sensor
+// ID, storage is mounted, and nothing is sitting in front of the sensor
+bool performQuickSelfTest() {
+    bool passed = true;
+    
+    sensor_t * s = esp_camera_sensor_get();
+    if (!s || s->id.PID == 0) {
+        DEBUG_PRINTLN("Self-test: camera not responding");
+        passed = false;
+    } else {
+        DEBUG_PRINT("Self-test: camera PID 0x");
+        DEBUG_PRINTLN(String(s->id.PID, HEX));
+    }
+    
+    if (SPIFFS.totalBytes() == 0) {
+        DEBUG_PRINTLN("Self-test: storage not mounted");
+        passed = false;
+    }
+    
+    // Not fatal: a coin left in the chute is handled when it clears. Read
+    // the pin: the ISR has seen no edge yet if it was blocked at power-on.
+    if (digitalRead(OPTICAL_SENSOR_PIN) == LOW) {
+        DEBUG_PRINTLN("Self-test: WARNING coin sensor blocked");
+    }
+    
+    return passed;
+}
+
+// Full actuator test: cycles every LED and servo. Cold boot or 'test' only.
 bool performSystemTest() {
     DEBUG_PRINTLN("Starting system test...");
+    RGBColor statusBefore = outputs.statusLED;
     
     // Test status LED
     setStatusLED(LED_READY);
@@ -356,6 +2775,9 @@ bool performSystemTest() {
     delay(1000);
     setCameraLights(false);
     
+    // States only set the status LED on entry, so put back what was showing
+    setStatusLED(statusBefore);
+    
     DEBUG_PRINTLN("System test complete");
     return true;
 }
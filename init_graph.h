@@ -0,0 +1,51 @@
+#ifndef INIT_GRAPH_H
+#define INIT_GRAPH_H
+
+// Boot-time initialization as a dependency graph. Each step names the
+// steps it needs, and those it only has to wait for; runInitSteps()
+// (hardware_functions.h) starts every step whose dependencies have
+// succeeded and whose "after" steps have finished, the concurrent ones on
+// their own tasks, and times each. Steps may only wait on earlier ones, which
+// keeps the graph acyclic; the static checks below enforce it. Kept free
+// of Arduino dependencies like state_machine.h.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define INIT_MAX_STEPS        32      // Dependencies are a 32-bit mask
+#define INIT_DEP(id)          (1UL << (id))
+
+typedef bool (*InitFunction)();
+
+struct InitStep {
+    uint8_t id;                   // Must equal the step's index in the table
+    const char* name;
+    InitFunction run;             // Returns false on failure
+    uint32_t dependsOn;           // INIT_DEP() of each step that must succeed first
+    uint32_t after;               // INIT_DEP() of each step that must finish first, ok or not
+    bool concurrent;              // Run on its own task instead of setup()'s
+};
+
+// What happened to a step, filled in by runInitSteps()
+struct InitResult {
+    volatile bool finished;
+    bool ok;
+    bool skipped;                 // A dependency failed, so it never ran
+    bool concurrent;              // Actually ran on its own task
+    unsigned long startMs;        // millis() when it started
+    unsigned long durationMs;
+};
+
+// ==================== STATIC CHECKS ====================
+template<size_t N>
+constexpr bool initStepsIndexed(const InitStep (&steps)[N], size_t i = 0) {
+    return i >= N || (steps[i].id == i && initStepsIndexed(steps, i + 1));
+}
+
+// Every dependency is an earlier step
+template<size_t N>
+constexpr bool initDepsEarlier(const InitStep (&steps)[N], size_t i = 0) {
+    return i >= N || (((steps[i].dependsOn | steps[i].after) >> i) == 0 && initDepsEarlier(steps, i + 1));
+}
+
+#endif // INIT_GRAPH_H
@@ -0,0 +1,64 @@
+#ifndef INIT_TABLE_H
+#define INIT_TABLE_H
+
+// The coin machine's init steps and what each waits for. Concurrent steps
+// run on core 0 while setup() carries on with the rest on core 1; steps
+// that install interrupts or grab the calling task stay on setup()'s task.
+
+#include "init_graph.h"
+
+// ==================== INIT FUNCTIONS ====================
+// Defined in hardware_functions.h; initializeServosStep() in coin_machine_firmware.ino
+bool initializeTimerWheel();
+bool initializeStorage();
+bool startStorageTask();
+bool initializeCamera();
+bool initializeServosStep();
+bool initializeLEDs();
+bool initializeSensor();
+bool initializeTelemetry();
+
+enum InitStepId : uint8_t {
+    INIT_TIMER_WHEEL,
+    INIT_LEDS,
+    INIT_STORAGE,
+    INIT_CAMERA,
+    INIT_SERVOS,
+    INIT_SENSOR,
+    INIT_STORAGE_TASK,
+    INIT_TELEMETRY,
+    INIT_STEP_COUNT
+};
+
+// ==================== STEPS ====================
+// The timer wheel records the calling task as the one to wake, and the
+// sensor interrupt lands on the core that attaches it, so both stay on
+// setup()'s task. The status LED (analogWrite), the camera's XCLK and the
+// servos all configure LEDC, whose driver isn't safe to set up from two
+// tasks at once, so they go one after another: LEDs, camera, servos. The
+// LEDs are quick and go first, on setup()'s task. initializeServos() keeps
+// off the camera's timer, so the servos still attach when the camera
+// fails. SPIFFS mount and camera probe are the slow ones and need nothing
+// from each other.
+constexpr InitStep COIN_MACHINE_INIT_STEPS[] = {
+    // id                 name            run                   depends on                  after                   concurrent
+    {INIT_TIMER_WHEEL,    "timer wheel",  initializeTimerWheel, 0,                          0,                      false},
+    {INIT_LEDS,           "LEDs",         initializeLEDs,       0,                          0,                      false},
+    {INIT_STORAGE,        "storage",      initializeStorage,    0,                          0,                      true},
+    {INIT_CAMERA,         "camera",       initializeCamera,     0,                          INIT_DEP(INIT_LEDS),    true},
+    {INIT_SERVOS,         "servos",       initializeServosStep, 0,                          INIT_DEP(INIT_CAMERA),  true},
+    {INIT_SENSOR,         "sensor",       initializeSensor,     INIT_DEP(INIT_TIMER_WHEEL), 0,                      false},
+    {INIT_STORAGE_TASK,   "storage task", startStorageTask,     INIT_DEP(INIT_STORAGE),     0,                      false},
+    {INIT_TELEMETRY,      "telemetry",    initializeTelemetry,  0,                          0,                      false}
+};
+
+// ==================== STATIC CHECKS ====================
+static_assert(sizeof(COIN_MACHINE_INIT_STEPS) / sizeof(COIN_MACHINE_INIT_STEPS[0]) == INIT_STEP_COUNT,
+              "Every InitStepId needs a row in COIN_MACHINE_INIT_STEPS");
+static_assert(INIT_STEP_COUNT <= INIT_MAX_STEPS, "Too many init steps for the dependency mask");
+static_assert(initStepsIndexed(COIN_MACHINE_INIT_STEPS),
+              "COIN_MACHINE_INIT_STEPS must be in InitStepId order");
+static_assert(initDepsEarlier(COIN_MACHINE_INIT_STEPS),
+              "An init step depends on itself or a later step");
+
+#endif // INIT_TABLE_H
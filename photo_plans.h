@@ -0,0 +1,78 @@
+#ifndef PHOTO_PLANS_H
+#define PHOTO_PLANS_H
+
+// Photo plans: the shots taken of each coin, as data. Each shot moves the
+// flipper to an angle (no move if it is already there), waits for it by
+// the given settle policy, then captures with a light pattern and exposure
+// preset. The PHOTOGRAPHING state runs the active plan; the console picks
+// it per session. The first shot must be a fully lit face, since that is
+// the image the classifier reads.
+
+#include <stdint.h>
+#include "config.h"
+
+struct PhotoShot {
+    uint8_t angle;            // Flipper angle (degrees)
+    uint8_t settle;           // SETTLE_TIMED or SETTLE_CAMERA
+    uint8_t exposure;         // EXPOSURE_* preset
+    uint8_t lights;           // LIGHTS_* pattern
+};
+
+struct PhotoPlan {
+    const char* name;
+    const PhotoShot* shots;
+    uint8_t shotCount;
+};
+
+// Both faces, the original sequence
+constexpr PhotoShot STANDARD_SHOTS[] = {
+    // angle         settle                 exposure           lights
+    {FLIPPER_SIDE_1, FLIPPER_SETTLE_POLICY, EXPOSURE_SESSION,  LIGHTS_FULL},
+    {FLIPPER_SIDE_2, FLIPPER_SETTLE_POLICY, EXPOSURE_SESSION,  LIGHTS_FULL}
+};
+
+// One face only, for bulk sorting
+constexpr PhotoShot FAST_SHOTS[] = {
+    {FLIPPER_SIDE_1, FLIPPER_SETTLE_POLICY, EXPOSURE_SESSION,  LIGHTS_FULL}
+};
+
+// Both faces plus raking-light shots of the rim and the reverse lettering
+constexpr PhotoShot DETAIL_SHOTS[] = {
+    {FLIPPER_SIDE_1, FLIPPER_SETTLE_POLICY, EXPOSURE_SESSION,  LIGHTS_FULL},
+    {FLIPPER_EDGE,   SETTLE_CAMERA,         EXPOSURE_PLUS_1EV, LIGHTS_RAKING},
+    {FLIPPER_SIDE_2, FLIPPER_SETTLE_POLICY, EXPOSURE_SESSION,  LIGHTS_FULL},
+    {FLIPPER_SIDE_2, SETTLE_TIMED,          EXPOSURE_PLUS_1EV, LIGHTS_RAKING}
+};
+
+#define PHOTO_PLAN(name, shots) {name, shots, sizeof(shots) / sizeof(shots[0])}
+
+constexpr PhotoPlan PHOTO_PLANS[] = {
+    PHOTO_PLAN("standard", STANDARD_SHOTS),
+    PHOTO_PLAN("fast", FAST_SHOTS),
+    PHOTO_PLAN("detail", DETAIL_SHOTS)
+};
+
+#define PHOTO_PLAN_COUNT (sizeof(PHOTO_PLANS) / sizeof(PHOTO_PLANS[0]))
+
+// ==================== STATIC CHECKS ====================
+constexpr bool photoShotsValid(const PhotoShot* shots, uint8_t count, uint8_t i = 0) {
+    return i >= count ||
+           (shots[i].angle <= 180 &&
+            (shots[i].settle == SETTLE_TIMED || shots[i].settle == SETTLE_CAMERA) &&
+            shots[i].exposure <= EXPOSURE_MINUS_1EV &&
+            shots[i].lights <= LIGHTS_RAKING &&
+            photoShotsValid(shots, count, i + 1));
+}
+
+constexpr bool photoPlansValid(uint8_t p = 0) {
+    return p >= PHOTO_PLAN_COUNT ||
+           (PHOTO_PLANS[p].shotCount >= 1 && PHOTO_PLANS[p].shotCount <= PHOTO_PLAN_MAX_SHOTS &&
+            PHOTO_PLANS[p].shots[0].lights == LIGHTS_FULL &&
+            photoShotsValid(PHOTO_PLANS[p].shots, PHOTO_PLANS[p].shotCount) &&
+            photoPlansValid(p + 1));
+}
+
+static_assert(photoPlansValid(), "Photo plan needs 1..PHOTO_PLAN_MAX_SHOTS valid shots, the first fully lit");
+static_assert(DEFAULT_PHOTO_PLAN < PHOTO_PLAN_COUNT, "DEFAULT_PHOTO_PLAN out of range");
+
+#endif // PHOTO_PLANS_H
@@ -0,0 +1,102 @@
+#ifndef QUALITY_CONTROLLER_H
+#define QUALITY_CONTROLLER_H
+
+// Adaptive JPEG quality / frame size. Tracks the size and write time of
+// recent frames and steers jpeg_quality so each image fits a byte budget
+// derived from the free storage. Hardware is touched only by the caller
+// (see updateImageQuality() in hardware_functions.h).
+
+#include <stdint.h>
+#include "config.h"
+
+struct QualityController {
+    uint8_t quality;            // Current jpeg_quality (0-63, lower = better)
+    bool reducedFrame;          // Dropped to QUALITY_REDUCED_FRAME_SIZE
+    bool storageFull;           // Not enough room left for another coin
+    uint32_t avgFrameBytes;     // Running average of recent frame sizes
+    uint32_t avgWriteMs;        // Running average of recent write times
+    uint32_t budgetBytes;       // Current per-image target
+    uint8_t framesSinceChange;
+};
+
+void qualityControllerInit(QualityController& qc) {
+    qc.quality = CAMERA_JPEG_QUALITY;
+    qc.reducedFrame = false;
+    qc.storageFull = false;
+    qc.avgFrameBytes = 0;
+    qc.avgWriteMs = 0;
+    qc.budgetBytes = QUALITY_MAX_IMAGE_BYTES;
+    qc.framesSinceChange = 0;
+}
+
+// Feed one stored frame into the running averages (weight 1/4 per frame)
+void qualityControllerAddFrame(QualityController& qc, uint32_t bytes, uint32_t writeMs) {
+    if (qc.framesSinceChange == 0) {
+        qc.avgFrameBytes = bytes;
+    } else {
+        qc.avgFrameBytes = (qc.avgFrameBytes * 3 + bytes) / 4;
+    }
+    qc.avgWriteMs = (qc.avgWriteMs * 3 + writeMs) / 4;
+    if (qc.framesSinceChange < 255) {
+        qc.framesSinceChange++;
+    }
+}
+
+// Recompute the budget and step quality/frame size towards it.
+// Returns true if the camera settings need to be re-applied.
+bool qualityControllerUpdate(QualityController& qc, uint32_t freeBytes) {
+    qc.storageFull = freeBytes < QUALITY_MIN_FREE_BYTES;
+
+    // Spread what is left over the reserve so the last coins still fit
+    uint32_t budget = freeBytes / QUALITY_RESERVE_IMAGES;
+    if (budget > QUALITY_MAX_IMAGE_BYTES) {
+        budget = QUALITY_MAX_IMAGE_BYTES;
+    }
+
+    // Slow writes mean flash is backing up; ask for smaller images
+    if (qc.avgWriteMs > QUALITY_MAX_WRITE_MS) {
+        budget = budget * QUALITY_MAX_WRITE_MS / qc.avgWriteMs;
+    }
+    qc.budgetBytes = budget;
+
+    // A raw crop is the same size whatever jpeg_quality says, and is always
+    // over the JPEG budget; steering would only cost it resolution
+    if (CAPTURE_MODE != CAPTURE_MODE_JPEG) {
+        return false;
+    }
+
+    if (qc.framesSinceChange < QUALITY_SETTLE_FRAMES) {
+        return false;
+    }
+
+    bool changed = false;
+    if (qc.avgFrameBytes > budget + budget / 8) {
+        if (qc.quality < QUALITY_WORST) {
+            qc.quality += QUALITY_STEP;
+            if (qc.quality > QUALITY_WORST) {
+                qc.quality = QUALITY_WORST;
+            }
+            changed = true;
+        } else if (!qc.reducedFrame) {
+            // Out of quality headroom; trade resolution instead
+            qc.reducedFrame = true;
+            qc.quality = CAMERA_JPEG_QUALITY;
+            changed = true;
+        }
+    } else if (qc.avgFrameBytes < budget - budget / 4) {
+        if (qc.quality > CAMERA_JPEG_QUALITY) {
+            qc.quality--;
+            changed = true;
+        } else if (qc.reducedFrame && qc.avgFrameBytes * 4 < budget) {
+            qc.reducedFrame = false;
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        qc.framesSinceChange = 0;
+    }
+    return changed;
+}
+
+#endif // QUALITY_CONTROLLER_H
@@ -0,0 +1,56 @@
+#ifndef SCRATCH_POOL_H
+#define SCRATCH_POOL_H
+
+// Bump allocator over one block that is allocated once, for analysis
+// buffers that only live while one coin is processed. reset() frees them
+// all between coins, so per-coin work never goes to the heap and cannot
+// fragment it. One owner task only; there is no locking. Kept free of
+// Arduino dependencies like spsc_queue.h.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SCRATCH_ALIGN         4       // Every allocation starts word-aligned
+
+class ScratchPool {
+public:
+    void begin(uint8_t* memory, size_t size) {
+        base = memory;
+        capacity = memory ? size : 0;
+        used = 0;
+    }
+
+    // NULL (and a counted failure) if the request doesn't fit
+    void* alloc(size_t bytes) {
+        size_t start = (used + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+        if (start > capacity || bytes > capacity - start) {
+            failures++;
+            return NULL;
+        }
+        used = start + bytes;
+        if (used > highWater) {
+            highWater = used;
+        }
+        return base + start;
+    }
+
+    void reset() {
+        used = 0;
+        resets++;
+    }
+
+    size_t size() const {
+        return capacity;
+    }
+
+    size_t highWater = 0;         // Most bytes in use before a reset
+    uint32_t failures = 0;
+    uint32_t resets = 0;
+
+private:
+    uint8_t* base = NULL;
+    size_t capacity = 0;
+    size_t used = 0;
+};
+
+#endif // SCRATCH_POOL_H
@@ -0,0 +1,59 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+// Fixed-size ring for handing work between two tasks, possibly on
+// different cores, without a lock. One producer (which only moves tail)
+// and one consumer (which only moves head); the acquire/release index
+// updates publish a slot's contents before the index that covers it.
+// Kept free of Arduino dependencies like coin_queue.h.
+
+#include <stdint.h>
+
+template<typename T, uint8_t Size>
+class SpscQueue {
+    static_assert(Size != 0 && (Size & (Size - 1)) == 0 && Size <= 128,
+                  "SpscQueue size must be a power of two, at most 128");
+
+public:
+    uint8_t count() const {
+        return (uint8_t)(__atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE));
+    }
+
+    // Producer side. Returns false (and counts a drop) when full.
+    bool push(const T& item) {
+        uint8_t t = tail;
+        uint8_t queued = (uint8_t)(t - __atomic_load_n(&head, __ATOMIC_ACQUIRE));
+        if (queued >= Size) {
+            dropped++;
+            return false;
+        }
+        slots[t & (Size - 1)] = item;
+        __atomic_store_n(&tail, (uint8_t)(t + 1), __ATOMIC_RELEASE);
+        if (queued + 1 > highWater) {
+            highWater = queued + 1;
+        }
+        return true;
+    }
+
+    // Consumer side. The slot is cleared so it holds no resources once taken.
+    bool pop(T& item) {
+        uint8_t h = head;
+        if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        item = slots[h & (Size - 1)];
+        slots[h & (Size - 1)] = T();
+        __atomic_store_n(&head, (uint8_t)(h + 1), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    uint32_t dropped = 0;         // Producer side only
+    uint8_t highWater = 0;        // Most items ever queued at once
+
+private:
+    T slots[Size];
+    uint8_t head = 0;
+    uint8_t tail = 0;
+};
+
+#endif // SPSC_QUEUE_H
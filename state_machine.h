@@ -0,0 +1,265 @@
+#ifndef STATE_MACHINE_H
+#define STATE_MACHINE_H
+
+// Table-driven state machine engine. States (entry/exit/tick actions and
+// timeouts) and transitions (event, guard, action) are plain constexpr
+// tables; see state_table.h for the coin machine's. Kept free of Arduino
+// dependencies: time is passed in, so the same tables run on the host.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SM_ANY_STATE          0xFE    // Transition row applies to every state without its own row
+#define SM_NONE               0xFF    // No transition / empty queue slot
+#define SM_QUEUE_SIZE         8       // Events that can be posted per update()
+
+typedef void (*StateAction)();
+typedef bool (*TransitionGuard)();
+typedef void (*TransitionHook)(uint8_t from, uint8_t to, uint8_t event);
+
+struct StateDef {
+    uint8_t id;               // Must equal the state's index in the table
+    const char* name;
+    StateAction onEntry;      // May be NULL
+    StateAction onExit;
+    StateAction onTick;       // Runs on every update() while in the state
+    uint32_t timeoutMs;       // Raises the timeout event after this long, 0 = never
+    bool idle;                // May wait for input indefinitely (no timeout required)
+};
+
+// Rows sharing (from, event) must be adjacent; the first whose guard
+// passes is taken
+struct Transition {
+    uint8_t from;             // State id or SM_ANY_STATE
+    uint8_t event;
+    TransitionGuard guard;    // NULL = always
+    uint8_t to;
+    StateAction action;       // Runs between exit and entry, may be NULL
+};
+
+template<uint8_t NumStates, uint8_t NumEvents>
+class StateMachine {
+public:
+    void begin(const StateDef* stateTable, const Transition* transitionTable, uint8_t transitionCount,
+               uint8_t initialState, uint8_t timeoutEvent, unsigned long now) {
+        states = stateTable;
+        transitions = transitionTable;
+        numTransitions = transitionCount;
+        timeout = timeoutEvent;
+        state = initialState;
+        lastState = initialState;
+        enteredTime = now;
+        queueHead = queueTail = 0;
+
+        // Index the first row for every (state, event) so dispatch is a
+        // single lookup. State-specific rows win over SM_ANY_STATE rows.
+        for (uint8_t s = 0; s < NumStates; s++) {
+            for (uint8_t e = 0; e < NumEvents; e++) {
+                index[s][e] = SM_NONE;
+            }
+        }
+        for (int i = numTransitions - 1; i >= 0; i--) {
+            const Transition& t = transitions[i];
+            if (t.from != SM_ANY_STATE) {
+                index[t.from][t.event] = i;
+            }
+        }
+        for (int i = numTransitions - 1; i >= 0; i--) {
+            const Transition& t = transitions[i];
+            if (t.from != SM_ANY_STATE) {
+                continue;
+            }
+            for (uint8_t s = 0; s < NumStates; s++) {
+                if (index[s][t.event] == SM_NONE || transitions[index[s][t.event]].from == SM_ANY_STATE) {
+                    index[s][t.event] = i;
+                }
+            }
+        }
+
+        if (states[state].onEntry) {
+            states[state].onEntry();
+        }
+    }
+
+    // Handle an event now. Returns true if it caused a transition.
+    bool dispatch(uint8_t event, unsigned long now) {
+        uint8_t first = index[state][event];
+        if (first == SM_NONE) {
+            return false;
+        }
+        uint8_t from = transitions[first].from;
+        for (uint8_t i = first; i < numTransitions; i++) {
+            const Transition& t = transitions[i];
+            if (t.from != from || t.event != event) {
+                break;
+            }
+            if (t.guard && !t.guard()) {
+                continue;
+            }
+
+            if (states[state].onExit) {
+                states[state].onExit();
+            }
+            if (t.action) {
+                t.action();
+            }
+            lastState = state;
+            state = t.to;
+            enteredTime = now;
+            if (hook) {
+                hook(lastState, state, event);
+            }
+            if (states[state].onEntry) {
+                states[state].onEntry();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Queue an event for the end of the current update(). Used from actions,
+    // which must not dispatch directly.
+    bool post(uint8_t event) {
+        uint8_t next = (queueTail + 1) % SM_QUEUE_SIZE;
+        if (next == queueHead) {
+            return false;
+        }
+        queue[queueTail] = event;
+        queueTail = next;
+        return true;
+    }
+
+    // One loop() pass: fire the timeout if due, run the state's tick action,
+    // then handle anything it posted
+    void update(unsigned long now) {
+        uint32_t timeoutMs = states[state].timeoutMs;
+        if (timeoutMs != 0 && now - enteredTime >= timeoutMs) {
+            dispatch(timeout, now);
+        }
+        if (states[state].onTick) {
+            states[state].onTick();
+        }
+        while (queueHead != queueTail) {
+            uint8_t event = queue[queueHead];
+            queueHead = (queueHead + 1) % SM_QUEUE_SIZE;
+            dispatch(event, now);
+        }
+    }
+
+    // Called on every transition, after exit and action, before entry
+    void onTransition(TransitionHook transitionHook) { hook = transitionHook; }
+
+    uint8_t current() const { return state; }
+    uint8_t previous() const { return lastState; }
+    unsigned long enteredAt() const { return enteredTime; }
+    unsigned long timeInState(unsigned long now) const { return now - enteredTime; }
+
+    // How long update() can wait before the current state times out
+    unsigned long timeUntilTimeout(unsigned long now) const {
+        uint32_t timeoutMs = states[state].timeoutMs;
+        if (timeoutMs == 0) {
+            return (unsigned long)-1;
+        }
+        unsigned long elapsed = now - enteredTime;
+        return elapsed >= timeoutMs ? 0 : timeoutMs - elapsed;
+    }
+    const char* stateName(uint8_t s) const { return s < NumStates ? states[s].name : "UNKNOWN"; }
+
+private:
+    const StateDef* states;
+    const Transition* transitions;
+    uint8_t numTransitions;
+    uint8_t index[NumStates][NumEvents];
+    uint8_t state;
+    uint8_t lastState;
+    uint8_t timeout;
+    unsigned long enteredTime;
+    uint8_t queue[SM_QUEUE_SIZE];
+    uint8_t queueHead;
+    uint8_t queueTail;
+    TransitionHook hook = NULL;
+};
+
+// ==================== STATIC CHECKS ====================
+// constexpr helpers for static_assert on the tables (C++11: single return)
+
+// Every table entry sits at the index of its id
+template<size_t S>
+constexpr bool smStatesIndexed(const StateDef (&states)[S], size_t s = 0) {
+    return s >= S || (states[s].id == s && smStatesIndexed(states, s + 1));
+}
+
+// State has a row of its own for event
+template<size_t N>
+constexpr bool smHasOwnRow(const Transition (&t)[N], uint8_t state, uint8_t event, size_t i = 0) {
+    return i < N && ((t[i].from == state && t[i].event == event) || smHasOwnRow(t, state, event, i + 1));
+}
+
+// Row i can fire in state, as dispatch() would pick it (guards aside)
+template<size_t N>
+constexpr bool smRowApplies(const Transition (&t)[N], size_t i, uint8_t state) {
+    return t[i].from == state || (t[i].from == SM_ANY_STATE && !smHasOwnRow(t, state, t[i].event));
+}
+
+// Bit mask of the states one transition away from state
+template<size_t N>
+constexpr uint64_t smTargetsFrom(const Transition (&t)[N], uint8_t state, size_t i = 0) {
+    return i >= N ? 0 :
+           (smRowApplies(t, i, state) ? (1ULL << t[i].to) : 0) | smTargetsFrom(t, state, i + 1);
+}
+
+// reached plus every state one transition away from it
+template<size_t N>
+constexpr uint64_t smReachStep(const Transition (&t)[N], uint8_t numStates, uint64_t reached, uint8_t s = 0) {
+    return s >= numStates ? reached :
+           ((reached >> s) & 1 ? smTargetsFrom(t, s) : 0) | smReachStep(t, numStates, reached, s + 1);
+}
+
+// Fixed point of smReachStep
+template<size_t N>
+constexpr uint64_t smReachable(const Transition (&t)[N], uint8_t numStates, uint64_t reached) {
+    return smReachStep(t, numStates, reached) == reached ? reached :
+           smReachable(t, numStates, smReachStep(t, numStates, reached));
+}
+
+// Every state can be reached from the initial one by some sequence of
+// events, ignoring guards
+template<size_t N>
+constexpr bool smAllReachable(const Transition (&t)[N], uint8_t numStates, uint8_t initial) {
+    return numStates <= 64 &&
+           smReachable(t, numStates, 1ULL << initial) == (numStates == 64 ? ~0ULL : (1ULL << numStates) - 1);
+}
+
+template<size_t N>
+constexpr bool smHandles(const Transition (&t)[N], uint8_t state, uint8_t event, size_t i = 0) {
+    return i < N && (((t[i].from == state || t[i].from == SM_ANY_STATE) && t[i].event == event) ||
+                     smHandles(t, state, event, i + 1));
+}
+
+// Every non-idle state has a timeout, and every timeout leads somewhere
+template<size_t S, size_t N>
+constexpr bool smTimeoutsHandled(const StateDef (&states)[S], const Transition (&t)[N], uint8_t event, size_t s = 0) {
+    return s >= S ||
+           ((states[s].idle || states[s].timeoutMs != 0) &&
+            (states[s].timeoutMs == 0 || smHandles(t, s, event)) &&
+            smTimeoutsHandled(states, t, event, s + 1));
+}
+
+template<size_t N>
+constexpr bool smSameKey(const Transition (&t)[N], size_t a, size_t b) {
+    return t[a].from == t[b].from && t[a].event == t[b].event;
+}
+
+template<size_t N>
+constexpr bool smKeyRecursAfterGap(const Transition (&t)[N], size_t i, size_t j) {
+    return j < N && (smSameKey(t, i, j) || smKeyRecursAfterGap(t, i, j + 1));
+}
+
+// Rows with the same (from, event) are adjacent
+template<size_t N>
+constexpr bool smRowsGrouped(const Transition (&t)[N], size_t i = 0) {
+    return i + 1 >= N ||
+           ((smSameKey(t, i, i + 1) || !smKeyRecursAfterGap(t, i, i + 2)) && smRowsGrouped(t, i + 1));
+}
+
+#endif // STATE_MACHINE_H
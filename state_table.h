@@ -0,0 +1,83 @@
+#ifndef STATE_TABLE_H
+#define STATE_TABLE_H
+
+// The coin machine's states, timeouts and transitions, all in one place.
+// The static_asserts at the bottom reject unreachable states and states
+// that could wait forever, in the firmware and in any host build.
+
+#include "config.h"
+#include "state_machine.h"
+
+// ==================== STATE ACTIONS ====================
+// Defined in coin_machine_firmware.ino; guards and systemReset() come from
+// hardware_functions.h
+void enterWaitingForCoin();
+void enterCoinDetected();
+void enterProcessing();
+void enterPhotographing();
+void enterRejecting();
+void enterError();
+void exitCoinDetected();
+void exitRejecting();
+void handlePhotographing();
+void handleErrorState();
+void acceptCoin();
+void rejectMultipleCoins();
+void rejectStorageFull();
+void failWithTimeout();
+bool isMultipleCoinDetected();
+bool hasQueuedCoin();
+bool isStorageFull();
+void systemReset();
+
+// ==================== STATES ====================
+constexpr StateDef COIN_MACHINE_STATES[] = {
+    // id                    name                entry                exit              tick                 timeout (ms)            idle
+    {STATE_INIT,             "INIT",             NULL,                NULL,             NULL,                0,                      true},
+    {STATE_WAITING_FOR_COIN, "WAITING_FOR_COIN", enterWaitingForCoin, NULL,             NULL,                0,                      true},
+    {STATE_COIN_DETECTED,    "COIN_DETECTED",    enterCoinDetected,   exitCoinDetected, NULL,                MULTI_COIN_TIMEOUT * 2, false},
+    {STATE_PROCESSING,       "PROCESSING",       enterProcessing,     NULL,             NULL,                COIN_SETTLE_TIME,       false},
+    {STATE_PHOTOGRAPHING,    "PHOTOGRAPHING",    enterPhotographing,  NULL,             handlePhotographing, PROCESSING_TIMEOUT,     false},
+    {STATE_REJECTING,        "REJECTING",        enterRejecting,      exitRejecting,    NULL,                TRAPDOOR_OPEN_TIME,     false},
+    {STATE_ERROR,            "ERROR",            enterError,          NULL,             handleErrorState,    RESET_TIMEOUT,          false}
+};
+
+// ==================== TRANSITIONS ====================
+constexpr Transition COIN_MACHINE_TRANSITIONS[] = {
+    // from                  event                guard                   to                      action
+    {STATE_INIT,             EVENT_START,         NULL,                   STATE_WAITING_FOR_COIN, NULL},
+    {STATE_WAITING_FOR_COIN, EVENT_COIN_SENSED,   NULL,                   STATE_COIN_DETECTED,    NULL},
+    {STATE_COIN_DETECTED,    EVENT_WINDOW_CLOSED, isMultipleCoinDetected, STATE_REJECTING,        rejectMultipleCoins},
+    {STATE_COIN_DETECTED,    EVENT_WINDOW_CLOSED, isStorageFull,          STATE_REJECTING,        rejectStorageFull},
+    {STATE_COIN_DETECTED,    EVENT_WINDOW_CLOSED, NULL,                   STATE_PROCESSING,       acceptCoin},
+    {STATE_COIN_DETECTED,    EVENT_TIMEOUT,       NULL,                   STATE_WAITING_FOR_COIN, NULL},
+    {STATE_PROCESSING,       EVENT_TIMEOUT,       NULL,                   STATE_PHOTOGRAPHING,    NULL},
+    {STATE_PHOTOGRAPHING,    EVENT_PHOTOS_DONE,   hasQueuedCoin,          STATE_COIN_DETECTED,    NULL},
+    {STATE_PHOTOGRAPHING,    EVENT_PHOTOS_DONE,   NULL,                   STATE_WAITING_FOR_COIN, NULL},
+    {STATE_PHOTOGRAPHING,    EVENT_TIMEOUT,       NULL,                   STATE_ERROR,            failWithTimeout},
+    {STATE_REJECTING,        EVENT_CHUTE_CLEAR,   hasQueuedCoin,          STATE_COIN_DETECTED,    NULL},
+    {STATE_REJECTING,        EVENT_CHUTE_CLEAR,   NULL,                   STATE_WAITING_FOR_COIN, NULL},
+    {STATE_REJECTING,        EVENT_TIMEOUT,       NULL,                   STATE_WAITING_FOR_COIN, NULL},
+    {STATE_ERROR,            EVENT_RECOVERED,     NULL,                   STATE_WAITING_FOR_COIN, NULL},
+    {STATE_ERROR,            EVENT_TIMEOUT,       NULL,                   STATE_WAITING_FOR_COIN, systemReset},
+    {SM_ANY_STATE,           EVENT_FAULT,         NULL,                   STATE_ERROR,            NULL},
+    {SM_ANY_STATE,           EVENT_RESET,         NULL,                   STATE_WAITING_FOR_COIN, systemReset}
+};
+
+#define NUM_COIN_MACHINE_TRANSITIONS (sizeof(COIN_MACHINE_TRANSITIONS) / sizeof(COIN_MACHINE_TRANSITIONS[0]))
+
+typedef StateMachine<STATE_COUNT, EVENT_COUNT> CoinStateMachine;
+
+// ==================== STATIC CHECKS ====================
+static_assert(sizeof(COIN_MACHINE_STATES) / sizeof(COIN_MACHINE_STATES[0]) == STATE_COUNT,
+              "Every CoinMachineState needs a row in COIN_MACHINE_STATES");
+static_assert(smStatesIndexed(COIN_MACHINE_STATES),
+              "COIN_MACHINE_STATES must be in CoinMachineState order");
+static_assert(smAllReachable(COIN_MACHINE_TRANSITIONS, STATE_COUNT, STATE_INIT),
+              "COIN_MACHINE_TRANSITIONS leaves a state unreachable");
+static_assert(smTimeoutsHandled(COIN_MACHINE_STATES, COIN_MACHINE_TRANSITIONS, EVENT_TIMEOUT),
+              "Non-idle state without a timeout, or a timeout with no transition");
+static_assert(smRowsGrouped(COIN_MACHINE_TRANSITIONS),
+              "Transitions for the same state and event must be adjacent");
+
+#endif // STATE_TABLE_H
@@ -0,0 +1,95 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+// Binary telemetry frame for fleet monitoring. One fixed-layout frame is
+// sent every TELEMETRY_INTERVAL and after every coin; tools/
+// telemetry_collector.py decodes it (keep its FRAME layout in step with
+// this struct and bump TELEMETRY_VERSION on any change). Counters and
+// histograms are totals since boot, so a lost frame loses nothing: the
+// collector works with differences between frames. Little-endian, packed.
+// Kept free of Arduino dependencies.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TELEMETRY_SYNC0       0xC5
+#define TELEMETRY_SYNC1       0x7E
+#define TELEMETRY_VERSION     1
+#define TELEMETRY_HIST_BUCKETS 16
+
+// Why a frame was sent
+#define TELEMETRY_PERIODIC    0
+#define TELEMETRY_COIN        1       // A coin was photographed or rejected
+
+// Power-of-two buckets: bucket 0 counts zeros, bucket n counts values in
+// [2^(n-1), 2^n), and the last bucket everything above. Counts wrap at
+// 65536; the collector takes differences modulo that.
+struct __attribute__((packed)) TelemetryHistogram {
+    uint16_t counts[TELEMETRY_HIST_BUCKETS];
+};
+
+inline void histogramAdd(TelemetryHistogram& histogram, uint32_t value) {
+    uint8_t bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+    if (bucket >= TELEMETRY_HIST_BUCKETS) {
+        bucket = TELEMETRY_HIST_BUCKETS - 1;
+    }
+    histogram.counts[bucket]++;
+}
+
+struct __attribute__((packed)) TelemetryFrame {
+    uint8_t sync[2];              // TELEMETRY_SYNC0, TELEMETRY_SYNC1
+    uint8_t version;              // TELEMETRY_VERSION
+    uint8_t length;               // sizeof(TelemetryFrame)
+    uint32_t unitId;              // Low bits of the chip's MAC
+    uint32_t sequence;            // Frames sent since boot
+    uint32_t uptimeMs;
+    uint8_t reason;               // TELEMETRY_PERIODIC / TELEMETRY_COIN
+    uint8_t state;                // CoinMachineState
+    uint8_t lastError;            // StatusCode
+    uint8_t storageFillPercent;
+    int16_t temperatureDeciC;     // Chip temperature, tenths of a degree
+    uint16_t errorCount;
+    uint32_t coinsSensed;
+    uint32_t coinsPhotographed;
+    uint32_t coinsRejected;
+    uint32_t coinsStored;         // Records written by the storage task
+    uint32_t storageFreeBytes;
+    uint32_t freeHeap;
+    uint32_t largestFreeBlock;
+    uint32_t logDropped;          // Event log overflow since boot
+    uint32_t queueDrops;          // Coin, image and record queues
+    uint32_t recordWriteFailures;
+    uint32_t maxLoopPassUs;
+    uint8_t lastDenomination;     // CoinDenomination
+    uint8_t lastConfidence;       // Percent
+    uint8_t photoPlan;
+    uint8_t jpegQuality;
+    TelemetryHistogram loopPassUs;    // loop() work per pass
+    TelemetryHistogram imageWriteMs;  // SPIFFS write per image
+    TelemetryHistogram coinCycleMs;   // Sensor to last photo, per coin
+    uint16_t crc;                 // CRC-16/CCITT-FALSE of everything before it
+};
+
+static_assert(sizeof(TelemetryFrame) == 170, "TelemetryFrame layout changed; update the collector and TELEMETRY_VERSION");
+
+inline uint16_t telemetryCrc(const uint8_t* data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Fill in the framing fields once the payload is set
+inline void telemetrySeal(TelemetryFrame& frame) {
+    frame.sync[0] = TELEMETRY_SYNC0;
+    frame.sync[1] = TELEMETRY_SYNC1;
+    frame.version = TELEMETRY_VERSION;
+    frame.length = sizeof(TelemetryFrame);
+    frame.crc = telemetryCrc((const uint8_t*)&frame, offsetof(TelemetryFrame, crc));
+}
+
+#endif // TELEMETRY_H
@@ -0,0 +1,117 @@
+/*
+ * Host benchmark for the denomination classifier
+ *
+ * Runs the same int8 model as the firmware over a labelled corpus and
+ * reports accuracy, a confusion matrix and latency per prediction.
+ *
+ * Build:  g++ -O2 -I.. -o classifier_bench classifier_bench.cpp
+ * Usage:  ./classifier_bench corpus.csv
+ *
+ * Corpus format (one coin per line, header optional):
+ *   label,diameter_px,mean_r,mean_g,mean_b,block_ms
+ * where label is a denomination name as printed by the firmware (e.g. DIME).
+ * The coins.csv written by the firmware can be turned into a corpus by
+ * replacing the predicted denomination with the true one.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "coin_classifier.h"
+
+struct LabelledCoin {
+    CoinDenomination label;
+    CoinFeatures features;
+};
+
+bool parseDenomination(const char* name, CoinDenomination* out) {
+    for (int c = 0; c <= COIN_UNKNOWN; c++) {
+        if (strcmp(name, getDenominationName((CoinDenomination)c)) == 0) {
+            *out = (CoinDenomination)c;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s corpus.csv\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "r");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<LabelledCoin> corpus;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        char label[32];
+        unsigned diameter, r, g, b, block;
+        if (sscanf(line, "%31[^,],%u,%u,%u,%u,%u", label, &diameter, &r, &g, &b, &block) != 6) {
+            continue;
+        }
+        LabelledCoin coin;
+        if (!parseDenomination(label, &coin.label)) {
+            continue;
+        }
+        coin.features.diameterPx = diameter;
+        coin.features.meanR = r;
+        coin.features.meanG = g;
+        coin.features.meanB = b;
+        coin.features.blockTimeMs = block;
+        corpus.push_back(coin);
+    }
+    fclose(file);
+
+    if (corpus.empty()) {
+        fprintf(stderr, "no labelled coins in %s\n", argv[1]);
+        return 1;
+    }
+
+    // Accuracy and confusion matrix
+    int confusion[COIN_UNKNOWN + 1][COIN_UNKNOWN + 1] = {};
+    int correct = 0;
+    for (size_t i = 0; i < corpus.size(); i++) {
+        CoinPrediction prediction = classifyCoin(corpus[i].features);
+        confusion[corpus[i].label][prediction.denomination]++;
+        if (prediction.denomination == corpus[i].label) {
+            correct++;
+        }
+    }
+
+    printf("Coins: %zu\n", corpus.size());
+    printf("Accuracy: %.2f%%\n", 100.0 * correct / corpus.size());
+    printf("\n%-12s", "true\\pred");
+    for (int p = 0; p <= COIN_UNKNOWN; p++) {
+        printf("%8.7s", getDenominationName((CoinDenomination)p));
+    }
+    printf("\n");
+    for (int t = 0; t <= COIN_UNKNOWN; t++) {
+        printf("%-12s", getDenominationName((CoinDenomination)t));
+        for (int p = 0; p <= COIN_UNKNOWN; p++) {
+            printf("%8d", confusion[t][p]);
+        }
+        printf("\n");
+    }
+
+    // Latency, repeated enough to get a stable figure
+    const int repeats = 1000;
+    volatile int sink = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < corpus.size(); i++) {
+            sink += classifyCoin(corpus[i].features).denomination;
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("\nLatency: %.1f ns per prediction (host)\n", ns / (repeats * corpus.size()));
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""
+Convert raw coin captures (.raw) to standard images on the host.
+
+The firmware writes raw captures when CAPTURE_MODE is GRAYSCALE or YUV422:
+a RawImageHeader (see hardware_functions.h) followed by `height` rows of
+`stride` bytes. This does the JPEG/PNG encoding the device skips.
+
+Usage: raw_to_image.py coin_123_1.raw [more.raw ...] [--format png|jpg] [--quality 95]
+Needs Pillow (pip install pillow).
+"""
+
+import argparse
+import struct
+import sys
+
+from PIL import Image
+
+HEADER = struct.Struct("<IBBHHHIHHHHI")
+RAW_IMAGE_MAGIC = 0x57415243
+RAW_FORMAT_GRAY8 = 1
+RAW_FORMAT_YUYV = 2
+
+
+def clamp(value):
+    return 0 if value < 0 else 255 if value > 255 else value
+
+
+def yuyv_to_rgb(rows, width, height):
+    rgb = bytearray(width * height * 3)
+    out = 0
+    for row in rows:
+        for x in range(0, width, 2):
+            y0, u, y1, v = row[x * 2], row[x * 2 + 1], row[x * 2 + 2], row[x * 2 + 3]
+            d, e = u - 128, v - 128
+            for y in (y0, y1):
+                rgb[out] = clamp(y + ((359 * e) >> 8))
+                rgb[out + 1] = clamp(y - ((88 * d + 183 * e) >> 8))
+                rgb[out + 2] = clamp(y + ((454 * d) >> 8))
+                out += 3
+    return Image.frombytes("RGB", (width, height), bytes(rgb))
+
+
+def read_raw(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    (magic, version, fmt, header_size, width, height, stride,
+     origin_x, origin_y, frame_width, frame_height, timestamp) = HEADER.unpack_from(data)
+    if magic != RAW_IMAGE_MAGIC:
+        raise ValueError("%s: not a raw coin capture" % path)
+
+    rows = [data[header_size + y * stride:header_size + (y + 1) * stride] for y in range(height)]
+    if fmt == RAW_FORMAT_GRAY8:
+        return Image.frombytes("L", (width, height), b"".join(row[:width] for row in rows))
+    if fmt == RAW_FORMAT_YUYV:
+        return yuyv_to_rgb(rows, width, height)
+    raise ValueError("%s: unknown raw format %d" % (path, fmt))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("files", nargs="+")
+    parser.add_argument("--format", choices=["png", "jpg"], default="png")
+    parser.add_argument("--quality", type=int, default=95, help="JPEG quality (1-100)")
+    args = parser.parse_args()
+
+    for path in args.files:
+        try:
+            image = read_raw(path)
+        except (ValueError, struct.error) as err:
+            print(err, file=sys.stderr)
+            continue
+        out = path.rsplit(".", 1)[0] + "." + args.format
+        if args.format == "jpg":
+            image.save(out, quality=args.quality)
+        else:
+            image.save(out)
+        print("%s -> %s (%dx%d)" % (path, out, image.width, image.height))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,402 @@
+/*
+ * Host replay of recorded sensor edges through the firmware's state machine
+ *
+ * Feeds the edges printed by the 'edges dump' command through the same
+ * coin_sensor.h (debounce, coin queue, multiple coin window) and
+ * state_table.h the firmware runs, on a virtual clock, and reports every
+ * accept and reject. The flipper, camera and trapdoor are stood in for by
+ * their timings: photography takes -p ms, the chute is checked
+ * TRAPDOOR_DROP_TIME after a reject as on the device. The clock jumps from
+ * one edge, timer or state timeout to the next, so hours of drops replay in
+ * milliseconds and the same capture always gives the same result.
+ *
+ * To try a detection change, edit config.h, coin_sensor.h or the tables in
+ * state_table.h, rebuild and compare the output against the old build's.
+ *
+ * Build:  g++ -O2 -I.. -DALLOC_COUNTER_WRAP -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc \
+ *             -o sensor_replay sensor_replay.cpp
+ * Usage:  ./sensor_replay [-p photo_ms] [-v] capture.log ...
+ *
+ * Built as above it also counts heap allocations (alloc_counter.h) while
+ * the firmware's code runs, and exits with status 1 if there were any: a
+ * coin cycle must not allocate. Without -DALLOC_COUNTER_WRAP they aren't
+ * counted.
+ *
+ * Capture format: the serial output of 'edges dump'. "B" starts a boot,
+ * "E <micros> <0 blocked|1 clear>" is an edge; other lines are ignored.
+ * Differences from the device: storage is never full, and ERROR recovers
+ * by its RESET_TIMEOUT only (the device's handleError() may recover first).
+ */
+
+#include <stdint.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "coin_sensor.h"
+#include "state_table.h"
+
+struct Edge {
+    uint64_t timeUs;              // Unwrapped micros() since boot
+    bool blocked;
+};
+
+typedef std::vector<Edge> Boot;
+
+// ==================== VIRTUAL CLOCK ====================
+uint64_t nowUs = 0;
+
+uint32_t nowMs() {
+    return (uint32_t)(nowUs / 1000);
+}
+
+// ==================== ALLOCATIONS ====================
+uint32_t allocationsSoFar() {
+#ifdef ALLOC_COUNTER_WRAP
+    return hostAllocs.allocations;
+#else
+    return 0;
+#endif
+}
+
+// ==================== TIMERS ====================
+// Stands in for the timer wheel: actions due at a virtual time, and the
+// events they post for the next loop pass. Both are reserved up front so
+// the replay itself doesn't allocate.
+#define REPLAY_MAX_TIMERS     16
+typedef void (*TimerAction)(uint32_t arg);
+
+struct Timer {
+    uint64_t dueUs;
+    TimerAction action;
+    uint32_t arg;
+};
+
+std::vector<Timer> timers;
+std::vector<uint8_t> timerEvents;
+
+void scheduleAfter(uint32_t delayMs, TimerAction action, uint32_t arg) {
+    Timer timer = {nowUs + delayMs * 1000ULL, action, arg};
+    timers.push_back(timer);
+}
+
+void cancelTimerAction(TimerAction action) {
+    for (size_t i = 0; i < timers.size(); ) {
+        if (timers[i].action == action) {
+            timers.erase(timers.begin() + i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Index of the earliest timer, first scheduled on a tie; -1 if none
+int nextTimer() {
+    int next = -1;
+    for (size_t i = 0; i < timers.size(); i++) {
+        if (next < 0 || timers[i].dueUs < timers[next].dueUs) {
+            next = (int)i;
+        }
+    }
+    return next;
+}
+
+void runDueTimers() {
+    int next;
+    while ((next = nextTimer()) >= 0 && timers[next].dueUs <= nowUs) {
+        Timer timer = timers[next];
+        timers.erase(timers.begin() + next);
+        timer.action(timer.arg);
+    }
+}
+
+void postTimerEvent(uint8_t event) {
+    timerEvents.push_back(event);
+}
+
+// ==================== MACHINE ====================
+CoinStateMachine stateMachine;
+CoinQueue coinQueue;
+SensorState sensorState;
+uint32_t photoMs = 3000;
+bool verbose = false;
+
+struct ReplayStats {
+    unsigned long boots;
+    unsigned long edges;
+    unsigned long coinsSensed;
+    unsigned long accepted;
+    unsigned long rejects;        // Reject cycles
+    unsigned long coinsRejected;  // Coins in them
+    unsigned long queueDrops;
+    unsigned long timeouts;
+    unsigned long leftQueued;     // Still waiting when a boot's edges ran out
+    unsigned long allocations;    // Heap allocations by the firmware's code
+    uint8_t maxQueued;
+    uint64_t replayedUs;
+};
+
+ReplayStats stats;
+
+void report(const char* what, unsigned coins) {
+    if (verbose) {
+        const QueuedCoin& coin = coinQueueFront(coinQueue);
+        printf("%12.3f  %-8s %u coin%s, first sensed at %.3f, blocked %u ms\n", nowUs / 1e6, what, coins,
+               coins == 1 ? "" : "s", coin.sensedAt / 1e3, (unsigned)coin.blockTimeMs);
+    }
+}
+
+void postWindowClosed(uint32_t) {
+    postTimerEvent(EVENT_WINDOW_CLOSED);
+}
+
+void postPhotosDone(uint32_t) {
+    postTimerEvent(EVENT_PHOTOS_DONE);
+}
+
+void chuteCheckAction(uint32_t) {
+    if (sensorState.blockStart != 0) {
+        scheduleAfter(CHUTE_POLL_INTERVAL, chuteCheckAction, 0);
+    } else {
+        postTimerEvent(EVENT_CHUTE_CLEAR);
+    }
+}
+
+// State actions and guards declared by state_table.h, doing what the
+// firmware's do to the coin queue and the timers
+void enterWaitingForCoin() {}
+void enterProcessing() {}
+void handlePhotographing() {}
+void handleErrorState() {}
+
+void enterCoinDetected() {
+    scheduleAfter(detectionWindowRemaining(coinQueue, nowMs()), postWindowClosed, 0);
+}
+
+void exitCoinDetected() {
+    cancelTimerAction(postWindowClosed);
+}
+
+void acceptCoin() {
+    report("accept", 1);
+    stats.accepted++;
+    coinQueueDrop(coinQueue, 1);
+}
+
+void rejectMultipleCoins() {
+    uint8_t coins = coinsInWindow(coinQueue);
+    report("reject", coins);
+    stats.rejects++;
+    stats.coinsRejected += coins;
+    coinQueueDrop(coinQueue, coins);
+}
+
+void rejectStorageFull() {
+    coinQueueDrop(coinQueue, 1);
+}
+
+void enterPhotographing() {
+    scheduleAfter(photoMs, postPhotosDone, 0);
+}
+
+void failWithTimeout() {
+    if (verbose) {
+        printf("%12.3f  timeout  photography ran past %u ms\n", nowUs / 1e6, (unsigned)PROCESSING_TIMEOUT);
+    }
+    stats.timeouts++;
+    cancelTimerAction(postPhotosDone);
+}
+
+void enterRejecting() {
+    scheduleAfter(TRAPDOOR_DROP_TIME, chuteCheckAction, 0);
+}
+
+void exitRejecting() {
+    cancelTimerAction(chuteCheckAction);
+}
+
+void enterError() {}
+
+void systemReset() {
+    coinQueueClear(coinQueue);
+}
+
+bool isMultipleCoinDetected() {
+    return multipleCoinsInWindow(coinQueue);
+}
+
+bool hasQueuedCoin() {
+    return coinQueueCount(coinQueue) > 0;
+}
+
+bool isStorageFull() {
+    return false;
+}
+
+// One pass of the firmware's loop()
+void loopPass() {
+    uint32_t now = nowMs();
+    if (hasQueuedCoin()) {
+        stateMachine.dispatch(EVENT_COIN_SENSED, now);
+    }
+    for (size_t i = 0; i < timerEvents.size(); i++) {
+        stateMachine.dispatch(timerEvents[i], now);
+    }
+    timerEvents.clear();
+    stateMachine.update(now);
+}
+
+// ==================== REPLAY ====================
+void replayBoot(const Boot& edges) {
+    uint32_t allocationsBefore = allocationsSoFar();
+    coinQueue = CoinQueue();
+    sensorState = SensorState();
+    timers.clear();
+    timerEvents.clear();
+    nowUs = 0;
+    stateMachine.begin(COIN_MACHINE_STATES, COIN_MACHINE_TRANSITIONS, NUM_COIN_MACHINE_TRANSITIONS,
+                       STATE_INIT, EVENT_TIMEOUT, 0);
+    stateMachine.dispatch(EVENT_START, 0);
+
+    size_t next = 0;
+    for (;;) {
+        // Jump to whatever happens first: an edge, a timer or a state timeout
+        const uint64_t never = ~0ULL;
+        uint64_t due = next < edges.size() ? edges[next].timeUs : never;
+        int timer = nextTimer();
+        if (timer >= 0 && timers[timer].dueUs < due) {
+            due = timers[timer].dueUs;
+        }
+        unsigned long untilTimeout = stateMachine.timeUntilTimeout(nowMs());
+        if (untilTimeout != (unsigned long)-1) {
+            uint64_t timeoutUs = (nowUs / 1000 + untilTimeout) * 1000;
+            if (timeoutUs < due) {
+                due = timeoutUs;
+            }
+        }
+        if (due == never) {
+            break;
+        }
+        if (due > nowUs) {
+            nowUs = due;
+        }
+
+        while (next < edges.size() && edges[next].timeUs <= nowUs) {
+            if (sensorEdge(sensorState, coinQueue, edges[next].blocked, nowMs())) {
+                stats.coinsSensed++;
+            }
+            next++;
+        }
+        if (coinQueueCount(coinQueue) > stats.maxQueued) {
+            stats.maxQueued = coinQueueCount(coinQueue);
+        }
+        runDueTimers();
+        loopPass();
+    }
+
+    stats.boots++;
+    stats.edges += edges.size();
+    stats.queueDrops += coinQueue.dropped;
+    stats.leftQueued += coinQueueCount(coinQueue);
+    stats.replayedUs += nowUs;
+    stats.allocations += allocationsSoFar() - allocationsBefore;
+}
+
+// Edges from an 'edges dump' capture, one vector per boot
+bool readCapture(const char* path, std::vector<Boot>& boots) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    char line[128];
+    uint32_t lastRaw = 0;
+    uint64_t wraps = 0;
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long us;
+        unsigned level;
+        if (line[0] == 'B' && (line[1] == '\n' || line[1] == '\r' || line[1] == '\0')) {
+            boots.push_back(Boot());
+            lastRaw = 0;
+            wraps = 0;
+        } else if (sscanf(line, "E %lu %u", &us, &level) == 2) {
+            if (boots.empty()) {
+                boots.push_back(Boot());
+            }
+            // micros() wraps every 71 minutes
+            if ((uint32_t)us < lastRaw) {
+                wraps += 1ULL << 32;
+            }
+            lastRaw = (uint32_t)us;
+            Edge edge = {wraps + (uint32_t)us, level == SENSOR_EDGE_BLOCKED};
+            boots.back().push_back(edge);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc) {
+            photoMs = (uint32_t)atol(argv[++arg]);
+        } else {
+            break;
+        }
+    }
+    if (arg >= argc) {
+        fprintf(stderr, "usage: %s [-p photo_ms] [-v] capture.log ...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<Boot> boots;
+    for (; arg < argc; arg++) {
+        if (!readCapture(argv[arg], boots)) {
+            return 1;
+        }
+    }
+    if (boots.empty()) {
+        fprintf(stderr, "no sensor edges found\n");
+        return 1;
+    }
+
+    timers.reserve(REPLAY_MAX_TIMERS);
+    timerEvents.reserve(REPLAY_MAX_TIMERS);
+    // First use of stdout allocates its buffer
+    fflush(stdout);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t b = 0; b < boots.size(); b++) {
+        if (verbose) {
+            printf("--- boot %zu: %zu edges\n", b + 1, boots[b].size());
+        }
+        replayBoot(boots[b]);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double wallMs = std::chrono::duration<double, std::milli>(end - start).count();
+
+    printf("Window %u ms, threshold %u coins, debounce %u ms, photos %u ms\n",
+           (unsigned)MULTI_COIN_TIMEOUT, (unsigned)MULTI_COIN_THRESHOLD,
+           (unsigned)SENSOR_DEBOUNCE_TIME, (unsigned)photoMs);
+    printf("Boots: %lu, edges: %lu, coins sensed: %lu\n", stats.boots, stats.edges, stats.coinsSensed);
+    printf("Accepted: %lu\n", stats.accepted);
+    printf("Rejected: %lu coins in %lu cycles\n", stats.coinsRejected, stats.rejects);
+    printf("Photo timeouts: %lu\n", stats.timeouts);
+    printf("Queue: %u at most, %lu lost full, %lu left at the end\n",
+           (unsigned)stats.maxQueued, stats.queueDrops, stats.leftQueued);
+    printf("Replayed %.1f s in %.1f ms (%.0fx real time)\n", stats.replayedUs / 1e6, wallMs,
+           wallMs > 0 ? stats.replayedUs / 1e3 / wallMs : 0.0);
+#ifdef ALLOC_COUNTER_WRAP
+    printf("Heap allocations during replay: %lu\n", stats.allocations);
+    if (stats.allocations > 0) {
+        fprintf(stderr, "coin cycles allocated from the heap\n");
+        return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,287 @@
+#!/usr/bin/env python3
+"""
+Collect binary telemetry frames from many coin machines into time series.
+
+Each unit sends a TelemetryFrame (see telemetry.h) every TELEMETRY_INTERVAL
+and after every coin, over serial between its text output and/or by UDP.
+Frames are found by their sync bytes and checked by CRC, so the text lines
+on a serial port are skipped. Counters and histograms in a frame are totals
+since boot; this works out rates and per-interval percentiles from the
+difference to the unit's previous frame, notices reboots and lost frames,
+and appends one CSV row per frame to <out>/unit_<id>.csv.
+
+Usage: telemetry_collector.py [--serial /dev/ttyUSB0 ...] [--udp 5005]
+                              [--file capture.bin ...] [--out telemetry]
+Serial ports need pyserial (pip install pyserial).
+"""
+
+import argparse
+import csv
+import os
+import queue
+import socket
+import struct
+import sys
+import threading
+import time
+
+FRAME = struct.Struct("<BBBBIIIBBBBhH11IBBBB16H16H16HH")
+SYNC = b"\xc5\x7e"
+VERSION = 1
+HIST_BUCKETS = 16
+
+FIELDS = [
+    "sync0", "sync1", "version", "length", "unit_id", "sequence", "uptime_ms",
+    "reason", "state", "last_error", "storage_fill_pct", "temperature_dc", "error_count",
+    "coins_sensed", "coins_photographed", "coins_rejected", "coins_stored",
+    "storage_free_bytes", "free_heap", "largest_free_block", "log_dropped",
+    "queue_drops", "record_write_failures", "max_loop_pass_us",
+    "last_denomination", "last_confidence", "photo_plan", "jpeg_quality",
+]
+HISTOGRAMS = ["loop_pass_us", "image_write_ms", "coin_cycle_ms"]
+
+# In the firmware's enum order (config.h, coin_classifier.h)
+STATES = ["INIT", "WAITING_FOR_COIN", "COIN_DETECTED", "PROCESSING",
+          "PHOTOGRAPHING", "REJECTING", "ERROR"]
+ERRORS = ["OK", "MULTIPLE_COINS", "COIN_DURING_PROCESSING", "CAMERA_ERROR",
+          "STORAGE_ERROR", "TIMEOUT_ERROR"]
+DENOMINATIONS = ["PENNY", "NICKEL", "DIME", "QUARTER", "HALF_DOLLAR", "DOLLAR", "UNKNOWN"]
+REASONS = ["periodic", "coin"]
+
+COLUMNS = ["host_time", "unit_id", "sequence", "uptime_s", "reason", "state", "last_error",
+           "storage_fill_pct", "temperature_c", "error_count", "coins_sensed",
+           "coins_photographed", "coins_rejected", "coins_stored", "coins_per_min",
+           "free_heap", "largest_free_block", "log_dropped", "queue_drops",
+           "record_write_failures", "max_loop_pass_us", "last_denomination",
+           "last_confidence", "photo_plan", "jpeg_quality", "lost_frames", "rebooted"]
+for name in HISTOGRAMS:
+    COLUMNS += [name + "_count", name + "_p50", name + "_p95"]
+
+
+def name_of(names, value):
+    return names[value] if value < len(names) else value
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE, as telemetryCrc() in telemetry.h."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def decode(raw):
+    values = FRAME.unpack(raw)
+    frame = dict(zip(FIELDS, values[:len(FIELDS)]))
+    rest = values[len(FIELDS):]
+    for i, name in enumerate(HISTOGRAMS):
+        frame[name] = list(rest[i * HIST_BUCKETS:(i + 1) * HIST_BUCKETS])
+    frame["crc"] = rest[-1]
+    return frame
+
+
+class FrameScanner:
+    """Pulls valid frames out of a byte stream that also carries text."""
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.bad_frames = 0
+
+    def feed(self, data):
+        self.buffer += data
+        frames = []
+        while True:
+            start = self.buffer.find(SYNC)
+            if start < 0:
+                # Keep a trailing first sync byte; the second may be on its way
+                del self.buffer[:max(0, len(self.buffer) - 1)]
+                return frames
+            del self.buffer[:start]
+            if len(self.buffer) < 4:
+                return frames
+            if self.buffer[2] != VERSION or self.buffer[3] != FRAME.size:
+                del self.buffer[:1]
+                continue
+            if len(self.buffer) < FRAME.size:
+                return frames
+            raw = bytes(self.buffer[:FRAME.size])
+            if crc16(raw[:-2]) != struct.unpack_from("<H", raw, FRAME.size - 2)[0]:
+                self.bad_frames += 1
+                del self.buffer[:1]
+                continue
+            frames.append(decode(raw))
+            del self.buffer[:FRAME.size]
+
+
+def bucket_value(bucket):
+    """Upper bound of a power-of-two histogram bucket."""
+    return 0 if bucket == 0 else (1 << bucket) - 1
+
+
+def percentile(counts, fraction):
+    total = sum(counts)
+    if total == 0:
+        return ""
+    target = fraction * total
+    seen = 0
+    for bucket, count in enumerate(counts):
+        seen += count
+        if seen >= target:
+            return bucket_value(bucket)
+    return bucket_value(len(counts) - 1)
+
+
+class Unit:
+    """One machine's previous frame and its CSV file."""
+
+    def __init__(self, unit_id, out_dir):
+        self.unit_id = unit_id
+        self.last = None
+        self.frames = 0
+        self.lost = 0
+        self.reboots = 0
+        path = os.path.join(out_dir, "unit_%08x.csv" % unit_id)
+        new_file = not os.path.exists(path)
+        self.file = open(path, "a", newline="")
+        self.writer = csv.writer(self.file)
+        if new_file:
+            self.writer.writerow(COLUMNS)
+
+    def add(self, frame, host_time):
+        last = self.last
+        rebooted = last is not None and (frame["sequence"] < last["sequence"] or
+                                         frame["uptime_ms"] < last["uptime_ms"])
+        if last is None or rebooted:
+            # Totals since boot are the interval's values
+            lost = frame["sequence"] if rebooted else 0
+            last = dict(frame, uptime_ms=0, coins_photographed=0, coins_rejected=0,
+                        **{name: [0] * HIST_BUCKETS for name in HISTOGRAMS})
+            self.reboots += rebooted
+        else:
+            lost = max(0, frame["sequence"] - last["sequence"] - 1)
+        self.lost += lost
+        self.frames += 1
+
+        minutes = (frame["uptime_ms"] - last["uptime_ms"]) / 60000.0
+        coins = (frame["coins_photographed"] - last["coins_photographed"] +
+                 frame["coins_rejected"] - last["coins_rejected"])
+        row = [
+            "%.3f" % host_time, "%08x" % frame["unit_id"], frame["sequence"],
+            "%.1f" % (frame["uptime_ms"] / 1000.0), name_of(REASONS, frame["reason"]),
+            name_of(STATES, frame["state"]), name_of(ERRORS, frame["last_error"]),
+            frame["storage_fill_pct"], "%.1f" % (frame["temperature_dc"] / 10.0), frame["error_count"],
+            frame["coins_sensed"], frame["coins_photographed"], frame["coins_rejected"], frame["coins_stored"],
+            "%.2f" % (coins / minutes) if minutes > 0 else "",
+            frame["free_heap"], frame["largest_free_block"], frame["log_dropped"], frame["queue_drops"],
+            frame["record_write_failures"], frame["max_loop_pass_us"],
+            name_of(DENOMINATIONS, frame["last_denomination"]),
+            frame["last_confidence"], frame["photo_plan"], frame["jpeg_quality"],
+            lost, int(rebooted),
+        ]
+        for name in HISTOGRAMS:
+            # Counts wrap at 65536 on the device
+            delta = [(now - before) & 0xFFFF for now, before in zip(frame[name], last[name])]
+            row += [sum(delta), percentile(delta, 0.5), percentile(delta, 0.95)]
+        self.writer.writerow(row)
+        self.file.flush()
+        self.last = frame
+
+    def summary(self):
+        frame = self.last
+        return ("unit %08x: %d frames (%d lost, %d reboots), %s, %d photographed, %d rejected, "
+                "heap %d (block %d), storage %d%%" % (
+                    self.unit_id, self.frames, self.lost, self.reboots, name_of(STATES, frame["state"]),
+                    frame["coins_photographed"], frame["coins_rejected"],
+                    frame["free_heap"], frame["largest_free_block"], frame["storage_fill_pct"]))
+
+
+def read_serial(port, baud, chunks):
+    import serial
+    with serial.Serial(port, baud, timeout=0.5) as link:
+        while True:
+            data = link.read(4096)
+            if data:
+                chunks.put((port, data))
+
+
+def read_udp(port, chunks):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", port))
+    while True:
+        data, address = sock.recvfrom(2048)
+        # Datagrams are whole frames; keep each sender's stream apart anyway
+        chunks.put(("udp:%s" % address[0], data))
+
+
+def read_file(path, chunks):
+    with open(path, "rb") as f:
+        chunks.put((path, f.read()))
+    chunks.put((path, None))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--serial", action="append", default=[], metavar="PORT[:BAUD]")
+    parser.add_argument("--udp", type=int, metavar="PORT", help="Listen for frames on this UDP port")
+    parser.add_argument("--file", action="append", default=[], help="Decode a saved serial capture")
+    parser.add_argument("--out", default="telemetry", help="Directory for the per-unit CSV files")
+    parser.add_argument("--summary", type=float, default=60, help="Seconds between summaries")
+    args = parser.parse_args()
+    if not (args.serial or args.udp or args.file):
+        parser.error("give at least one --serial, --udp or --file source")
+    os.makedirs(args.out, exist_ok=True)
+
+    chunks = queue.Queue()
+    readers = []
+    for spec in args.serial:
+        port, _, baud = spec.partition(":")
+        readers.append(threading.Thread(target=read_serial, args=(port, int(baud or 115200), chunks)))
+    if args.udp:
+        readers.append(threading.Thread(target=read_udp, args=(args.udp, chunks)))
+    for path in args.file:
+        readers.append(threading.Thread(target=read_file, args=(path, chunks)))
+    for reader in readers:
+        reader.daemon = True
+        reader.start()
+
+    scanners = {}
+    units = {}
+    files_left = len(args.file)
+    live = bool(args.serial or args.udp)
+    next_summary = time.time() + args.summary
+    try:
+        while live or files_left:
+            try:
+                source, data = chunks.get(timeout=1)
+            except queue.Empty:
+                data = b""
+                source = None
+            if source is not None and data is None:
+                files_left -= 1
+                continue
+            if data:
+                scanner = scanners.setdefault(source, FrameScanner())
+                for frame in scanner.feed(data):
+                    unit = units.get(frame["unit_id"])
+                    if unit is None:
+                        unit = units[frame["unit_id"]] = Unit(frame["unit_id"], args.out)
+                    unit.add(frame, time.time())
+            if live and time.time() >= next_summary:
+                next_summary += args.summary
+                for unit in units.values():
+                    print(unit.summary())
+    except KeyboardInterrupt:
+        pass
+
+    for unit in units.values():
+        print(unit.summary())
+    bad = sum(scanner.bad_frames for scanner in scanners.values())
+    if bad:
+        print("%d frames failed their CRC" % bad, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
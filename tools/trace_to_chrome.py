@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""
+Convert a firmware trace dump into Chrome trace-event JSON.
+
+The 'trace' command, a photo timeout or an ERROR (see TRACE_DUMP_ON_ERROR)
+prints the trace ring between "=== Trace" and "=== End trace ===" lines.
+Save the serial output, run this on it and open the JSON in
+chrome://tracing or https://ui.perfetto.dev. Each core is a track, with
+the state machine's states as spans on a track of their own. Events are
+stamped with their core's cycle counter; the sync events each core
+records every TRACE_SYNC_INTERVAL turn those into microseconds.
+
+Usage: trace_to_chrome.py capture.log [-o trace.json] [--dump N]
+"""
+
+import argparse
+import json
+import sys
+from collections import defaultdict
+
+STATE_TID = 2
+
+
+def parse_dumps(path):
+    """Every dump in the file as (header, events), oldest dump first."""
+    with open(path, "rb") as f:
+        # Telemetry frames may sit between the lines
+        lines = f.read().decode("latin-1").splitlines()
+    dumps = []
+    current = None
+    for line in lines:
+        line = line.strip()
+        if line.startswith("=== Trace:"):
+            current = (line.strip("= "), [])
+        elif line.startswith("=== End trace") and current is not None:
+            dumps.append(current)
+            current = None
+        elif current is not None and line.startswith("T "):
+            fields = line.split()
+            if len(fields) < 6:
+                continue
+            args = {}
+            for field in fields[6:]:
+                key, _, value = field.partition("=")
+                args[key] = int(value) if value.isdigit() else value
+            current[1].append({
+                "seq": int(fields[1]), "core": int(fields[2]), "cycles": int(fields[3]),
+                "phase": fields[4], "name": fields[5], "args": args,
+            })
+    return dumps
+
+
+def cpu_mhz(header):
+    for part in header.split(","):
+        part = part.strip()
+        if part.endswith("MHz"):
+            return int(part.split()[0])
+    return 240
+
+
+def signed32(value):
+    value &= 0xFFFFFFFF
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def add_timestamps(events, mhz):
+    """Set each event's "ts" (us) from the nearest sync on its core."""
+    # esp_timer's microseconds are sent as 32 bits; unwrap them in order
+    offset = 0
+    last_us = None
+    syncs = defaultdict(list)
+    for event in events:
+        if event["name"] != "sync":
+            continue
+        us = event["args"]["us"]
+        if last_us is not None and us + offset < last_us - (1 << 31):
+            offset += 1 << 32
+        last_us = us + offset
+        syncs[event["core"]].append((event["seq"], event["cycles"], last_us))
+
+    unplaced = 0
+    for event in events:
+        anchors = syncs.get(event["core"])
+        if not anchors:
+            unplaced += 1
+            continue
+        # The last sync before the event, else the first one after it
+        anchor = anchors[0]
+        for sync in anchors:
+            if sync[0] > event["seq"]:
+                break
+            anchor = sync
+        event["ts"] = anchor[2] + signed32(event["cycles"] - anchor[1]) / mhz
+    return unplaced
+
+
+def to_chrome(events):
+    """Trace events, and each span's durations by name for the summary."""
+    placed = [e for e in events if "ts" in e]
+    start = min((e["ts"] for e in placed), default=0)
+    end = max((e["ts"] for e in placed), default=0) - start
+    out = [{"ph": "M", "name": "thread_name", "pid": 1, "tid": STATE_TID, "args": {"name": "state"}}]
+    cores = sorted({e["core"] for e in placed})
+    for core in cores:
+        out.append({"ph": "M", "name": "thread_name", "pid": 1, "tid": core,
+                    "args": {"name": "core %d" % core}})
+
+    open_spans = defaultdict(list)    # (tid, name) -> begin times
+    durations = defaultdict(list)
+    state = None
+    for event in placed:
+        ts = event["ts"] - start
+        name = event["name"]
+        tid = event["core"]
+        if name == "sync":
+            continue
+        if name == "state":
+            if state is not None:
+                out.append({"ph": "E", "name": state, "pid": 1, "tid": STATE_TID, "ts": ts})
+                durations["state " + state].append(ts - state_start)
+            state = event["args"]["to"]
+            state_start = ts
+            out.append({"ph": "B", "name": state, "pid": 1, "tid": STATE_TID, "ts": ts,
+                        "args": event["args"]})
+            continue
+        phase = event["phase"]
+        if phase == "E":
+            # The ring may start part way through a span
+            begins = open_spans[(tid, name)]
+            if not begins:
+                continue
+            durations[name].append(ts - begins.pop())
+        elif phase == "B":
+            open_spans[(tid, name)].append(ts)
+        record = {"ph": phase, "name": name, "pid": 1, "tid": tid, "ts": ts, "args": event["args"]}
+        if phase == "i":
+            record["s"] = "t"
+        out.append(record)
+
+    # Spans still open when the ring was dumped, e.g. a timed out photo sequence
+    for (tid, name), begins in open_spans.items():
+        for _ in begins:
+            out.append({"ph": "E", "name": name, "pid": 1, "tid": tid, "ts": end,
+                        "args": {"unfinished": True}})
+    if state is not None:
+        out.append({"ph": "E", "name": state, "pid": 1, "tid": STATE_TID, "ts": end})
+    return out, durations
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("capture", help="Serial output holding one or more trace dumps")
+    parser.add_argument("-o", "--output", default="trace.json")
+    parser.add_argument("--dump", type=int, default=-1, help="Which dump to convert (default: the last)")
+    args = parser.parse_args()
+
+    dumps = parse_dumps(args.capture)
+    if not dumps:
+        sys.exit("no trace dump in %s" % args.capture)
+    try:
+        header, events = dumps[args.dump]
+    except IndexError:
+        sys.exit("%s holds %d dumps" % (args.capture, len(dumps)))
+
+    unplaced = add_timestamps(events, cpu_mhz(header))
+    trace, durations = to_chrome(events)
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": trace, "displayTimeUnit": "ms"}, f)
+
+    print("%s: %d of %d dumps, %s" % (args.capture, args.dump % len(dumps) + 1, len(dumps), header))
+    if unplaced:
+        print("%d events from a core without a sync were left out" % unplaced, file=sys.stderr)
+    print("%-28s %6s %10s %10s %10s" % ("span", "count", "total_ms", "mean_ms", "max_ms"))
+    for name, spans in sorted(durations.items(), key=lambda item: -sum(item[1])):
+        print("%-28s %6d %10.2f %10.2f %10.2f" % (name, len(spans), sum(spans) / 1000.0,
+                                                  sum(spans) / len(spans) / 1000.0, max(spans) / 1000.0))
+    print("Wrote %s" % args.output)
+
+
+if __name__ == "__main__":
+    main()
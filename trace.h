@@ -0,0 +1,102 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Flight recorder. TRACE() stamps an event with the CPU cycle counter and
+// stores it in a ring that overwrites its oldest entries, so the lead-up to
+// a reject, timeout or fault is still there when someone asks (see TRACE in
+// hardware_functions.h). Unlike the event log nothing is formatted or
+// printed until the ring is dumped. tools/trace_to_chrome.py turns a dump
+// into a Chrome trace-event timeline. Kept free of Arduino dependencies.
+//
+// Cycle counters are per core and wrap every few seconds, so each core
+// records a TRACE_SYNC with esp_timer's microseconds every
+// TRACE_SYNC_INTERVAL; the tool places every event relative to the last
+// sync on its core.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+
+// Timeline phases, as in the Chrome trace-event format
+#define TRACE_INSTANT         'i'
+#define TRACE_BEGIN           'B'
+#define TRACE_END             'E'
+
+enum TraceId : uint8_t {
+    TRACE_SYNC,
+    TRACE_STATE,
+    TRACE_SENSOR_EDGE,
+    TRACE_FLIPPER_MOVE,
+    TRACE_TRAPDOOR_MOVE,
+    TRACE_PHOTOS_BEGIN,
+    TRACE_PHOTOS_END,
+    TRACE_SETTLE_BEGIN,
+    TRACE_SETTLE_END,
+    TRACE_CAPTURE_BEGIN,
+    TRACE_FRAMES_FLUSHED,
+    TRACE_FRAME_READY,
+    TRACE_CAPTURE_END,
+    TRACE_WRITE_BEGIN,
+    TRACE_WRITE_END,
+    TRACE_CLASSIFY_BEGIN,
+    TRACE_CLASSIFY_END,
+    TRACE_ID_COUNT
+};
+
+struct TraceEvent {
+    uint32_t cycles;              // Cycle counter of the recording core
+    uint32_t arg;
+    uint16_t arg2;
+    uint8_t id;                   // TraceId
+    uint8_t core;
+};
+
+struct TraceKind {
+    uint8_t id;                   // Must equal the entry's index
+    char phase;                   // TRACE_INSTANT, TRACE_BEGIN or TRACE_END
+    const char* name;             // A BEGIN and its END share the name
+    const char* arg;              // What arg holds, for the timeline
+    const char* arg2;             // NULL if unused
+};
+
+constexpr TraceKind TRACE_KINDS[] = {
+    {TRACE_SYNC,           TRACE_INSTANT, "sync",     "us",        NULL},
+    {TRACE_STATE,          TRACE_INSTANT, "state",    "to",        "from"},
+    {TRACE_SENSOR_EDGE,    TRACE_INSTANT, "sensor",   "level",     NULL},
+    {TRACE_FLIPPER_MOVE,   TRACE_INSTANT, "flipper",  "angle",     NULL},
+    {TRACE_TRAPDOOR_MOVE,  TRACE_INSTANT, "trapdoor", "angle",     NULL},
+    {TRACE_PHOTOS_BEGIN,   TRACE_BEGIN,   "photos",   "coin",      NULL},
+    {TRACE_PHOTOS_END,     TRACE_END,     "photos",   "coin",      NULL},
+    {TRACE_SETTLE_BEGIN,   TRACE_BEGIN,   "settle",   "shot",      "policy"},
+    {TRACE_SETTLE_END,     TRACE_END,     "settle",   "ms",        NULL},
+    {TRACE_CAPTURE_BEGIN,  TRACE_BEGIN,   "capture",  "shot",      "lights"},
+    {TRACE_FRAMES_FLUSHED, TRACE_INSTANT, "flushed",  "frames",    NULL},
+    {TRACE_FRAME_READY,    TRACE_INSTANT, "frame",    "bytes",     NULL},
+    {TRACE_CAPTURE_END,    TRACE_END,     "capture",  "ok",        NULL},
+    {TRACE_WRITE_BEGIN,    TRACE_BEGIN,   "write",    "bytes",     NULL},
+    {TRACE_WRITE_END,      TRACE_END,     "write",    "written",   NULL},
+    {TRACE_CLASSIFY_BEGIN, TRACE_BEGIN,   "classify", "coin",      NULL},
+    {TRACE_CLASSIFY_END,   TRACE_END,     "classify", "confidence", "denomination"}
+};
+
+// ==================== STATIC CHECKS ====================
+template<size_t N>
+constexpr bool traceKindsIndexed(const TraceKind (&kinds)[N], size_t i = 0) {
+    return i >= N || (kinds[i].id == i && traceKindsIndexed(kinds, i + 1));
+}
+
+static_assert(sizeof(TRACE_KINDS) / sizeof(TRACE_KINDS[0]) == TRACE_ID_COUNT,
+              "Every TraceId needs a row in TRACE_KINDS");
+static_assert(traceKindsIndexed(TRACE_KINDS), "TRACE_KINDS must be in TraceId order");
+static_assert(sizeof(TraceEvent) == 12, "TraceEvent should stay three words");
+
+// Record an event unless tracing is compiled out; the arguments are then
+// not evaluated either
+#define TRACE(id, ...) \
+    do { \
+        if (TRACE_ENABLED) { \
+            traceEvent(id, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif // TRACE_H